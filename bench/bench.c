@@ -0,0 +1,256 @@
+#include "yamalloc.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The same workloads run against the C library when BENCH_LIBC is defined
+#ifdef BENCH_LIBC
+#define yamalloc malloc
+#define yacalloc calloc
+#define yarealloc realloc
+#define yafree free
+#define BENCH_ALLOCATOR "libc"
+#elif defined(YAMALLOC_LINKED_LIST)
+#define BENCH_ALLOCATOR "linked_list"
+#elif defined(YAMALLOC_FREE_LIST_LL_FIND_BEST)
+#define BENCH_ALLOCATOR "free_list_ll/best"
+#elif defined(YAMALLOC_FREE_LIST_LL)
+#define BENCH_ALLOCATOR "free_list_ll/first"
+#endif
+
+#define BENCH_DEFAULT_OPS 200000
+// Objects alive at once in the churn workloads
+#define BENCH_SLOTS 1024
+#define BENCH_MAX_SIZE (64 * 1024)
+
+typedef struct Bench {
+	const char *workload;
+	// Latency of each call, in nanoseconds, when timing is set
+	uint32_t *latencies;
+	size_t ops;
+	size_t max_ops;
+	int timing;
+	uint64_t random_state;
+	void *slots[BENCH_SLOTS];
+} Bench;
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t bench_random(Bench *bench)
+{
+	// xorshift64*, reseeded by every run so that both passes match
+	uint64_t x = bench->random_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	bench->random_state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Sizes from a Pareto distribution (alpha = 1.2) starting at 16 bytes
+static size_t bench_power_law_size(Bench *bench)
+{
+	double u = ((double)(bench_random(bench) >> 11) + 1.0) /
+		   9007199254740993.0;
+	double size = 16.0 / pow(u, 1.0 / 1.2);
+
+	return size > BENCH_MAX_SIZE ? BENCH_MAX_SIZE : (size_t)size;
+}
+
+// Runs one allocator call, timing it in the latency pass
+#define BENCH_CALL(bench, call)                                                \
+	do {                                                                   \
+		if ((bench)->timing) {                                         \
+			uint64_t start_ = bench_now();                         \
+			call;                                                  \
+			(bench)->latencies[(bench)->ops] =                     \
+			    (uint32_t)(bench_now() - start_);                  \
+		} else {                                                       \
+			call;                                                  \
+		}                                                              \
+		(bench)->ops++;                                                \
+	} while (0)
+
+static void bench_free_slots(Bench *bench)
+{
+	for (size_t i = 0; i < BENCH_SLOTS; i++) {
+		if (bench->slots[i]) {
+			BENCH_CALL(bench, yafree(bench->slots[i]));
+			bench->slots[i] = NULL;
+		}
+	}
+}
+
+// Replaces the objects of a fixed set of slots, all of the same size
+static void bench_fixed_churn(Bench *bench)
+{
+	while (bench->ops + 2 * BENCH_SLOTS <= bench->max_ops) {
+		size_t i = (size_t)(bench_random(bench) % BENCH_SLOTS);
+		if (bench->slots[i]) {
+			BENCH_CALL(bench, yafree(bench->slots[i]));
+		}
+		BENCH_CALL(bench, bench->slots[i] = yamalloc(64));
+	}
+	bench_free_slots(bench);
+}
+
+// Replaces random slots with objects of power-law distributed sizes
+static void bench_power_law(Bench *bench)
+{
+	while (bench->ops + 2 * BENCH_SLOTS <= bench->max_ops) {
+		size_t i = (size_t)(bench_random(bench) % BENCH_SLOTS);
+		size_t size = bench_power_law_size(bench);
+		if (bench->slots[i]) {
+			BENCH_CALL(bench, yafree(bench->slots[i]));
+		}
+		BENCH_CALL(bench, bench->slots[i] = yamalloc(size));
+	}
+	bench_free_slots(bench);
+}
+
+// Fills every slot, then frees them in reverse (lifo) or same order
+static void bench_batch(Bench *bench, int lifo)
+{
+	while (bench->ops + 2 * BENCH_SLOTS <= bench->max_ops) {
+		for (size_t i = 0; i < BENCH_SLOTS; i++) {
+			size_t size = 16 + (size_t)(bench_random(bench) % 497);
+			BENCH_CALL(bench, bench->slots[i] = yamalloc(size));
+		}
+		for (size_t i = 0; i < BENCH_SLOTS; i++) {
+			size_t j = lifo ? BENCH_SLOTS - 1 - i : i;
+			BENCH_CALL(bench, yafree(bench->slots[j]));
+			bench->slots[j] = NULL;
+		}
+	}
+}
+
+static void bench_lifo(Bench *bench) { bench_batch(bench, 1); }
+
+static void bench_fifo(Bench *bench) { bench_batch(bench, 0); }
+
+// Grows buffers by half of their size at a time, as a vector would
+static void bench_realloc_growth(Bench *bench)
+{
+	while (bench->ops + 64 <= bench->max_ops) {
+		void *ptr = NULL;
+		for (size_t size = 16; size <= 1024 * 1024;
+		     size += size / 2) {
+			BENCH_CALL(bench, ptr = yarealloc(ptr, size));
+		}
+		BENCH_CALL(bench, yafree(ptr));
+	}
+}
+
+// Zeroed buffers from 64 KB to 1 MB, freed at once
+static void bench_calloc_large(Bench *bench)
+{
+	while (bench->ops + 2 <= bench->max_ops / 16) {
+		size_t size = 64 * 1024 +
+			      (size_t)(bench_random(bench) % (960 * 1024));
+		void *ptr = NULL;
+		BENCH_CALL(bench, ptr = yacalloc(1, size));
+		BENCH_CALL(bench, yafree(ptr));
+	}
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t bench_percentile(const Bench *bench, double p)
+{
+	size_t index = (size_t)(p * (double)(bench->ops - 1));
+
+	return bench->latencies[index];
+}
+
+/**
+ * @brief Runs a workload twice and prints its results as a JSON line
+ *
+ * The first pass measures the throughput without timers; the second one
+ * replays the same calls and times each of them.
+ *
+ * @param[in, out] bench Benchmark state
+ * @param[in] name Name of the workload
+ * @param[in] workload Workload to run
+ * @return void
+ */
+static void bench_run(Bench *bench, const char *name,
+		      void (*workload)(Bench *))
+{
+	uint64_t start;
+	double seconds;
+
+	bench->workload = name;
+	bench->ops = 0;
+	bench->timing = 0;
+	bench->random_state = 0x9E3779B97F4A7C15ULL;
+	start = bench_now();
+	workload(bench);
+	seconds = (double)(bench_now() - start) / 1e9;
+
+	bench->ops = 0;
+	bench->timing = 1;
+	bench->random_state = 0x9E3779B97F4A7C15ULL;
+	workload(bench);
+	qsort(bench->latencies, bench->ops, sizeof(uint32_t), bench_compare);
+
+	printf("{\"allocator\":\"%s\",\"thread_safe\":%d,\"page_map\":%d,"
+	       "\"workload\":\"%s\",\"ops\":%zu,\"ops_per_sec\":%.0f,"
+	       "\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u}\n",
+	       BENCH_ALLOCATOR,
+#if defined(YAMALLOC_THREAD_SAFE) && !defined(BENCH_LIBC)
+	       1,
+#else
+	       0,
+#endif
+#if defined(YAMALLOC_PAGE_MAP) && !defined(BENCH_LIBC)
+	       1,
+#else
+	       0,
+#endif
+	       name, bench->ops,
+	       seconds > 0.0 ? (double)bench->ops / seconds : 0.0,
+	       bench_percentile(bench, 0.50), bench_percentile(bench, 0.99),
+	       bench_percentile(bench, 0.999));
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	static Bench bench;
+
+	bench.max_ops = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+	if (bench.max_ops < 4 * BENCH_SLOTS) {
+		bench.max_ops = BENCH_DEFAULT_OPS;
+	}
+	bench.latencies = (uint32_t *)calloc(bench.max_ops, sizeof(uint32_t));
+	if (!bench.latencies) {
+		fprintf(stderr, "bench: out of memory\n");
+		return 1;
+	}
+
+	bench_run(&bench, "fixed_churn", bench_fixed_churn);
+	bench_run(&bench, "power_law", bench_power_law);
+	bench_run(&bench, "lifo", bench_lifo);
+	bench_run(&bench, "fifo", bench_fifo);
+	bench_run(&bench, "realloc_growth", bench_realloc_growth);
+	bench_run(&bench, "calloc_large", bench_calloc_large);
+
+	free(bench.latencies);
+	return 0;
+}
@@ -0,0 +1,394 @@
+#include "yamalloc.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// The same workloads run against the C library when BENCH_LIBC is defined
+#ifdef BENCH_LIBC
+#define yamalloc malloc
+#define yafree free
+#define BENCH_ALLOCATOR "libc"
+#elif defined(YAMALLOC_LINKED_LIST)
+#define BENCH_ALLOCATOR "linked_list"
+#elif defined(YAMALLOC_FREE_LIST_LL_FIND_BEST)
+#define BENCH_ALLOCATOR "free_list_ll/best"
+#elif defined(YAMALLOC_FREE_LIST_LL)
+#define BENCH_ALLOCATOR "free_list_ll/first"
+#endif
+
+#define BENCH_MT_DEFAULT_MS 500
+// Objects held by each slot set of the churn workloads
+#define BENCH_MT_SLOTS 1024
+// Operations between two exchanges of slot sets in the Larson workload
+#define BENCH_MT_ROUND 4096
+// Objects in flight between two threads of the xmalloc workload
+#define BENCH_MT_RING 1024
+#define BENCH_MT_CACHE_LINE 64
+
+typedef struct BenchMtSlots {
+	void *ptr[BENCH_MT_SLOTS];
+	size_t size[BENCH_MT_SLOTS];
+} BenchMtSlots;
+
+// Single producer, single consumer queue of objects to free
+typedef struct BenchMtRing {
+	void *ptr[BENCH_MT_RING];
+	size_t size[BENCH_MT_RING];
+	size_t head __attribute__((aligned(BENCH_MT_CACHE_LINE)));
+	size_t tail __attribute__((aligned(BENCH_MT_CACHE_LINE)));
+} BenchMtRing;
+
+typedef struct BenchMt BenchMt;
+
+typedef struct BenchMtThread {
+	pthread_t thread;
+	BenchMt *bench;
+	size_t index;
+	uint64_t random_state;
+	uint64_t ops;
+	// Bytes allocated minus bytes freed by the thread: objects freed by
+	// another thread make it negative, but the sum over all the threads
+	// is the live size of the heap.
+	int64_t live;
+	BenchMtSlots *slots;
+} __attribute__((aligned(BENCH_MT_CACHE_LINE))) BenchMtThread;
+
+struct BenchMt {
+	size_t threads;
+	int stop;
+	// Slot set left by the last thread that finished a Larson round
+	BenchMtSlots *exchange;
+	BenchMtRing *rings;
+	BenchMtThread *thread;
+};
+
+static uint64_t bench_mt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t bench_mt_random(BenchMtThread *thread)
+{
+	// xorshift64*
+	uint64_t x = thread->random_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	thread->random_state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int bench_mt_stopped(BenchMtThread *thread)
+{
+	return __atomic_load_n(&thread->bench->stop, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Replaces random objects of a slot set
+ *
+ * @param[in, out] thread Running thread
+ * @param[in, out] slots Slot set owned by the thread for this round
+ * @param[in] count Number of objects to replace
+ * @return void
+ */
+static void bench_mt_churn(BenchMtThread *thread, BenchMtSlots *slots,
+			   size_t count)
+{
+	for (size_t n = 0; n < count; n++) {
+		uint64_t r = bench_mt_random(thread);
+		size_t i = (size_t)(r % BENCH_MT_SLOTS);
+		size_t size = 16 + (size_t)((r >> 32) % 1009);
+
+		if (slots->ptr[i]) {
+			yafree(slots->ptr[i]);
+			thread->live -= (int64_t)slots->size[i];
+			thread->ops++;
+		}
+		slots->ptr[i] = yamalloc(size);
+		slots->size[i] = slots->ptr[i] ? size : 0;
+		thread->live += (int64_t)slots->size[i];
+		thread->ops++;
+	}
+}
+
+// Server churn after Larson: the slot sets move from thread to thread, so
+// that most objects are freed by another thread than their allocator.
+static void bench_mt_larson(BenchMtThread *thread)
+{
+	BenchMt *bench = thread->bench;
+
+	while (!bench_mt_stopped(thread)) {
+		bench_mt_churn(thread, thread->slots, BENCH_MT_ROUND);
+		thread->slots = __atomic_exchange_n(
+		    &bench->exchange, thread->slots, __ATOMIC_ACQ_REL);
+	}
+}
+
+// Each thread churns its own slot set
+static void bench_mt_thread_local(BenchMtThread *thread)
+{
+	while (!bench_mt_stopped(thread)) {
+		bench_mt_churn(thread, thread->slots, BENCH_MT_ROUND);
+	}
+}
+
+// Producer and consumer after xmalloc: every thread allocates into its own
+// ring and frees what the previous thread allocated into its ring.
+static void bench_mt_xmalloc(BenchMtThread *thread)
+{
+	BenchMt *bench = thread->bench;
+	BenchMtRing *out = &bench->rings[thread->index];
+	BenchMtRing *in =
+	    &bench->rings[(thread->index + bench->threads - 1) %
+			  bench->threads];
+
+	while (!bench_mt_stopped(thread)) {
+		for (size_t n = 0; n < BENCH_MT_ROUND; n++) {
+			size_t head = out->head;
+			size_t tail =
+			    __atomic_load_n(&in->tail, __ATOMIC_RELAXED);
+
+			if (head - __atomic_load_n(&out->tail,
+						   __ATOMIC_ACQUIRE) <
+			    BENCH_MT_RING) {
+				size_t size =
+				    16 + (size_t)(bench_mt_random(thread) %
+						  241);
+				void *ptr = yamalloc(size);
+				if (ptr) {
+					out->ptr[head % BENCH_MT_RING] = ptr;
+					out->size[head % BENCH_MT_RING] = size;
+					thread->live += (int64_t)size;
+					__atomic_store_n(&out->head, head + 1,
+							 __ATOMIC_RELEASE);
+				}
+				thread->ops++;
+			}
+			if (tail != __atomic_load_n(&in->head,
+						    __ATOMIC_ACQUIRE)) {
+				yafree(in->ptr[tail % BENCH_MT_RING]);
+				thread->live -=
+				    (int64_t)in->size[tail % BENCH_MT_RING];
+				__atomic_store_n(&in->tail, tail + 1,
+						 __ATOMIC_RELEASE);
+				thread->ops++;
+			}
+		}
+	}
+}
+
+typedef struct BenchMtWorkload {
+	const char *name;
+	void (*run)(BenchMtThread *);
+} BenchMtWorkload;
+
+static const BenchMtWorkload bench_mt_workloads[] = {
+    {"larson", bench_mt_larson},
+    {"xmalloc", bench_mt_xmalloc},
+    {"thread_local", bench_mt_thread_local},
+};
+
+static const BenchMtWorkload *bench_mt_workload;
+
+static void *bench_mt_thread(void *arg)
+{
+	BenchMtThread *thread = (BenchMtThread *)arg;
+
+	bench_mt_workload->run(thread);
+	return NULL;
+}
+
+// Reads a field of /proc/self/status, in bytes
+static size_t bench_mt_status(const char *field)
+{
+	FILE *status = fopen("/proc/self/status", "r");
+	size_t len = strlen(field);
+	size_t kb = 0;
+	char line[256];
+
+	if (!status) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), status)) {
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			kb = strtoul(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(status);
+	return kb * 1024;
+}
+
+/**
+ * @brief Runs a workload on some threads and prints its results
+ *
+ * Runs in a fresh process, so that the peak resident size only accounts
+ * for this run. The blowup is the growth of the peak resident size over
+ * the bytes still live when the run stops.
+ *
+ * @param[in] workload Workload to run
+ * @param[in] threads Number of threads
+ * @param[in] ms Duration of the run, in milliseconds
+ * @return int 0 on success, -1 if the run could not be set up
+ */
+static int bench_mt_run(const BenchMtWorkload *workload, size_t threads,
+			unsigned long ms)
+{
+	BenchMt bench;
+	size_t rss_start, rss_peak;
+	int64_t live = 0;
+	uint64_t ops = 0;
+	uint64_t start;
+	double seconds;
+	struct timespec duration = {(time_t)(ms / 1000),
+				    (long)(ms % 1000) * 1000000};
+	FILE *clear_refs;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.threads = threads;
+	// Bookkeeping comes from the C library, as in the other commands
+	bench.thread = (BenchMtThread *)aligned_alloc(
+	    BENCH_MT_CACHE_LINE, threads * sizeof(BenchMtThread));
+	bench.rings = (BenchMtRing *)aligned_alloc(
+	    BENCH_MT_CACHE_LINE, threads * sizeof(BenchMtRing));
+	bench.exchange = (BenchMtSlots *)calloc(1, sizeof(BenchMtSlots));
+	if (!bench.thread || !bench.rings || !bench.exchange) {
+		return -1;
+	}
+	memset(bench.thread, 0, threads * sizeof(BenchMtThread));
+	memset(bench.rings, 0, threads * sizeof(BenchMtRing));
+	for (size_t i = 0; i < threads; i++) {
+		bench.thread[i].bench = &bench;
+		bench.thread[i].index = i;
+		bench.thread[i].random_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+		bench.thread[i].slots =
+		    (BenchMtSlots *)calloc(1, sizeof(BenchMtSlots));
+		if (!bench.thread[i].slots) {
+			return -1;
+		}
+	}
+
+	// Resets the peak resident size of the process (Linux 4.0 and later)
+	clear_refs = fopen("/proc/self/clear_refs", "w");
+	if (clear_refs) {
+		fputs("5", clear_refs);
+		fclose(clear_refs);
+	}
+	rss_start = bench_mt_status("VmRSS");
+
+	bench_mt_workload = workload;
+	start = bench_mt_now();
+	for (size_t i = 0; i < threads; i++) {
+		if (pthread_create(&bench.thread[i].thread, NULL,
+				   bench_mt_thread, &bench.thread[i]) != 0) {
+			return -1;
+		}
+	}
+	nanosleep(&duration, NULL);
+	__atomic_store_n(&bench.stop, 1, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < threads; i++) {
+		pthread_join(bench.thread[i].thread, NULL);
+		ops += bench.thread[i].ops;
+		live += bench.thread[i].live;
+	}
+	seconds = (double)(bench_mt_now() - start) / 1e9;
+	rss_peak = bench_mt_status("VmHWM");
+	rss_peak = rss_peak > rss_start ? rss_peak - rss_start : 0;
+
+	printf("{\"allocator\":\"%s\",\"workload\":\"%s\",\"threads\":%zu,"
+	       "\"ops\":%llu,\"ops_per_sec\":%.0f,\"live_bytes\":%lld,"
+	       "\"rss_peak_bytes\":%zu,\"blowup\":%.2f,",
+	       BENCH_ALLOCATOR, workload->name, threads,
+	       (unsigned long long)ops, (double)ops / seconds, (long long)live,
+	       rss_peak, live > 0 ? (double)rss_peak / (double)live : 0.0);
+#ifndef BENCH_LIBC
+	struct yamalloc_latency latency;
+	if (yamalloc_latency(&latency) == 0) {
+		uint64_t locks = latency.count[YAMALLOC_PATH_LOCK_WAIT];
+		uint64_t contended =
+		    locks - latency.histogram[YAMALLOC_PATH_LOCK_WAIT][0];
+
+		printf("\"locks\":%llu,\"locks_contended\":%llu,"
+		       "\"contention\":%.4f,\"lock_wait_ticks\":%llu}\n",
+		       (unsigned long long)locks,
+		       (unsigned long long)contended,
+		       locks ? (double)contended / (double)locks : 0.0,
+		       (unsigned long long)
+			   latency.total_ticks[YAMALLOC_PATH_LOCK_WAIT]);
+		return 0;
+	}
+#endif
+	printf("\"locks\":null,\"locks_contended\":null,\"contention\":null,"
+	       "\"lock_wait_ticks\":null}\n");
+	return 0;
+}
+
+// Doubles the number of threads, stopping at max_threads
+static size_t bench_mt_next(size_t threads, size_t max_threads)
+{
+	if (threads == max_threads) {
+		return max_threads + 1;
+	}
+	return threads * 2 < max_threads ? threads * 2 : max_threads;
+}
+
+/**
+ * @brief Runs every workload from 1 to max_threads threads
+ *
+ * The thread counts are the powers of two below max_threads, then
+ * max_threads itself. Each run is forked from this process before any
+ * thread or allocation exists.
+ *
+ * Usage: bench_mt [max_threads] [ms]
+ */
+int main(int argc, char **argv)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+	unsigned long ms = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+	size_t count = sizeof(bench_mt_workloads) / sizeof(BenchMtWorkload);
+
+	if (max_threads == 0) {
+		max_threads = cpus > 0 ? (size_t)cpus : 1;
+	}
+	if (ms == 0) {
+		ms = BENCH_MT_DEFAULT_MS;
+	}
+	for (size_t w = 0; w < count; w++) {
+		for (size_t threads = 1; threads <= max_threads;
+		     threads = bench_mt_next(threads, max_threads)) {
+			pid_t pid;
+			int status;
+
+			fflush(stdout);
+			pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				return 1;
+			}
+			if (pid == 0) {
+				int ret = bench_mt_run(&bench_mt_workloads[w],
+						       threads, ms);
+				fflush(stdout);
+				_exit(ret == 0 ? 0 : 1);
+			}
+			if (waitpid(pid, &status, 0) < 0 ||
+			    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				fprintf(stderr, "bench_mt: %s with %zu "
+						"threads failed\n",
+					bench_mt_workloads[w].name, threads);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include "yamalloc.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The same measure runs against the C library when BENCH_LIBC is defined
+#ifdef BENCH_LIBC
+#define yamalloc malloc
+#define yafree free
+#define BENCH_ALLOCATOR "libc"
+#elif defined(YAMALLOC_LINKED_LIST)
+#define BENCH_ALLOCATOR "linked_list"
+#elif defined(YAMALLOC_FREE_LIST_LL_FIND_BEST)
+#define BENCH_ALLOCATOR "free_list_ll/best"
+#elif defined(YAMALLOC_FREE_LIST_LL)
+#define BENCH_ALLOCATOR "free_list_ll/first"
+#endif
+
+#define BENCH_RSS_DEFAULT_OBJECTS 200000
+// The median allocation of our services
+#define BENCH_RSS_DEFAULT_SIZE 24
+
+// Reads the resident size of the process from /proc/self/status, in bytes
+static size_t bench_rss(void)
+{
+	FILE *status = fopen("/proc/self/status", "r");
+	size_t kb = 0;
+	char line[256];
+
+	if (!status) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), status)) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			kb = strtoul(line + 6, NULL, 10);
+			break;
+		}
+	}
+	fclose(status);
+	return kb * 1024;
+}
+
+/**
+ * @brief Measures the resident memory of many small live objects
+ *
+ * Every object is written, so that all its pages are resident. The pointer
+ * table comes from the C library and is touched before the first reading,
+ * so only the heap of the allocator is measured; the bytes above the
+ * payload are headers, alignment and free space.
+ */
+int main(int argc, char **argv)
+{
+	size_t objects = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+	size_t size = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+	size_t rss_start, rss;
+	void **ptrs;
+
+	if (objects == 0 || objects > SIZE_MAX / sizeof(void *)) {
+		objects = BENCH_RSS_DEFAULT_OBJECTS;
+	}
+	if (size == 0) {
+		size = BENCH_RSS_DEFAULT_SIZE;
+	}
+	ptrs = (void **)malloc(objects * sizeof(void *));
+	if (!ptrs) {
+		fprintf(stderr, "bench_rss: out of memory\n");
+		return 1;
+	}
+	// Not zero: a compiler may turn malloc and memset to 0 into calloc,
+	// whose pages stay untouched
+	memset(ptrs, 0xFF, objects * sizeof(void *));
+
+	rss_start = bench_rss();
+	for (size_t i = 0; i < objects; i++) {
+		ptrs[i] = yamalloc(size);
+		if (!ptrs[i]) {
+			fprintf(stderr, "bench_rss: out of memory\n");
+			return 1;
+		}
+		memset(ptrs[i], (int)i, size);
+	}
+	rss = bench_rss();
+	rss = rss > rss_start ? rss - rss_start : 0;
+
+	printf("{\"allocator\":\"%s\",\"page_map\":%d,\"objects\":%zu,"
+	       "\"size\":%zu,\"rss_bytes\":%zu,\"bytes_per_object\":%.1f}\n",
+	       BENCH_ALLOCATOR,
+#if defined(YAMALLOC_PAGE_MAP) && !defined(BENCH_LIBC)
+	       1,
+#else
+	       0,
+#endif
+	       objects, size, rss, (double)rss / (double)objects);
+	fflush(stdout);
+
+	for (size_t i = 0; i < objects; i++) {
+		yafree(ptrs[i]);
+	}
+	free(ptrs);
+	return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef YAMALLOC_CLI_HEAP_MAP_H
+#define YAMALLOC_CLI_HEAP_MAP_H
+
+#include <stdio.h>
+
+extern void heap_map_write(FILE *out, size_t granularity);
+extern int heap_map_main(int argc, char **argv);
+
+#endif // YAMALLOC_CLI_HEAP_MAP_H
@@ -0,0 +1,6 @@
+#ifndef YAMALLOC_CLI_REPLAY_H
+#define YAMALLOC_CLI_REPLAY_H
+
+extern int replay_main(int argc, char **argv);
+
+#endif // YAMALLOC_CLI_REPLAY_H
@@ -3,10 +3,236 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Alignment of the blocks of yamalloc(), yacalloc() and yarealloc()
+#define YAMALLOC_ALIGNMENT 8
 
 extern void *yamalloc(size_t size);
+// alignment must be a power of two; size is rounded up to a multiple of it
+extern void *yaaligned_alloc(size_t alignment, size_t size);
 extern void *yacalloc(size_t num, size_t size);
 extern void *yarealloc(void *ptr, size_t size);
 extern void yafree(void *ptr);
+// size must be the size last passed to yamalloc/yarealloc for ptr (num * size
+// for yacalloc, the rounded size for yaaligned_alloc).
+extern void yafree_sized(void *ptr, size_t size);
+// Without YAMALLOC_PAGE_MAP every non-NULL pointer is assumed to be ours.
+extern int yamalloc_owns(const void *ptr);
+extern size_t yamalloc_usable_size(void *ptr);
+
+// Flags of yamallocx() and yareallocx(), or-ed together. Blocks aligned by
+// the flags are freed with the size rounded up to the alignment.
+#define YAMALLOCX_LG_ALIGN(lg) ((int)(lg))
+#define YAMALLOCX_ALIGN(a)                                                     \
+	YAMALLOCX_LG_ALIGN(__builtin_ctzll((unsigned long long)(a)))
+#define YAMALLOCX_ZERO (1 << 6)
+// yareallocx() fails instead of moving the block
+#define YAMALLOCX_NO_MOVE (1 << 7)
+// Short-lived blocks are kept apart from long-lived ones, which reduces
+// fragmentation with the free_list_ll backend
+#define YAMALLOCX_SHORT_LIVED (1 << 8)
+#define YAMALLOCX_LONG_LIVED (1 << 9)
+// Allocates from the arena of yaarena_index(). Arena memory is released
+// with the arena, and cannot be reallocated or freed: yareallocx() refuses
+// it, with or without this flag.
+#define YAMALLOCX_ARENA(index) ((int)(index) << 12)
+
+#define YAMALLOCX_LG_ALIGN_MASK 0x3F
+#define YAMALLOCX_ARENA_SHIFT 12
+#define YAMALLOCX_ARENA_MASK (0xFF << YAMALLOCX_ARENA_SHIFT)
+
+extern void *yamallocx(size_t size, int flags);
+extern void *yareallocx(void *ptr, size_t size, int flags);
+// Usable size of a block of yamallocx(); flags are those it was given. Arenas
+// do not record sizes: arena memory has a usable size of 0.
+extern size_t yasallocx(void *ptr, int flags);
+
+// Bucket i of the size histogram counts the requests of (2^(i-1), 2^i] bytes
+#define YAMALLOC_STATS_HISTOGRAM_SIZE 48
+
+struct yamalloc_stats {
+	// Payload bytes and number of the blocks currently allocated
+	size_t bytes_in_use;
+	size_t blocks_in_use;
+	// Bytes (headers included) and number of the free blocks
+	size_t bytes_free;
+	size_t blocks_free;
+	size_t largest_free_block;
+	// Bytes obtained from the kernel
+	size_t heap_size;
+	// 1 - largest_free_block / bytes_free
+	double fragmentation;
+	uint64_t alloc_count;
+	uint64_t free_count;
+	uint64_t sbrk_calls;
+	uint64_t mmap_calls;
+	uint64_t munmap_calls;
+	uint64_t size_histogram[YAMALLOC_STATS_HISTOGRAM_SIZE];
+};
+
+#define YAMALLOC_STATS_TEXT 0
+#define YAMALLOC_STATS_JSON 1
+
+extern void yamalloc_stats(struct yamalloc_stats *stats);
+extern void yamalloc_stats_print(FILE *out, int format);
+
+// Memory budget on the footprint, the bytes obtained from the kernel. When
+// the footprint crosses the soft watermark, the next allocation call flushes
+// the caches of its thread, calls the pressure callbacks and gives free pages
+// back to the kernel; growing the heap past the hard watermark fails.
+#define YAMALLOC_PRESSURE_CALLBACKS 16
+
+typedef void (*YamallocPressureCallback)(size_t footprint, void *ctx);
+
+extern void yamalloc_set_limit(size_t bytes);
+extern int yamalloc_set_soft_limit(size_t bytes);
+extern size_t yamalloc_footprint(void);
+extern int yamalloc_add_pressure_callback(YamallocPressureCallback callback,
+					  void *ctx);
+extern int
+yamalloc_remove_pressure_callback(YamallocPressureCallback callback,
+				  void *ctx);
+
+// Internal paths timed when yamalloc is built with YAMALLOC_INSTRUMENT
+#define YAMALLOC_PATH_CACHE_HIT 0   // served without searching
+#define YAMALLOC_PATH_LIST_SEARCH 1 // free list walked past its head
+#define YAMALLOC_PATH_COALESCE 2    // free block merged into the list
+#define YAMALLOC_PATH_OS_GROWTH 3   // memory requested to the kernel
+#define YAMALLOC_PATH_LOCK_WAIT 4   // allocator mutex acquired
+#define YAMALLOC_PATH_COUNT 5
+
+// Bucket i counts the samples of [2^(i-1), 2^i) ticks (bucket 0: 0 ticks).
+// Ticks are TSC cycles on x86 and nanoseconds elsewhere.
+#define YAMALLOC_LATENCY_BUCKETS 40
+
+struct yamalloc_latency {
+	uint64_t count[YAMALLOC_PATH_COUNT];
+	uint64_t total_ticks[YAMALLOC_PATH_COUNT];
+	uint64_t histogram[YAMALLOC_PATH_COUNT][YAMALLOC_LATENCY_BUCKETS];
+	// Nodes visited by list searches, same bucketing
+	uint64_t probe_histogram[YAMALLOC_LATENCY_BUCKETS];
+};
+
+// Both return -1 (and print nothing) without YAMALLOC_INSTRUMENT
+extern int yamalloc_latency(struct yamalloc_latency *latency);
+extern int yamalloc_latency_print(FILE *out, int format);
+
+// Block visited by yamalloc_heap_walk()
+struct yamalloc_block {
+	void *address;  // first byte of the block, header included
+	size_t size;    // bytes of the block, header included
+	size_t padding; // bytes of an in-use block the payload cannot use
+	int free;
+};
+
+// Returning non-zero stops the walk. The callback runs with the allocator
+// locks held, so it must not call into yamalloc.
+typedef int (*YamallocWalkCallback)(const struct yamalloc_block *block,
+				    void *ctx);
+
+extern int yamalloc_heap_walk(YamallocWalkCallback callback, void *ctx);
+
+// Binary trace of the allocation calls, recorded when yamalloc is built with
+// YAMALLOC_TRACE. The file holds a yamalloc_trace_header followed by the
+// records; each thread flushes its records in batches, so the file is only
+// ordered by timestamp within a thread. Objects are identified by address.
+#define YAMALLOC_TRACE_MAGIC "YATRACE"
+#define YAMALLOC_TRACE_VERSION 1
+
+#define YAMALLOC_TRACE_MALLOC 1
+#define YAMALLOC_TRACE_CALLOC 2
+#define YAMALLOC_TRACE_REALLOC 3
+#define YAMALLOC_TRACE_FREE 4
+
+struct yamalloc_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct yamalloc_trace_record {
+	uint64_t timestamp; // nanoseconds since yamalloc_trace_start()
+	uint64_t size;      // bytes requested (num * size for calloc)
+	uint64_t id;        // object allocated, freed or reallocated
+	uint64_t new_id;    // object returned by realloc, 0 otherwise
+	uint32_t thread;    // thread number, in order of first traced call
+	uint32_t op;        // YAMALLOC_TRACE_*
+};
+
+// Both return -1 without YAMALLOC_TRACE
+extern int yamalloc_trace_start(const char *path);
+extern int yamalloc_trace_stop(void);
+
+// Sampling heap profiler, built with YAMALLOC_PROFILE. On average one
+// allocation is sampled every interval bytes; its backtrace is kept until
+// the object is freed.
+#define YAMALLOC_PROFILE_DEFAULT_INTERVAL (512 * 1024)
+
+// Both return -1 without YAMALLOC_PROFILE
+extern int yamalloc_profile_set_interval(size_t bytes);
+extern int yamalloc_profile_dump(const char *path);
+
+// Region allocator: objects are bump-allocated from large chunks and are all
+// released together by yaarena_reset() or yaarena_destroy(). An arena must
+// not be used by more than one thread at a time.
+typedef struct YaArena YaArena;
+
+// Keep the chunks across yaarena_reset() instead of returning them
+#define YAARENA_RETAIN 1
+
+extern YaArena *yaarena_create(size_t chunk_size, int flags);
+extern unsigned yaarena_index(const YaArena *arena);
+extern void *yaarena_alloc(YaArena *arena, size_t size);
+extern void yaarena_reset(YaArena *arena);
+extern void yaarena_destroy(YaArena *arena);
+
+// Pools of fixed-size objects. Objects are packed in contiguous chunks and
+// recycled through an intrusive free stack. With init/fini callbacks the
+// objects are constructed once, when their chunk is carved, and destroyed by
+// yapool_destroy(); they must be returned to the pool in constructed state.
+typedef struct YaPool YaPool;
+typedef void (*YaPoolCallback)(void *obj, void *ctx);
+
+extern YaPool *yapool_create(size_t obj_size, size_t align,
+			     size_t objs_per_chunk);
+extern YaPool *yapool_create_ex(size_t obj_size, size_t align,
+				size_t objs_per_chunk, YaPoolCallback init,
+				YaPoolCallback fini, void *ctx);
+extern void *yapool_alloc(YaPool *pool);
+extern void yapool_free(YaPool *pool, void *obj);
+extern void yapool_destroy(YaPool *pool);
+
+// Persistent heaps: a file mapped in memory whose blocks, free list and root
+// object outlive the process. The heap may be mapped at another address
+// when it is reopened, so its objects refer to each other by offset.
+typedef struct YaHeap YaHeap;
+
+extern YaHeap *yamalloc_heap_open(const char *path, size_t size);
+extern void *yamalloc_heap_alloc(YaHeap *heap, size_t size);
+extern void yamalloc_heap_free(YaHeap *heap, void *ptr);
+extern void *yamalloc_heap_root(YaHeap *heap);
+extern void yamalloc_heap_set_root(YaHeap *heap, void *ptr);
+extern uint64_t yamalloc_heap_offset(YaHeap *heap, const void *ptr);
+extern void *yamalloc_heap_pointer(YaHeap *heap, uint64_t offset);
+extern int yamalloc_heap_flush(YaHeap *heap);
+extern int yamalloc_heap_close(YaHeap *heap);
+
+// Shared heaps: the same heaps in POSIX shared memory, locked with a
+// process-shared mutex, so that every attached process can allocate and
+// free. They are closed with yamalloc_heap_close(). When a process dies
+// holding the mutex, the next one rebuilds the free list; if the heap is too
+// corrupted for that, its allocations fail from then on.
+extern YaHeap *yamalloc_shm_create(const char *name, size_t size);
+extern YaHeap *yamalloc_shm_attach(const char *name);
+extern int yamalloc_shm_unlink(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // YAMALLOC_H
@@ -0,0 +1,229 @@
+#ifndef YAMALLOC_HPP
+#define YAMALLOC_HPP
+
+// Header-only C++17 bindings: polymorphic memory resources over the global
+// heap, arenas and pools, and a standard allocator. Sizes and alignments
+// are forwarded to yaaligned_alloc() and yafree_sized(), so containers free
+// their blocks without a header lookup.
+
+#include "yamalloc.h"
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+namespace ya
+{
+
+// Size passed to yaaligned_alloc() once rounded, as yafree_sized() expects
+inline std::size_t aligned_size(std::size_t bytes, std::size_t alignment)
+{
+	return (bytes + alignment - 1) & ~(alignment - 1);
+}
+
+// The global heap of yamalloc. Every instance is interchangeable.
+class heap_resource : public std::pmr::memory_resource
+{
+      protected:
+	void *do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		void *ptr = yaaligned_alloc(alignment, bytes);
+		if (!ptr) {
+			throw std::bad_alloc();
+		}
+		return ptr;
+	}
+
+	void do_deallocate(void *ptr, std::size_t bytes,
+			   std::size_t alignment) override
+	{
+		yafree_sized(ptr, aligned_size(bytes, alignment));
+	}
+
+	bool do_is_equal(
+	    const std::pmr::memory_resource &other) const noexcept override
+	{
+		return dynamic_cast<const heap_resource *>(&other) != nullptr;
+	}
+};
+
+// Shared instance, as std::pmr::new_delete_resource()
+inline heap_resource *global_resource() noexcept
+{
+	static heap_resource resource;
+	return &resource;
+}
+
+// An arena: deallocations are no-ops and release() frees everything at
+// once. Not thread safe, as the arena itself.
+class arena_resource : public std::pmr::memory_resource
+{
+      public:
+	explicit arena_resource(std::size_t chunk_size = 0, int flags = 0)
+	    : arena_(yaarena_create(chunk_size, flags))
+	{
+		if (!arena_) {
+			throw std::bad_alloc();
+		}
+	}
+
+	arena_resource(const arena_resource &) = delete;
+	arena_resource &operator=(const arena_resource &) = delete;
+
+	~arena_resource() override { yaarena_destroy(arena_); }
+
+	void release() noexcept { yaarena_reset(arena_); }
+
+	YaArena *get() const noexcept { return arena_; }
+
+      protected:
+	void *do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		// Larger alignments are obtained by over-allocating
+		std::size_t extra =
+		    alignment > YAMALLOC_ALIGNMENT ? alignment - 1 : 0;
+		char *ptr;
+
+		if (bytes > std::numeric_limits<std::size_t>::max() - extra) {
+			throw std::bad_alloc();
+		}
+		ptr = static_cast<char *>(yaarena_alloc(arena_, bytes + extra));
+		if (!ptr) {
+			throw std::bad_alloc();
+		}
+		return reinterpret_cast<void *>(
+		    aligned_size(reinterpret_cast<std::uintptr_t>(ptr),
+				 alignment));
+	}
+
+	void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+	bool do_is_equal(
+	    const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+      private:
+	YaArena *arena_;
+};
+
+// A pool of blocks of up to obj_size bytes. Larger or more aligned requests
+// go to the upstream resource.
+class pool_resource : public std::pmr::memory_resource
+{
+      public:
+	explicit pool_resource(
+	    std::size_t obj_size, std::size_t alignment = YAMALLOC_ALIGNMENT,
+	    std::size_t objs_per_chunk = 0,
+	    std::pmr::memory_resource *upstream = global_resource())
+	    : pool_(yapool_create(obj_size, alignment, objs_per_chunk)),
+	      obj_size_(obj_size), alignment_(alignment), upstream_(upstream)
+	{
+		if (!pool_) {
+			throw std::bad_alloc();
+		}
+	}
+
+	pool_resource(const pool_resource &) = delete;
+	pool_resource &operator=(const pool_resource &) = delete;
+
+	~pool_resource() override { yapool_destroy(pool_); }
+
+	YaPool *get() const noexcept { return pool_; }
+
+	std::pmr::memory_resource *upstream_resource() const noexcept
+	{
+		return upstream_;
+	}
+
+      protected:
+	void *do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		void *ptr;
+
+		if (!fits(bytes, alignment)) {
+			return upstream_->allocate(bytes, alignment);
+		}
+		ptr = yapool_alloc(pool_);
+		if (!ptr) {
+			throw std::bad_alloc();
+		}
+		return ptr;
+	}
+
+	void do_deallocate(void *ptr, std::size_t bytes,
+			   std::size_t alignment) override
+	{
+		if (!fits(bytes, alignment)) {
+			upstream_->deallocate(ptr, bytes, alignment);
+			return;
+		}
+		yapool_free(pool_, ptr);
+	}
+
+	bool do_is_equal(
+	    const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+      private:
+	bool fits(std::size_t bytes, std::size_t alignment) const noexcept
+	{
+		return bytes <= obj_size_ && alignment <= alignment_;
+	}
+
+	YaPool *pool_;
+	std::size_t obj_size_;
+	std::size_t alignment_;
+	std::pmr::memory_resource *upstream_;
+};
+
+// Standard allocator over the global heap. The container passes back the
+// element count on deallocate, so blocks are freed with yafree_sized().
+template <class T> class allocator
+{
+      public:
+	using value_type = T;
+
+	allocator() noexcept = default;
+
+	template <class U> allocator(const allocator<U> &) noexcept {}
+
+	T *allocate(std::size_t n)
+	{
+		void *ptr;
+
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+			throw std::bad_array_new_length();
+		}
+		ptr = yaaligned_alloc(alignof(T), n * sizeof(T));
+		if (!ptr) {
+			throw std::bad_alloc();
+		}
+		return static_cast<T *>(ptr);
+	}
+
+	void deallocate(T *ptr, std::size_t n) noexcept
+	{
+		yafree_sized(ptr, n * sizeof(T));
+	}
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+{
+	return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+{
+	return false;
+}
+
+} // namespace ya
+
+#endif // YAMALLOC_HPP
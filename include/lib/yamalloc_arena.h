@@ -0,0 +1,32 @@
+#ifndef YAMALLOC_ARENA_H
+#define YAMALLOC_ARENA_H
+
+#include "yamalloc.h"
+
+#define YAARENA_ALIGNMENT 8
+#define YAARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+// Arenas that can be targeted with YAMALLOCX_ARENA(); index 0 means none
+#define YAARENA_MAX_INDEX 255
+
+typedef struct YaArenaChunk {
+	struct YaArenaChunk *next;
+	size_t size;
+} YaArenaChunk;
+
+struct YaArena {
+	// Chunks handed out since the last reset, the current one first
+	YaArenaChunk *chunks;
+	// Chunks kept by yaarena_reset() when YAARENA_RETAIN is set
+	YaArenaChunk *spare;
+	char *ptr;
+	char *end;
+	size_t chunk_size;
+	int flags;
+	// Slot in the arena registry, 0 when the registry was full
+	unsigned index;
+};
+
+extern YaArena *yaarena_lookup(unsigned index);
+extern int yaarena_owns(const void *ptr);
+
+#endif // YAMALLOC_ARENA_H
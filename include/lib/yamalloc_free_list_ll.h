@@ -1,41 +1,143 @@
 #ifndef YAMALLOC_FREE_LIST_LL_H
 #define YAMALLOC_FREE_LIST_LL_H
 
+#include "yamalloc.h"
 #include <stddef.h>
 #include <stdint.h>
 
+#if !defined(YAMALLOC_FREE_LIST_LL_FIND_FIRST) &&                             \
+    !defined(YAMALLOC_FREE_LIST_LL_FIND_BEST)
+#define YAMALLOC_FREE_LIST_LL_FIND_FIRST
+#endif
+
+// Layout of FreeListLLHeader.info:
+//
+//   bit  0      block is free
+//   bit  1      reserved
+//   bit  2      word is a padding marker, not a block header
+//   bits 3..47  block size in bytes, header included (multiple of 8)
+//   bits 48..55 tag, free for use by the layers above the backend
+//   bits 56..63 padding between the header and the payload
+//
+// A block with padding ends it with a marker word, packed with the same
+// padding and FREE_LIST_LL_PAD_MARK, so that the header can be found from
+// the payload.
+#define FREE_LIST_LL_FREE ((uint64_t)1 << 0)
+// Reserved: the free list is ordered by address, so coalescing finds the
+// previous block without it
+#define FREE_LIST_LL_PREV_INUSE ((uint64_t)1 << 1)
+#define FREE_LIST_LL_PAD_MARK ((uint64_t)1 << 2)
+#define FREE_LIST_LL_SIZE_MASK ((uint64_t)0x0000FFFFFFFFFFF8)
+#define FREE_LIST_LL_TAG_SHIFT 48
+#define FREE_LIST_LL_TAG_MASK ((uint64_t)0xFF << FREE_LIST_LL_TAG_SHIFT)
+#define FREE_LIST_LL_PADDING_SHIFT 56
+#define FREE_LIST_LL_PADDING_MASK ((uint64_t)0xFF << FREE_LIST_LL_PADDING_SHIFT)
+
 typedef struct FreeListLLHeader {
-	size_t size;
-	// Padding store the amount of bytes that has to be placed before the
-	// header to make the payload aligned
-	size_t padding;
+	uint64_t info;
 } FreeListLLHeader;
 
+// A free block. The link lives in the payload, so it costs nothing while the
+// block is in use.
 typedef struct FreeListLLNode {
-	size_t size;
-	struct FreeListLLNode *next;
+	FreeListLLHeader header;
+	uint64_t next;
 } FreeListLLNode;
 
+// An address-ordered list of free blocks. Links are offsets from base, 0
+// ending the list: with a NULL base they are plain addresses, as in the
+// process heap; with the start of a mapping they stay valid wherever it is
+// mapped, as in the heaps of yamalloc_heap_open().
+typedef struct FreeListLL {
+	char *base;
+	// Link to the first node
+	uint64_t *head;
+} FreeListLL;
+
+static inline size_t free_list_ll_size(const FreeListLLHeader *header)
+{
+	return (size_t)(header->info & FREE_LIST_LL_SIZE_MASK);
+}
+
+static inline size_t free_list_ll_padding(const FreeListLLHeader *header)
+{
+	return (size_t)(header->info >> FREE_LIST_LL_PADDING_SHIFT);
+}
+
+static inline int free_list_ll_is_free(const FreeListLLHeader *header)
+{
+	return (header->info & FREE_LIST_LL_FREE) != 0;
+}
+
+static inline FreeListLLNode *free_list_ll_node(const FreeListLL *list,
+						uint64_t link)
+{
+	return link == 0 ? NULL
+			 : (FreeListLLNode *)((uintptr_t)list->base + link);
+}
+
+static inline uint64_t free_list_ll_link(const FreeListLL *list,
+					 const FreeListLLNode *node)
+{
+	if (node == NULL) {
+		return 0;
+	}
+	return (uint64_t)((uintptr_t)node - (uintptr_t)list->base);
+}
+
+static inline FreeListLLNode *free_list_ll_first(const FreeListLL *list)
+{
+	return free_list_ll_node(list, *list->head);
+}
+
+static inline FreeListLLNode *free_list_ll_next(const FreeListLL *list,
+						const FreeListLLNode *node)
+{
+	return free_list_ll_node(list, node->next);
+}
+
+static inline uint64_t free_list_ll_pack(size_t size, size_t padding,
+					 uint8_t tag, uint64_t flags)
+{
+	return ((uint64_t)size & FREE_LIST_LL_SIZE_MASK) |
+	       ((uint64_t)padding << FREE_LIST_LL_PADDING_SHIFT) |
+	       ((uint64_t)tag << FREE_LIST_LL_TAG_SHIFT) | flags;
+}
+
 extern void *free_list_ll_yamalloc(size_t size);
+extern void *free_list_ll_yamallocx(size_t size, int lifetime);
+extern void *free_list_ll_yaaligned_alloc(size_t alignment, size_t size);
 extern void *free_list_ll_yacalloc(size_t num, size_t size);
 extern void *free_list_ll_yarealloc(void *ptr, size_t size);
+extern int free_list_ll_resize(void *ptr, size_t size);
+extern size_t free_list_ll_trim(void);
 extern void free_list_ll_yafree(void *ptr);
+extern size_t free_list_ll_usable_size(void *ptr);
+extern void free_list_ll_free_stats(size_t *bytes, size_t *blocks,
+				    size_t *largest);
 
+extern int free_list_ll_heap_walk(YamallocWalkCallback callback, void *ctx);
 extern size_t get_padding_with_header(uintptr_t payload, size_t header_size);
 
-#if defined(YAMALLOC_FREE_LIST_LL_FIND_FIRST)
-extern FreeListLLNode *free_list_ll_find_first(FreeListLLNode **prev_node,
+// Operations on any free list, shared by the process heap and the heaps of
+// yamalloc_heap_open(); the caller holds the lock of the list
+extern size_t free_list_ll_block_size(size_t size);
+// Both searches are built: long-lived blocks always take the first fit
+extern FreeListLLNode *free_list_ll_find_first(const FreeListLL *list,
+					       FreeListLLNode **prev_node,
 					       size_t size, size_t *padding);
-#elif defined(YAMALLOC_FREE_LIST_LL_FIND_BEST)
-extern FreeListLLNode *free_list_ll_find_best(FreeListLLNode **prev_node,
+extern FreeListLLNode *free_list_ll_find_best(const FreeListLL *list,
+					      FreeListLLNode **prev_node,
 					      size_t size, size_t *padding);
-#endif
+extern void *free_list_ll_carve(FreeListLL *list, FreeListLLNode *prev,
+				FreeListLLNode *node, size_t block_size);
+extern void free_list_ll_release(FreeListLL *list, FreeListLLNode *node);
 
-extern void free_list_ll_coalesce(FreeListLLNode *prev,
+extern void free_list_ll_coalesce(FreeListLL *list, FreeListLLNode *prev,
 				  FreeListLLNode *free_node);
-extern void free_list_ll_insert_node(FreeListLLNode *prev,
+extern void free_list_ll_insert_node(FreeListLL *list, FreeListLLNode *prev,
 				     FreeListLLNode *new_node);
-extern void free_list_ll_remove_node(FreeListLLNode *prev,
+extern void free_list_ll_remove_node(FreeListLL *list, FreeListLLNode *prev,
 				     FreeListLLNode *del_node);
 
 #endif // YAMALLOC_FREE_LIST_LL_H
@@ -0,0 +1,49 @@
+#ifndef YAMALLOC_HEAP_H
+#define YAMALLOC_HEAP_H
+
+#include "yamalloc.h"
+#include "yamalloc_free_list_ll.h"
+#include <pthread.h>
+
+#define YAHEAP_MAGIC "YAHEAP"
+#define YAHEAP_VERSION 1
+#define YAHEAP_ALIGNMENT 8
+
+// YaHeapHeader.state
+#define YAHEAP_CLEAN 0
+#define YAHEAP_DIRTY 1
+
+// First bytes of a persistent or shared heap. The blocks follow, laid out as
+// in the free_list_ll backend, up to a fencepost in the last word of the
+// heap, and the free list is a FreeListLL whose links are offsets from the
+// start of the heap.
+typedef struct YaHeapHeader {
+	// YAHEAP_MAGIC, published last, once the heap and its lock are ready
+	union {
+		char magic[8];
+		uint64_t magic_word;
+	};
+	uint32_t version;
+	// YAHEAP_DIRTY from the opening of the heap until it is closed
+	uint32_t state;
+	uint64_t size;
+	// Offsets from the start of the heap, 0 when unset
+	uint64_t root;
+	uint64_t free_list;
+	// Initialized by each opening of a persistent heap, and once by
+	// yamalloc_shm_create() as a process-shared lock
+	pthread_mutex_t lock;
+} YaHeapHeader;
+
+struct YaHeap {
+	char *base;
+	size_t size;
+	// Free list of the mapping, headed by YaHeapHeader.free_list
+	FreeListLL free_list;
+	int fd;
+	// Set for the heaps of yamalloc_shm_create() and yamalloc_shm_attach(),
+	// which are always locked
+	int shared;
+};
+
+#endif // YAMALLOC_HEAP_H
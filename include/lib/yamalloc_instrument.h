@@ -0,0 +1,60 @@
+#ifndef YAMALLOC_INSTRUMENT_H
+#define YAMALLOC_INSTRUMENT_H
+
+#include "yamalloc.h"
+
+// Latency probes for the internal paths. They expand to nothing unless
+// YAMALLOC_INSTRUMENT is defined.
+//
+//   INSTRUMENT_START(t);              starts a measurement in variable t
+//   INSTRUMENT_END(path, t);          records the time elapsed since t
+//   INSTRUMENT_SEARCH_END(t, n);      records a search that visited n nodes
+//   INSTRUMENT_LOCK(mutex);           locks mutex, recording the wait
+#ifdef YAMALLOC_INSTRUMENT
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t instrument_now(void) { return __rdtsc(); }
+#else
+#include <time.h>
+static inline uint64_t instrument_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+extern void instrument_record(int path, uint64_t ticks);
+extern void instrument_record_search(uint64_t ticks, size_t probes);
+
+#define INSTRUMENT_START(t) uint64_t t = instrument_now()
+#define INSTRUMENT_END(path, t) instrument_record(path, instrument_now() - (t))
+#define INSTRUMENT_SEARCH_END(t, n)                                            \
+	instrument_record_search(instrument_now() - (t), n)
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+static inline void instrument_lock(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_trylock(mutex) == 0) {
+		instrument_record(YAMALLOC_PATH_LOCK_WAIT, 0);
+		return;
+	}
+	INSTRUMENT_START(t);
+	pthread_mutex_lock(mutex);
+	INSTRUMENT_END(YAMALLOC_PATH_LOCK_WAIT, t);
+}
+#define INSTRUMENT_LOCK(mutex) instrument_lock(mutex)
+#endif
+
+#else // YAMALLOC_INSTRUMENT
+
+#define INSTRUMENT_START(t) ((void)0)
+#define INSTRUMENT_END(path, t) ((void)0)
+#define INSTRUMENT_SEARCH_END(t, n) ((void)(n))
+#define INSTRUMENT_LOCK(mutex) pthread_mutex_lock(mutex)
+
+#endif // YAMALLOC_INSTRUMENT
+
+#endif // YAMALLOC_INSTRUMENT_H
@@ -0,0 +1,31 @@
+#ifndef YAMALLOC_LIMIT_H
+#define YAMALLOC_LIMIT_H
+
+#include "yamalloc.h"
+
+// Fraction of the hard watermark at which yamalloc_set_limit() puts the
+// soft one
+#define LIMIT_SOFT_NUMERATOR 7
+#define LIMIT_SOFT_DENOMINATOR 8
+
+typedef struct LimitCallback {
+	YamallocPressureCallback callback;
+	void *ctx;
+} LimitCallback;
+
+// Set when the footprint crosses the soft watermark, or the hard one
+// refuses memory. Growth happens under the backend locks, so the pressure
+// is only relieved by the next allocation call, once LIMIT_CHECK() sees it.
+extern int limit_pressure;
+extern int limit_charge(size_t size);
+extern void limit_release(size_t size);
+extern void limit_relieve(void);
+
+#define LIMIT_CHECK()                                                          \
+	do {                                                                   \
+		if (__atomic_load_n(&limit_pressure, __ATOMIC_RELAXED)) {      \
+			limit_relieve();                                       \
+		}                                                              \
+	} while (0)
+
+#endif // YAMALLOC_LIMIT_H
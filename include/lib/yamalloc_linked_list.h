@@ -1,19 +1,44 @@
 #ifndef YAMALLOC_LINKED_LIST_H
 #define YAMALLOC_LINKED_LIST_H
 
+#include "yamalloc.h"
 #include <stddef.h>
 #include <stdint.h>
 
+// Sizes are multiples of 8, so the low bit of size_and_free is used as the
+// free flag instead of a separate (padded) field.
+#define LINKED_LIST_FREE ((size_t)1)
+
+// Every block, in use or free, is linked in address order: allocation and
+// coalescing walk all of them. The header thus stays 16 bytes; the compact
+// layout, with an 8-byte header and the link only in free payloads, is the
+// one of the free_list_ll backend.
 typedef struct BlockHeaderLinkedList {
-	size_t size;
+	size_t size_and_free;
 	struct BlockHeaderLinkedList *next;
-	uint8_t is_free;
 } BlockHeaderLinkedList;
 
+static inline size_t linked_list_size(const BlockHeaderLinkedList *block)
+{
+	return block->size_and_free & ~LINKED_LIST_FREE;
+}
+
+static inline int linked_list_is_free(const BlockHeaderLinkedList *block)
+{
+	return (block->size_and_free & LINKED_LIST_FREE) != 0;
+}
+
 extern void *linked_list_yamalloc(size_t size);
+extern void *linked_list_yaaligned_alloc(size_t alignment, size_t size);
 extern void *linked_list_yacalloc(size_t num, size_t size);
 extern void *linked_list_yarealloc(void *ptr, size_t size);
 extern void linked_list_yafree(void *ptr);
+extern size_t linked_list_usable_size(void *ptr);
+extern int linked_list_resize(void *ptr, size_t size);
+extern size_t linked_list_trim(void);
+extern void linked_list_free_stats(size_t *bytes, size_t *blocks,
+				   size_t *largest);
+extern int linked_list_heap_walk(YamallocWalkCallback callback, void *ctx);
 extern BlockHeaderLinkedList *
 linked_list_request_space(BlockHeaderLinkedList *last, size_t size);
 extern BlockHeaderLinkedList *
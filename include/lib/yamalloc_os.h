@@ -0,0 +1,13 @@
+#ifndef YAMALLOC_OS_H
+#define YAMALLOC_OS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define YAMALLOC_OS_PAGE_SIZE 4096
+
+extern void *yamalloc_os_map(size_t size);
+extern void yamalloc_os_unmap(void *ptr, size_t size);
+extern void yamalloc_os_purge(void *ptr, size_t size);
+
+#endif // YAMALLOC_OS_H
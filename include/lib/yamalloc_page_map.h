@@ -0,0 +1,25 @@
+#ifndef YAMALLOC_PAGE_MAP_H
+#define YAMALLOC_PAGE_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The page map is a three-level radix tree indexed by page number (48-bit
+// addresses, 4 KiB pages, 12 bits per level). Its nodes are mapped directly
+// from the kernel, so the metadata never shares cache lines with user data.
+#define PAGE_MAP_PAGE_SHIFT 12
+#define PAGE_MAP_LEVEL_BITS 12
+#define PAGE_MAP_LEVEL_SIZE ((size_t)1 << PAGE_MAP_LEVEL_BITS)
+
+// Page values. The low byte is the kind of the page, the rest is owned by
+// the kind (the size class for small spans).
+#define PAGE_MAP_NONE ((uintptr_t)0)
+#define PAGE_MAP_BACKEND ((uintptr_t)1)
+#define PAGE_MAP_SMALL ((uintptr_t)2)
+#define PAGE_MAP_KIND_MASK ((uintptr_t)0xFF)
+#define PAGE_MAP_CLASS_SHIFT 8
+
+extern int page_map_set(const void *addr, size_t size, uintptr_t value);
+extern uintptr_t page_map_get(const void *addr);
+
+#endif // YAMALLOC_PAGE_MAP_H
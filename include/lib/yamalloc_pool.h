@@ -0,0 +1,59 @@
+#ifndef YAMALLOC_POOL_H
+#define YAMALLOC_POOL_H
+
+#include "yamalloc.h"
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#define YAPOOL_MIN_ALIGNMENT 8
+#define YAPOOL_DEFAULT_OBJS_PER_CHUNK 64
+
+#ifdef YAMALLOC_THREAD_SAFE
+// Per-thread caches of free objects. A thread has YAPOOL_MAGAZINE_SLOTS
+// magazines, each caching one pool; a pool that has none takes an unused
+// slot, or else the least recently used one.
+#define YAPOOL_MAGAZINE_SIZE 32
+#define YAPOOL_MAGAZINE_SLOTS 8
+
+typedef struct YaPoolMagazine {
+	uint64_t pool_id;
+	// Per-thread tick of the last use, to pick the slot to evict
+	uint64_t last_use;
+	size_t count;
+	void *objs[YAPOOL_MAGAZINE_SIZE];
+} YaPoolMagazine;
+#endif
+
+typedef struct YaPoolChunk {
+	struct YaPoolChunk *next;
+	char *objs;
+} YaPoolChunk;
+
+struct YaPool {
+	size_t align;
+	// Distance between two objects in a chunk
+	size_t stride;
+	size_t objs_per_chunk;
+	// Offset of the free-stack link inside a free object. It lies past
+	// the object when the objects are pre-constructed.
+	size_t link_offset;
+	// Chunks of the pool, the one being carved first
+	YaPoolChunk *chunks;
+	char *bump;
+	char *end;
+	void *free;
+	YaPoolCallback init;
+	YaPoolCallback fini;
+	void *ctx;
+#ifdef YAMALLOC_THREAD_SAFE
+	uint64_t id;
+	struct YaPool *next;
+	pthread_mutex_t lock;
+#endif
+};
+
+extern void yapool_flush_thread_cache(void);
+
+#endif // YAMALLOC_POOL_H
@@ -0,0 +1,94 @@
+#ifndef YAMALLOC_PROFILE_H
+#define YAMALLOC_PROFILE_H
+
+#include "yamalloc.h"
+
+// Frames kept for each sample
+#define PROFILE_MAX_DEPTH 32
+// Chains of the table of live samples
+#define PROFILE_BUCKETS 4096
+// Counters of the filter that lets frees skip the table
+#define PROFILE_FILTER_BITS 16
+#define PROFILE_FILTER_SIZE ((size_t)1 << PROFILE_FILTER_BITS)
+// Bytes between two checks of the interval while sampling is off
+#define PROFILE_DISABLED_RECHECK (16 * 1024 * 1024)
+
+typedef struct ProfileSample {
+	uintptr_t ptr;
+	size_t size;
+	size_t depth;
+	void *stack[PROFILE_MAX_DEPTH];
+	struct ProfileSample *next;
+} ProfileSample;
+
+// PROFILE_ALLOC(ptr, size) and PROFILE_FREE(ptr) expand to nothing unless
+// YAMALLOC_PROFILE is defined. An allocation only costs a subtraction from
+// the bytes left before the next sample of the thread; a free only costs a
+// load from the filter, which counts the live samples by address hash.
+// PROFILE_DETACH(ptr, sample) takes the sample of an object that may be
+// freed out of the table; PROFILE_KEEP(sample) puts it back when the object
+// stays with its owner and PROFILE_DROP(sample) recycles it otherwise.
+#ifdef YAMALLOC_PROFILE
+#ifdef YAMALLOC_THREAD_SAFE
+extern __thread int64_t profile_countdown;
+#else
+extern int64_t profile_countdown;
+#endif
+extern uint8_t profile_filter[PROFILE_FILTER_SIZE];
+extern void profile_sample(void *ptr, size_t size);
+extern void profile_forget(void *ptr);
+extern ProfileSample *profile_detach(void *ptr);
+extern void profile_attach(ProfileSample *sample);
+extern void profile_drop(ProfileSample *sample);
+
+static inline size_t profile_filter_index(const void *ptr)
+{
+	return (size_t)(((uint64_t)(uintptr_t)ptr >> 4) *
+			    0x9E3779B97F4A7C15ULL >>
+			(64 - PROFILE_FILTER_BITS));
+}
+
+#define PROFILE_ALLOC(ptr, size)                                               \
+	do {                                                                   \
+		profile_countdown -= (int64_t)(size);                          \
+		if (profile_countdown < 0) {                                   \
+			profile_sample(ptr, size);                             \
+		}                                                              \
+	} while (0)
+#define PROFILE_FREE(ptr)                                                      \
+	do {                                                                   \
+		size_t index_ = profile_filter_index(ptr);                     \
+		if (__atomic_load_n(&profile_filter[index_],                   \
+				    __ATOMIC_RELAXED)) {                       \
+			profile_forget(ptr);                                   \
+		}                                                              \
+	} while (0)
+#define PROFILE_DETACH(ptr, sample)                                            \
+	do {                                                                   \
+		size_t index_ = profile_filter_index(ptr);                     \
+		(sample) = __atomic_load_n(&profile_filter[index_],            \
+					   __ATOMIC_RELAXED)                   \
+			       ? profile_detach(ptr)                           \
+			       : NULL;                                         \
+	} while (0)
+#define PROFILE_KEEP(sample)                                                   \
+	do {                                                                   \
+		if (sample) {                                                  \
+			profile_attach(sample);                                \
+		}                                                              \
+	} while (0)
+#define PROFILE_DROP(sample)                                                   \
+	do {                                                                   \
+		if (sample) {                                                  \
+			profile_drop(sample);                                  \
+		}                                                              \
+	} while (0)
+#else
+#define PROFILE_ALLOC(ptr, size) ((void)0)
+#define PROFILE_FREE(ptr) ((void)0)
+#define PROFILE_DETACH(ptr, sample) ((void)(ptr), (sample) = NULL)
+#define PROFILE_KEEP(sample) ((void)(sample))
+#define PROFILE_DROP(sample) ((void)(sample))
+#endif
+
+#endif // YAMALLOC_PROFILE_H
@@ -0,0 +1,45 @@
+#ifndef YAMALLOC_SMALL_H
+#define YAMALLOC_SMALL_H
+
+#include "yamalloc.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Small objects have no header: they are carved out of spans whose size
+// class is recorded in the page map.
+#define SMALL_QUANTUM 8
+#define SMALL_MAX_SIZE 256
+#define SMALL_CLASS_COUNT (SMALL_MAX_SIZE / SMALL_QUANTUM)
+#define SMALL_SPAN_SIZE (64 * 1024)
+
+typedef struct SmallFreeObject {
+	struct SmallFreeObject *next;
+} SmallFreeObject;
+
+typedef struct SmallClass {
+	SmallFreeObject *free;
+	size_t free_count;
+	char *bump;
+	char *end;
+	// Spans of the class, in mapping order: the last one is being carved
+	char **spans;
+	size_t span_count;
+	size_t span_capacity;
+} SmallClass;
+
+static inline size_t small_class_of(size_t size)
+{
+	return size == 0 ? 0 : (size - 1) / SMALL_QUANTUM;
+}
+
+static inline size_t small_class_size(size_t class_index)
+{
+	return (class_index + 1) * SMALL_QUANTUM;
+}
+
+extern void *small_yamalloc(size_t size);
+extern void small_yafree(void *ptr, size_t class_index);
+extern void small_free_stats(size_t *bytes, size_t *blocks, size_t *largest);
+extern int small_heap_walk(YamallocWalkCallback callback, void *ctx);
+
+#endif // YAMALLOC_SMALL_H
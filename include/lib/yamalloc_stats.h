@@ -0,0 +1,28 @@
+#ifndef YAMALLOC_STATS_H
+#define YAMALLOC_STATS_H
+
+#include "yamalloc.h"
+
+// Counters updated on every allocation. With YAMALLOC_THREAD_SAFE each
+// thread owns a copy, which only that thread writes; readers sum them up.
+typedef struct YamallocThreadStats {
+	int64_t bytes_in_use;
+	int64_t blocks_in_use;
+	uint64_t alloc_count;
+	uint64_t free_count;
+	uint64_t size_histogram[YAMALLOC_STATS_HISTOGRAM_SIZE];
+#ifdef YAMALLOC_INSTRUMENT
+	struct yamalloc_latency latency;
+#endif
+	struct YamallocThreadStats *next;
+} YamallocThreadStats;
+
+extern void stats_record_alloc(size_t size, size_t usable_size);
+extern void stats_record_free(size_t usable_size);
+extern void stats_record_realloc(size_t size, size_t old_usable_size,
+				 size_t new_usable_size);
+extern void stats_record_sbrk(intptr_t increment);
+extern void stats_record_mmap(size_t size);
+extern void stats_record_munmap(size_t size);
+
+#endif // YAMALLOC_STATS_H
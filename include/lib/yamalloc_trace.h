@@ -0,0 +1,45 @@
+#ifndef YAMALLOC_TRACE_H
+#define YAMALLOC_TRACE_H
+
+#include "yamalloc.h"
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+// Records handed to the trace file in a single write
+#define TRACE_BUFFER_RECORDS 1024
+
+typedef struct TraceBuffer {
+	struct yamalloc_trace_record records[TRACE_BUFFER_RECORDS];
+	size_t count;
+	uint32_t thread;
+	// Trace the records belong to: records left behind by a stopped trace
+	// are dropped instead of leaking into the next one
+	uint32_t generation;
+#ifdef YAMALLOC_THREAD_SAFE
+	// Taken by the owner on each record, and by yamalloc_trace_stop()
+	// when it flushes the buffers of the other threads
+	pthread_mutex_t lock;
+	struct TraceBuffer *next;
+#endif
+} TraceBuffer;
+
+// TRACE_RECORD(op, size, id, new_id) expands to nothing unless
+// YAMALLOC_TRACE is defined
+#ifdef YAMALLOC_TRACE
+extern int trace_enabled;
+extern void trace_record(uint32_t op, size_t size, const void *id,
+			 const void *new_id);
+
+#define TRACE_RECORD(op, size, id, new_id)                                     \
+	do {                                                                   \
+		if (__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE)) {       \
+			trace_record(op, size, id, new_id);                    \
+		}                                                              \
+	} while (0)
+#else
+#define TRACE_RECORD(op, size, id, new_id) ((void)0)
+#endif
+
+#endif // YAMALLOC_TRACE_H
@@ -0,0 +1,344 @@
+#include "heap_map.h"
+#include "yamalloc.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEAP_MAP_DEFAULT_OPS 200000
+#define HEAP_MAP_DEFAULT_LIVE 4096
+#define HEAP_MAP_DEFAULT_GRANULARITY 4096
+// Cells printed on each line of the map
+#define HEAP_MAP_WIDTH 64
+// Power-of-two buckets of the free block sizes
+#define HEAP_MAP_BUCKETS 48
+
+// The blocks are collected in memory from the C library, so that the map
+// does not disturb the heap it describes.
+typedef struct HeapMapBlocks {
+	struct yamalloc_block *blocks;
+	size_t count;
+	size_t capacity;
+} HeapMapBlocks;
+
+typedef struct HeapMapCell {
+	size_t used;
+	size_t free;
+} HeapMapCell;
+
+static int heap_map_count(const struct yamalloc_block *block, void *ctx)
+{
+	(void)block;
+	((HeapMapBlocks *)ctx)->capacity++;
+	return 0;
+}
+
+static int heap_map_collect(const struct yamalloc_block *block, void *ctx)
+{
+	HeapMapBlocks *map = (HeapMapBlocks *)ctx;
+
+	// The heap cannot grow between the two walks of a single thread, but
+	// stop rather than overflow if it did.
+	if (map->count == map->capacity) {
+		return 1;
+	}
+	map->blocks[map->count++] = *block;
+	return 0;
+}
+
+static int heap_map_compare(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)((const struct yamalloc_block *)a)->address;
+	uintptr_t y = (uintptr_t)((const struct yamalloc_block *)b)->address;
+
+	return (x > y) - (x < y);
+}
+
+static size_t heap_map_bucket(size_t size)
+{
+	size_t bucket = 0;
+
+	while (bucket < HEAP_MAP_BUCKETS - 1 && ((size_t)1 << bucket) < size) {
+		bucket++;
+	}
+	return bucket;
+}
+
+/**
+ * @brief Prints a run of contiguous blocks, one character per cell
+ *
+ * '#' marks a cell that is entirely in use, '.' one that is entirely free
+ * and '+' one that holds both.
+ *
+ * @param[in] out Stream to print to
+ * @param[in] blocks Contiguous blocks, sorted by address
+ * @param[in] count Number of blocks
+ * @param[in] granularity Bytes per cell
+ * @return void
+ */
+static void heap_map_write_region(FILE *out,
+				  const struct yamalloc_block *blocks,
+				  size_t count, size_t granularity)
+{
+	uintptr_t start = (uintptr_t)blocks[0].address;
+	uintptr_t end = (uintptr_t)blocks[count - 1].address +
+			blocks[count - 1].size;
+	size_t cells = (end - start + granularity - 1) / granularity;
+	HeapMapCell *cell = (HeapMapCell *)calloc(cells, sizeof(HeapMapCell));
+
+	if (!cell) {
+		fprintf(out, "%#lx +%lu (out of memory)\n",
+			(unsigned long)start, (unsigned long)(end - start));
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		uintptr_t from = (uintptr_t)blocks[i].address;
+		uintptr_t to = from + blocks[i].size;
+
+		while (from < to) {
+			size_t index = (from - start) / granularity;
+			uintptr_t cell_end = start + (index + 1) * granularity;
+			size_t bytes = (cell_end < to ? cell_end : to) - from;
+
+			if (blocks[i].free) {
+				cell[index].free += bytes;
+			} else {
+				cell[index].used += bytes;
+			}
+			from += bytes;
+		}
+	}
+
+	fprintf(out, "%#lx +%lu\n", (unsigned long)start,
+		(unsigned long)(end - start));
+	for (size_t i = 0; i < cells; i++) {
+		if (cell[i].free == 0) {
+			fputc('#', out);
+		} else {
+			fputc(cell[i].used == 0 ? '.' : '+', out);
+		}
+		if ((i + 1) % HEAP_MAP_WIDTH == 0 || i + 1 == cells) {
+			fputc('\n', out);
+		}
+	}
+	free(cell);
+}
+
+/**
+ * @brief Writes the map of the heap followed by a fragmentation summary
+ *
+ * @param[in] out Stream to write to
+ * @param[in] granularity Bytes represented by each character of the map
+ * @return void
+ */
+void heap_map_write(FILE *out, size_t granularity)
+{
+	HeapMapBlocks map = {NULL, 0, 0};
+	size_t free_count[HEAP_MAP_BUCKETS] = {0};
+	size_t free_bytes[HEAP_MAP_BUCKETS] = {0};
+	size_t used = 0, used_blocks = 0;
+	size_t unused = 0, unused_blocks = 0;
+	size_t largest = 0, padding = 0;
+	size_t first = 0;
+
+	yamalloc_heap_walk(heap_map_count, &map);
+	if (map.capacity != 0) {
+		map.blocks = (struct yamalloc_block *)malloc(
+		    map.capacity * sizeof(struct yamalloc_block));
+		if (!map.blocks) {
+			fprintf(out, "out of memory\n");
+			return;
+		}
+		yamalloc_heap_walk(heap_map_collect, &map);
+		qsort(map.blocks, map.count, sizeof(struct yamalloc_block),
+		      heap_map_compare);
+	}
+
+	fprintf(out, "heap map: %zu bytes per character, '#' in use, "
+		     "'.' free, '+' both\n",
+		granularity);
+	for (size_t i = 0; i < map.count; i++) {
+		struct yamalloc_block *block = &map.blocks[i];
+
+		if (block->free) {
+			unused += block->size;
+			unused_blocks++;
+			free_count[heap_map_bucket(block->size)]++;
+			free_bytes[heap_map_bucket(block->size)] += block->size;
+			if (block->size > largest) {
+				largest = block->size;
+			}
+		} else {
+			used += block->size;
+			used_blocks++;
+			padding += block->padding;
+		}
+		if (i + 1 == map.count ||
+		    (char *)block->address + block->size !=
+			(char *)map.blocks[i + 1].address) {
+			heap_map_write_region(out, &map.blocks[first],
+					      i + 1 - first, granularity);
+			first = i + 1;
+		}
+	}
+
+	fprintf(out, "\nin use:             %zu bytes in %zu blocks\n", used,
+		used_blocks);
+	fprintf(out, "free:               %zu bytes in %zu blocks\n", unused,
+		unused_blocks);
+	fprintf(out, "largest free block: %zu bytes\n", largest);
+	fprintf(out, "fragmentation:      %.2f%%\n",
+		unused == 0 ? 0.0
+			    : 100.0 * (1.0 - (double)largest / (double)unused));
+	fprintf(out, "wasted padding:     %zu bytes (%.2f%% of in use)\n",
+		padding, used == 0 ? 0.0 : 100.0 * padding / used);
+	fprintf(out, "free block sizes:\n");
+	for (size_t i = 0; i < HEAP_MAP_BUCKETS; i++) {
+		if (free_count[i] != 0) {
+			fprintf(out, "  <= %-12zu %8zu blocks %12zu bytes\n",
+				(size_t)1 << i, free_count[i], free_bytes[i]);
+		}
+	}
+	free(map.blocks);
+}
+
+static uint64_t heap_map_random(uint64_t *state)
+{
+	// xorshift64*, so that a seed always replays the same workload
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Mostly small requests, with a tail of medium and large ones
+static size_t heap_map_size(uint64_t *state)
+{
+	uint64_t r = heap_map_random(state);
+
+	switch (r % 20) {
+	case 0:
+		return 4096 + (size_t)(r >> 8) % (60 * 1024);
+	case 1:
+	case 2:
+	case 3:
+	case 4:
+	case 5:
+		return 256 + (size_t)(r >> 8) % 3840;
+	default:
+		return 8 + (size_t)(r >> 8) % 248;
+	}
+}
+
+/**
+ * @brief Runs a random workload and leaves its live objects allocated
+ *
+ * Each operation picks a slot: an empty slot is filled, a full one is
+ * reallocated one time out of eight and freed otherwise.
+ *
+ * @param[in] ops Number of operations
+ * @param[in] live Number of slots
+ * @param[in] seed Seed of the workload
+ * @return int 0 on success, -1 if the slots could not be allocated
+ */
+static int heap_map_workload(size_t ops, size_t live, uint64_t seed)
+{
+	void **slots = (void **)calloc(live, sizeof(void *));
+	uint64_t state = seed == 0 ? 1 : seed;
+
+	if (!slots) {
+		return -1;
+	}
+	for (size_t i = 0; i < ops; i++) {
+		uint64_t r = heap_map_random(&state);
+		size_t slot = (size_t)(r % live);
+
+		if (!slots[slot]) {
+			slots[slot] = yamalloc(heap_map_size(&state));
+		} else if ((r >> 32) % 8 == 0) {
+			size_t size = heap_map_size(&state);
+			void *ptr = yarealloc(slots[slot], size);
+			if (ptr) {
+				slots[slot] = ptr;
+			}
+		} else {
+			yafree(slots[slot]);
+			slots[slot] = NULL;
+		}
+	}
+	free(slots);
+	return 0;
+}
+
+static void heap_map_usage(void)
+{
+	fprintf(stderr,
+		"usage: main heap-map [-n ops] [-l live] [-s seed] "
+		"[-g granularity] [-o path]\n");
+}
+
+/**
+ * @brief Entry point of the heap-map command
+ *
+ * @param[in] argc Number of arguments after the command name
+ * @param[in] argv Arguments after the command name
+ * @return int Exit status
+ */
+int heap_map_main(int argc, char **argv)
+{
+	size_t ops = HEAP_MAP_DEFAULT_OPS;
+	size_t live = HEAP_MAP_DEFAULT_LIVE;
+	size_t granularity = HEAP_MAP_DEFAULT_GRANULARITY;
+	uint64_t seed = 1;
+	const char *path = NULL;
+	FILE *out = stdout;
+
+	for (int i = 0; i < argc; i++) {
+		if (i + 1 == argc || argv[i][0] != '-' || argv[i][1] == '\0' ||
+		    argv[i][2] != '\0') {
+			heap_map_usage();
+			return 1;
+		}
+		const char *value = argv[++i];
+		switch (argv[i - 1][1]) {
+		case 'n':
+			ops = strtoul(value, NULL, 10);
+			break;
+		case 'l':
+			live = strtoul(value, NULL, 10);
+			break;
+		case 's':
+			seed = strtoull(value, NULL, 10);
+			break;
+		case 'g':
+			granularity = strtoul(value, NULL, 10);
+			break;
+		case 'o':
+			path = value;
+			break;
+		default:
+			heap_map_usage();
+			return 1;
+		}
+	}
+	if (live == 0 || granularity == 0) {
+		heap_map_usage();
+		return 1;
+	}
+
+	if (heap_map_workload(ops, live, seed) != 0) {
+		fprintf(stderr, "heap-map: out of memory\n");
+		return 1;
+	}
+	if (path) {
+		out = fopen(path, "w");
+		if (!out) {
+			perror(path);
+			return 1;
+		}
+	}
+	heap_map_write(out, granularity);
+	if (path) {
+		fclose(out);
+	}
+	return 0;
+}
@@ -1,10 +1,19 @@
+#include "heap_map.h"
+#include "replay.h"
 #include "yamalloc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-int main()
+int main(int argc, char **argv)
 {
+	if (argc > 1 && strcmp(argv[1], "heap-map") == 0) {
+		return heap_map_main(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+		return replay_main(argc - 2, argv + 2);
+	}
+
 	char *str = (char *)yamalloc(14 * sizeof(char));
 	if (str == NULL) {
 		return 1;
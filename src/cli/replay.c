@@ -0,0 +1,337 @@
+#include "replay.h"
+#include "heap_map.h"
+#include "yamalloc.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Live objects are sampled for the peak resident set every so many records
+#define REPLAY_RSS_PERIOD 1024
+
+// Live objects of the replay, keyed by their id in the trace. Open
+// addressing with linear probing; freed slots become tombstones.
+typedef struct ReplayObject {
+	uint64_t id;
+	void *ptr;
+} ReplayObject;
+
+typedef struct ReplayTable {
+	ReplayObject *slots;
+	size_t capacity;
+	size_t used; // live objects and tombstones
+	size_t live;
+} ReplayTable;
+
+#define REPLAY_MIN_CAPACITY 1024
+
+#define REPLAY_EMPTY ((uint64_t)0)
+#define REPLAY_TOMBSTONE (~(uint64_t)0)
+
+typedef struct ReplayRecord {
+	struct yamalloc_trace_record record;
+	size_t index; // position in the file, to keep the sort stable
+} ReplayRecord;
+
+static size_t replay_hash(uint64_t id)
+{
+	id ^= id >> 33;
+	id *= 0xFF51AFD7ED558CCDULL;
+	id ^= id >> 33;
+	return (size_t)id;
+}
+
+static ReplayObject *replay_find(ReplayTable *table, uint64_t id)
+{
+	size_t mask = table->capacity - 1;
+
+	for (size_t i = replay_hash(id) & mask;; i = (i + 1) & mask) {
+		if (table->slots[i].id == id) {
+			return &table->slots[i];
+		}
+		if (table->slots[i].id == REPLAY_EMPTY) {
+			return NULL;
+		}
+	}
+}
+
+static int replay_insert(ReplayTable *table, uint64_t id, void *ptr);
+
+// Rehashes the live objects, dropping the tombstones
+static int replay_grow(ReplayTable *table)
+{
+	ReplayTable bigger = {NULL, REPLAY_MIN_CAPACITY, 0, 0};
+
+	while (bigger.capacity < 4 * table->live) {
+		bigger.capacity *= 2;
+	}
+	bigger.slots = (ReplayObject *)calloc(bigger.capacity,
+					      sizeof(ReplayObject));
+	if (!bigger.slots) {
+		return -1;
+	}
+	for (size_t i = 0; i < table->capacity; i++) {
+		uint64_t id = table->slots[i].id;
+		if (id != REPLAY_EMPTY && id != REPLAY_TOMBSTONE) {
+			replay_insert(&bigger, id, table->slots[i].ptr);
+		}
+	}
+	free(table->slots);
+	*table = bigger;
+	return 0;
+}
+
+static int replay_insert(ReplayTable *table, uint64_t id, void *ptr)
+{
+	size_t mask;
+	size_t i;
+
+	if (2 * (table->used + 1) > table->capacity &&
+	    replay_grow(table) != 0) {
+		return -1;
+	}
+	mask = table->capacity - 1;
+	for (i = replay_hash(id) & mask; table->slots[i].id != REPLAY_EMPTY;
+	     i = (i + 1) & mask) {
+	}
+	table->slots[i].id = id;
+	table->slots[i].ptr = ptr;
+	table->used++;
+	table->live++;
+	return 0;
+}
+
+static void replay_remove(ReplayTable *table, ReplayObject *object)
+{
+	object->id = REPLAY_TOMBSTONE;
+	table->live--;
+}
+
+static int replay_compare(const void *a, const void *b)
+{
+	const ReplayRecord *x = (const ReplayRecord *)a;
+	const ReplayRecord *y = (const ReplayRecord *)b;
+
+	if (x->record.timestamp != y->record.timestamp) {
+		return x->record.timestamp < y->record.timestamp ? -1 : 1;
+	}
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * @brief Loads a trace and sorts its records by timestamp
+ *
+ * @param[in] path Trace file
+ * @param[out] count Number of records
+ * @return ReplayRecord* Records, to release with free(), NULL on failure
+ */
+static ReplayRecord *replay_load(const char *path, size_t *count)
+{
+	struct yamalloc_trace_header header;
+	ReplayRecord *records = NULL;
+	size_t capacity = 0;
+	FILE *in = fopen(path, "rb");
+
+	*count = 0;
+	if (!in) {
+		perror(path);
+		return NULL;
+	}
+	if (fread(&header, sizeof(header), 1, in) != 1 ||
+	    memcmp(header.magic, YAMALLOC_TRACE_MAGIC,
+		   sizeof(YAMALLOC_TRACE_MAGIC)) != 0 ||
+	    header.version != YAMALLOC_TRACE_VERSION ||
+	    header.record_size != sizeof(struct yamalloc_trace_record)) {
+		fprintf(stderr, "%s: not a yamalloc trace\n", path);
+		fclose(in);
+		return NULL;
+	}
+	for (;;) {
+		if (*count == capacity) {
+			size_t bigger = capacity == 0 ? 4096 : capacity * 2;
+			ReplayRecord *grown = (ReplayRecord *)realloc(
+			    records, bigger * sizeof(ReplayRecord));
+			if (!grown) {
+				fprintf(stderr, "replay: out of memory\n");
+				free(records);
+				fclose(in);
+				return NULL;
+			}
+			records = grown;
+			capacity = bigger;
+		}
+		if (fread(&records[*count].record,
+			  sizeof(struct yamalloc_trace_record), 1, in) != 1) {
+			break;
+		}
+		records[*count].index = *count;
+		(*count)++;
+	}
+	fclose(in);
+	qsort(records, *count, sizeof(ReplayRecord), replay_compare);
+	return records;
+}
+
+// Resident set size of the process, in bytes (0 where it is not known)
+static size_t replay_rss(void)
+{
+	unsigned long pages = 0;
+	unsigned long resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if (!statm) {
+		return 0;
+	}
+	if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(statm);
+	return (size_t)resident * 4096;
+}
+
+static double replay_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Replays the records against the allocator, in timestamp order
+ *
+ * The records of all the threads are replayed by the calling thread. Calls
+ * that raced in the traced program may appear slightly out of order, so an
+ * object allocated twice is freed first and frees of unknown objects are
+ * ignored.
+ *
+ * @param[in] records Records sorted by timestamp
+ * @param[in] count Number of records
+ * @param[out] peak_rss Peak growth of the resident set (in bytes)
+ * @param[out] seconds Time spent in the allocator calls
+ * @return int 0 on success, -1 if the replay ran out of memory
+ */
+static int replay_run(const ReplayRecord *records, size_t count,
+		      size_t *peak_rss, double *seconds)
+{
+	ReplayTable table = {NULL, REPLAY_MIN_CAPACITY, 0, 0};
+	size_t base_rss = replay_rss();
+	double elapsed = 0.0;
+
+	table.slots = (ReplayObject *)calloc(table.capacity,
+					     sizeof(ReplayObject));
+	if (!table.slots) {
+		return -1;
+	}
+	*peak_rss = 0;
+	for (size_t i = 0; i < count; i++) {
+		const struct yamalloc_trace_record *r = &records[i].record;
+		ReplayObject *object = replay_find(&table, r->id);
+		void *old = object ? object->ptr : NULL;
+		void *ptr = NULL;
+		double start;
+
+		if (object) {
+			replay_remove(&table, object);
+		}
+		start = replay_seconds();
+		switch (r->op) {
+		case YAMALLOC_TRACE_MALLOC:
+			yafree(old);
+			ptr = yamalloc((size_t)r->size);
+			break;
+		case YAMALLOC_TRACE_CALLOC:
+			yafree(old);
+			ptr = yacalloc(1, (size_t)r->size);
+			break;
+		case YAMALLOC_TRACE_REALLOC:
+			ptr = yarealloc(old, (size_t)r->size);
+			if (!ptr) {
+				yafree(old);
+			}
+			break;
+		case YAMALLOC_TRACE_FREE:
+			yafree(old);
+			break;
+		}
+		elapsed += replay_seconds() - start;
+
+		uint64_t id =
+		    r->op == YAMALLOC_TRACE_REALLOC ? r->new_id : r->id;
+		if (ptr && replay_insert(&table, id, ptr) != 0) {
+			free(table.slots);
+			return -1;
+		}
+		if (i % REPLAY_RSS_PERIOD == 0 || i + 1 == count) {
+			size_t rss = replay_rss();
+			if (rss > base_rss && rss - base_rss > *peak_rss) {
+				*peak_rss = rss - base_rss;
+			}
+		}
+	}
+	free(table.slots);
+	*seconds = elapsed;
+	return 0;
+}
+
+static void replay_usage(void)
+{
+	fprintf(stderr, "usage: main replay <trace> [-m heap-map-path]\n");
+}
+
+/**
+ * @brief Entry point of the replay command
+ *
+ * @param[in] argc Number of arguments after the command name
+ * @param[in] argv Arguments after the command name
+ * @return int Exit status
+ */
+int replay_main(int argc, char **argv)
+{
+	const char *map_path = NULL;
+	struct yamalloc_stats stats;
+	ReplayRecord *records;
+	size_t count;
+	size_t peak_rss;
+	double seconds;
+
+	if (argc == 3 && strcmp(argv[1], "-m") == 0) {
+		map_path = argv[2];
+	} else if (argc != 1) {
+		replay_usage();
+		return 1;
+	}
+
+	records = replay_load(argv[0], &count);
+	if (!records) {
+		return 1;
+	}
+	if (replay_run(records, count, &peak_rss, &seconds) != 0) {
+		fprintf(stderr, "replay: out of memory\n");
+		free(records);
+		return 1;
+	}
+	free(records);
+
+	yamalloc_stats(&stats);
+	printf("records:            %zu\n", count);
+	printf("throughput:         %.0f ops/s\n",
+	       seconds > 0.0 ? (double)count / seconds : 0.0);
+	printf("peak RSS growth:    %zu bytes\n", peak_rss);
+	printf("heap size:          %zu bytes\n", stats.heap_size);
+	printf("in use at the end:  %zu bytes in %zu blocks\n",
+	       stats.bytes_in_use, stats.blocks_in_use);
+	printf("fragmentation:      %.2f%%\n", stats.fragmentation * 100.0);
+
+	if (map_path) {
+		FILE *out = fopen(map_path, "w");
+		if (!out) {
+			perror(map_path);
+			return 1;
+		}
+		heap_map_write(out, 4096);
+		fclose(out);
+	}
+	return 0;
+}
@@ -1,4 +1,10 @@
 #include "yamalloc.h"
+#include "yamalloc_arena.h"
+#include "yamalloc_limit.h"
+#include "yamalloc_profile.h"
+#include "yamalloc_stats.h"
+#include "yamalloc_trace.h"
+#include <string.h>
 
 #if (defined(YAMALLOC_LINKED_LIST) && defined(YAMALLOC_FREE_LIST_LL)) ||       \
     (defined(YAMALLOC_FREE_LIST_LL) && defined(YAMALLOC_FREE_LIST_RBT)) ||     \
@@ -24,18 +30,36 @@
 #include "yamalloc_red_black.h"
 #endif // YAMALLOC_FREE_LIST_RBT
 
-void *yamalloc(size_t size)
+#ifdef YAMALLOC_PAGE_MAP
+#include "yamalloc_page_map.h"
+#include "yamalloc_small.h"
+#endif // YAMALLOC_PAGE_MAP
+
+// Only the free_list_ll backend places blocks by lifetime
+static void *backend_yamallocx(size_t size, int lifetime)
 {
 #ifdef YAMALLOC_LINKED_LIST
+	(void)lifetime;
 	return linked_list_yamalloc(size);
 #elif YAMALLOC_FREE_LIST_LL
-	return free_list_ll_yamalloc(size);
+	return free_list_ll_yamallocx(size, lifetime);
 #elif YAMALLOC_FREE_LIST_RBT
-	return free_list_rbt_yamalloc(size);
+	return free_list_rbt_yamallocx(size, lifetime);
 #endif
 }
 
-void *yacalloc(size_t num, size_t size)
+static void *backend_yaaligned_alloc(size_t alignment, size_t size)
+{
+#ifdef YAMALLOC_LINKED_LIST
+	return linked_list_yaaligned_alloc(alignment, size);
+#elif YAMALLOC_FREE_LIST_LL
+	return free_list_ll_yaaligned_alloc(alignment, size);
+#elif YAMALLOC_FREE_LIST_RBT
+	return free_list_rbt_yaaligned_alloc(alignment, size);
+#endif
+}
+
+static void *backend_yacalloc(size_t num, size_t size)
 {
 #ifdef YAMALLOC_LINKED_LIST
 	return linked_list_yacalloc(num, size);
@@ -46,7 +70,7 @@ void *yacalloc(size_t num, size_t size)
 #endif
 }
 
-void *yarealloc(void *ptr, size_t size)
+static void *backend_yarealloc(void *ptr, size_t size)
 {
 #ifdef YAMALLOC_LINKED_LIST
 	return linked_list_yarealloc(ptr, size);
@@ -57,7 +81,7 @@ void *yarealloc(void *ptr, size_t size)
 #endif
 }
 
-void yafree(void *ptr)
+static void backend_yafree(void *ptr)
 {
 #ifdef YAMALLOC_LINKED_LIST
 	linked_list_yafree(ptr);
@@ -67,3 +91,503 @@ void yafree(void *ptr)
 	free_list_rbt_yafree(ptr);
 #endif
 }
+
+static size_t backend_usable_size(void *ptr)
+{
+#ifdef YAMALLOC_LINKED_LIST
+	return linked_list_usable_size(ptr);
+#elif YAMALLOC_FREE_LIST_LL
+	return free_list_ll_usable_size(ptr);
+#elif YAMALLOC_FREE_LIST_RBT
+	return free_list_rbt_usable_size(ptr);
+#endif
+}
+
+static int backend_resize(void *ptr, size_t size)
+{
+#ifdef YAMALLOC_LINKED_LIST
+	return linked_list_resize(ptr, size);
+#elif YAMALLOC_FREE_LIST_LL
+	return free_list_ll_resize(ptr, size);
+#elif YAMALLOC_FREE_LIST_RBT
+	return free_list_rbt_resize(ptr, size);
+#endif
+}
+
+#ifdef YAMALLOC_PAGE_MAP
+// Small requests are served by header-less size classes. A pointer always
+// lives in the class of the size it was last (re)allocated with, which is
+// what lets yafree_sized() skip the page map.
+static void *small_yarealloc(void *ptr, size_t class_index, size_t size)
+{
+	size_t old_size = small_class_size(class_index);
+	void *new_ptr;
+
+	if (size <= SMALL_MAX_SIZE && small_class_of(size) == class_index) {
+		return ptr;
+	}
+	new_ptr = size <= SMALL_MAX_SIZE ? small_yamalloc(size)
+					 : backend_yamallocx(size, 0);
+	if (new_ptr) {
+		memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+		small_yafree(ptr, class_index);
+	}
+	return new_ptr;
+}
+#endif // YAMALLOC_PAGE_MAP
+
+/**
+ * @brief Allocates a block, placed according to its expected lifetime
+ *
+ * @param[in] size Size (in bytes) of the block to allocate
+ * @param[in] lifetime YAMALLOCX_SHORT_LIVED, YAMALLOCX_LONG_LIVED or 0
+ * @return void* Pointer to the allocated block, NULL on failure
+ */
+static void *yamalloc_lifetime(size_t size, int lifetime)
+{
+	void *ptr;
+
+	LIMIT_CHECK();
+#ifdef YAMALLOC_PAGE_MAP
+	if (size <= SMALL_MAX_SIZE) {
+		ptr = small_yamalloc(size);
+		if (ptr) {
+			stats_record_alloc(
+			    size, small_class_size(small_class_of(size)));
+			TRACE_RECORD(YAMALLOC_TRACE_MALLOC, size, ptr, NULL);
+			PROFILE_ALLOC(ptr, size);
+		}
+		return ptr;
+	}
+#endif
+	ptr = backend_yamallocx(size, lifetime);
+	if (ptr) {
+		stats_record_alloc(size, backend_usable_size(ptr));
+		TRACE_RECORD(YAMALLOC_TRACE_MALLOC, size, ptr, NULL);
+		PROFILE_ALLOC(ptr, size);
+	}
+	return ptr;
+}
+
+void *yamalloc(size_t size) { return yamalloc_lifetime(size, 0); }
+
+/**
+ * @brief Allocates a block whose address is a multiple of alignment
+ *
+ * As aligned_alloc() in C11, size is rounded up to a multiple of alignment;
+ * the rounded size is the one to pass to yafree_sized().
+ *
+ * @param[in] alignment Alignment (in bytes), a power of two
+ * @param[in] size Size (in bytes) of the block to allocate
+ * @return void* Pointer to the allocated block, NULL on failure or if
+ * alignment is not a power of two
+ */
+void *yaaligned_alloc(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+	    size > ~(size_t)0 - alignment) {
+		return NULL;
+	}
+	size = (size + alignment - 1) & ~(alignment - 1);
+	if (alignment <= YAMALLOC_ALIGNMENT) {
+		return yamalloc(size);
+	}
+	LIMIT_CHECK();
+#ifdef YAMALLOC_PAGE_MAP
+	// Spans are page aligned and carved from their first byte, so objects
+	// are aligned to the largest power of two dividing their class size.
+	if (size <= SMALL_MAX_SIZE) {
+		ptr = small_yamalloc(size);
+		if (ptr) {
+			stats_record_alloc(
+			    size, small_class_size(small_class_of(size)));
+			TRACE_RECORD(YAMALLOC_TRACE_MALLOC, size, ptr, NULL);
+			PROFILE_ALLOC(ptr, size);
+		}
+		return ptr;
+	}
+#endif
+	ptr = backend_yaaligned_alloc(alignment, size);
+	if (ptr) {
+		stats_record_alloc(size, backend_usable_size(ptr));
+		TRACE_RECORD(YAMALLOC_TRACE_MALLOC, size, ptr, NULL);
+		PROFILE_ALLOC(ptr, size);
+	}
+	return ptr;
+}
+
+void *yacalloc(size_t num, size_t size)
+{
+	void *ptr;
+
+	LIMIT_CHECK();
+	if (size != 0 && num > ~(size_t)0 / size) {
+		return NULL;
+	}
+#ifdef YAMALLOC_PAGE_MAP
+	if (num * size <= SMALL_MAX_SIZE) {
+		ptr = small_yamalloc(num * size);
+		if (ptr) {
+			memset(ptr, 0, num * size);
+			stats_record_alloc(
+			    num * size,
+			    small_class_size(small_class_of(num * size)));
+			TRACE_RECORD(YAMALLOC_TRACE_CALLOC, num * size, ptr,
+				     NULL);
+			PROFILE_ALLOC(ptr, num * size);
+		}
+		return ptr;
+	}
+#endif
+	ptr = backend_yacalloc(num, size);
+	if (ptr) {
+		stats_record_alloc(num * size, backend_usable_size(ptr));
+		TRACE_RECORD(YAMALLOC_TRACE_CALLOC, num * size, ptr, NULL);
+		PROFILE_ALLOC(ptr, num * size);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Reallocates a block of yamalloc, the profiler aside
+ *
+ * @param[in] ptr Block to reallocate, not NULL
+ * @param[in] size New size (in bytes) of the block
+ * @return void* Pointer to the reallocated block, NULL on failure or if ptr
+ * is not ours, in which case ptr is left untouched
+ */
+static void *yarealloc_block(void *ptr, size_t size)
+{
+	size_t old_usable;
+	void *new_ptr;
+
+#ifdef YAMALLOC_PAGE_MAP
+	uintptr_t page = page_map_get(ptr);
+	if ((page & PAGE_MAP_KIND_MASK) == PAGE_MAP_SMALL) {
+		size_t class_index = page >> PAGE_MAP_CLASS_SHIFT;
+		new_ptr = small_yarealloc(ptr, class_index, size);
+		if (new_ptr) {
+			stats_record_realloc(size,
+					     small_class_size(class_index),
+					     yamalloc_usable_size(new_ptr));
+			TRACE_RECORD(YAMALLOC_TRACE_REALLOC, size, ptr,
+				     new_ptr);
+			PROFILE_ALLOC(new_ptr, size);
+		}
+		return new_ptr;
+	}
+	if ((page & PAGE_MAP_KIND_MASK) != PAGE_MAP_BACKEND) {
+		return NULL;
+	}
+	old_usable = backend_usable_size(ptr);
+	if (size <= SMALL_MAX_SIZE) {
+		new_ptr = small_yamalloc(size);
+		if (new_ptr) {
+			memcpy(new_ptr, ptr, size);
+			backend_yafree(ptr);
+			stats_record_realloc(
+			    size, old_usable,
+			    small_class_size(small_class_of(size)));
+			TRACE_RECORD(YAMALLOC_TRACE_REALLOC, size, ptr,
+				     new_ptr);
+			PROFILE_ALLOC(new_ptr, size);
+		}
+		return new_ptr;
+	}
+#else
+	old_usable = backend_usable_size(ptr);
+#endif
+	new_ptr = backend_yarealloc(ptr, size);
+	if (new_ptr) {
+		stats_record_realloc(size, old_usable,
+				     backend_usable_size(new_ptr));
+		TRACE_RECORD(YAMALLOC_TRACE_REALLOC, size, ptr, new_ptr);
+		PROFILE_ALLOC(new_ptr, size);
+	}
+	return new_ptr;
+}
+
+void *yarealloc(void *ptr, size_t size)
+{
+	ProfileSample *sample;
+	void *new_ptr;
+
+	LIMIT_CHECK();
+	if (!ptr) {
+		return yamalloc(size);
+	}
+	// The sample is detached before the block can be freed and handed to
+	// another thread, and put back when the block stays with the caller
+	PROFILE_DETACH(ptr, sample);
+	new_ptr = yarealloc_block(ptr, size);
+	if (new_ptr) {
+		PROFILE_DROP(sample);
+	} else {
+		PROFILE_KEEP(sample);
+	}
+	return new_ptr;
+}
+
+void yafree(void *ptr)
+{
+	if (!ptr) {
+		return;
+	}
+	TRACE_RECORD(YAMALLOC_TRACE_FREE, 0, ptr, NULL);
+	PROFILE_FREE(ptr);
+#ifdef YAMALLOC_PAGE_MAP
+	uintptr_t page = page_map_get(ptr);
+
+	// Pointers that do not belong to yamalloc are ignored
+	if ((page & PAGE_MAP_KIND_MASK) == PAGE_MAP_SMALL) {
+		size_t class_index = page >> PAGE_MAP_CLASS_SHIFT;
+		stats_record_free(small_class_size(class_index));
+		small_yafree(ptr, class_index);
+		return;
+	}
+	if ((page & PAGE_MAP_KIND_MASK) != PAGE_MAP_BACKEND) {
+		return;
+	}
+#endif
+	stats_record_free(backend_usable_size(ptr));
+	backend_yafree(ptr);
+}
+
+void yafree_sized(void *ptr, size_t size)
+{
+	if (!ptr) {
+		return;
+	}
+	TRACE_RECORD(YAMALLOC_TRACE_FREE, size, ptr, NULL);
+	PROFILE_FREE(ptr);
+#ifdef YAMALLOC_PAGE_MAP
+	if (size <= SMALL_MAX_SIZE) {
+		size_t class_index = small_class_of(size);
+		stats_record_free(small_class_size(class_index));
+		small_yafree(ptr, class_index);
+		return;
+	}
+#else
+	(void)size;
+#endif
+	stats_record_free(backend_usable_size(ptr));
+	backend_yafree(ptr);
+}
+
+int yamalloc_owns(const void *ptr)
+{
+#ifdef YAMALLOC_PAGE_MAP
+	return page_map_get(ptr) != PAGE_MAP_NONE;
+#else
+	return ptr != NULL;
+#endif
+}
+
+/**
+ * @brief Visits every block of the heap
+ *
+ * The backend blocks are visited first, chunk by chunk, then the small
+ * objects class by class. Free blocks include the parts of the heap that
+ * have been obtained from the kernel but not carved yet.
+ *
+ * @param[in] callback Function called on each block, see
+ * YamallocWalkCallback
+ * @param[in] ctx Argument passed to callback
+ * @return int 0, the non-zero value returned by callback to stop the walk,
+ * or -1 if the walk ran out of memory
+ */
+int yamalloc_heap_walk(YamallocWalkCallback callback, void *ctx)
+{
+	int ret;
+
+#ifdef YAMALLOC_LINKED_LIST
+	ret = linked_list_heap_walk(callback, ctx);
+#elif YAMALLOC_FREE_LIST_LL
+	ret = free_list_ll_heap_walk(callback, ctx);
+#elif YAMALLOC_FREE_LIST_RBT
+	ret = free_list_rbt_heap_walk(callback, ctx);
+#endif
+#ifdef YAMALLOC_PAGE_MAP
+	if (ret == 0) {
+		ret = small_heap_walk(callback, ctx);
+	}
+#endif
+	return ret;
+}
+
+size_t yamalloc_usable_size(void *ptr)
+{
+	if (!ptr) {
+		return 0;
+	}
+#ifdef YAMALLOC_PAGE_MAP
+	uintptr_t page = page_map_get(ptr);
+	if ((page & PAGE_MAP_KIND_MASK) == PAGE_MAP_SMALL) {
+		return small_class_size(page >> PAGE_MAP_CLASS_SHIFT);
+	}
+	if ((page & PAGE_MAP_KIND_MASK) != PAGE_MAP_BACKEND) {
+		return 0;
+	}
+#endif
+	return backend_usable_size(ptr);
+}
+
+/**
+ * @brief Resizes a block without moving it
+ *
+ * Small objects keep their class, and backend blocks cannot become small
+ * objects, so that yafree_sized() still finds them.
+ *
+ * @param[in] ptr Block to resize
+ * @param[in] size New size (in bytes) of the block
+ * @return int 0 on success, -1 if the block would have to move
+ */
+static int yamalloc_resize(void *ptr, size_t size)
+{
+#ifdef YAMALLOC_PAGE_MAP
+	uintptr_t page = page_map_get(ptr);
+	if ((page & PAGE_MAP_KIND_MASK) == PAGE_MAP_SMALL) {
+		return size <= SMALL_MAX_SIZE &&
+			       small_class_of(size) ==
+				   page >> PAGE_MAP_CLASS_SHIFT
+			   ? 0
+			   : -1;
+	}
+	if ((page & PAGE_MAP_KIND_MASK) != PAGE_MAP_BACKEND ||
+	    size <= SMALL_MAX_SIZE) {
+		return -1;
+	}
+#endif
+	return backend_resize(ptr, size);
+}
+
+/**
+ * @brief Allocates a block from the arena named by the flags
+ *
+ * @param[in] index Index of the arena, see yaarena_index()
+ * @param[in] alignment Alignment (in bytes), a power of two
+ * @param[in] size Size (in bytes) of the block to allocate
+ * @return void* Pointer to the block, NULL on failure or if no arena has
+ * that index
+ */
+static void *yamallocx_arena(unsigned index, size_t alignment, size_t size)
+{
+	YaArena *arena = yaarena_lookup(index);
+	size_t extra = alignment > YAARENA_ALIGNMENT ? alignment - 1 : 0;
+	char *ptr;
+
+	if (!arena || size > ~(size_t)0 - extra) {
+		return NULL;
+	}
+	ptr = (char *)yaarena_alloc(arena, size + extra);
+	if (!ptr) {
+		return NULL;
+	}
+	return (void *)(((uintptr_t)ptr + extra) & ~(uintptr_t)extra);
+}
+
+/**
+ * @brief Allocates a block with the properties given by flags
+ *
+ * @param[in] size Size (in bytes) of the block to allocate
+ * @param[in] flags YAMALLOCX_* flags or-ed together, 0 for yamalloc()
+ * @return void* Pointer to the allocated block, NULL on failure
+ *
+ * @note Blocks are freed with yafree(), except those of an arena
+ */
+void *yamallocx(size_t size, int flags)
+{
+	size_t alignment = (size_t)1 << (flags & YAMALLOCX_LG_ALIGN_MASK);
+	unsigned arena = (unsigned)(flags & YAMALLOCX_ARENA_MASK) >>
+			 YAMALLOCX_ARENA_SHIFT;
+	void *ptr;
+
+	if (arena != 0) {
+		ptr = yamallocx_arena(arena, alignment, size);
+	} else if (alignment > YAMALLOC_ALIGNMENT) {
+		ptr = yaaligned_alloc(alignment, size);
+	} else {
+		ptr = yamalloc_lifetime(size, flags & (YAMALLOCX_SHORT_LIVED |
+						       YAMALLOCX_LONG_LIVED));
+	}
+	if (ptr && (flags & YAMALLOCX_ZERO)) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Reallocates a block with the properties given by flags
+ *
+ * The block is resized in place when it is suitably aligned and the
+ * allocator can do it; otherwise it moves to a block of yamallocx(), unless
+ * YAMALLOCX_NO_MOVE is set. With YAMALLOCX_ZERO the bytes past the old
+ * usable size are zeroed.
+ *
+ * @param[in] ptr Block to reallocate, or NULL
+ * @param[in] size New size (in bytes) of the block
+ * @param[in] flags YAMALLOCX_* flags or-ed together; arenas are refused
+ * @return void* Pointer to the reallocated block, NULL on failure, in which
+ * case ptr is left untouched
+ *
+ * @note Memory of a registered arena is refused whatever the flags, at the
+ * cost of a walk over the chunks of the arenas while any arena is alive
+ */
+void *yareallocx(void *ptr, size_t size, int flags)
+{
+	size_t alignment = (size_t)1 << (flags & YAMALLOCX_LG_ALIGN_MASK);
+	size_t old_usable;
+	void *new_ptr;
+
+	LIMIT_CHECK();
+	if (!ptr) {
+		return yamallocx(size, flags);
+	}
+	if ((flags & YAMALLOCX_ARENA_MASK) != 0 || !yamalloc_owns(ptr) ||
+	    yaarena_owns(ptr)) {
+		return NULL;
+	}
+	old_usable = yamalloc_usable_size(ptr);
+	if (((uintptr_t)ptr & (alignment - 1)) == 0 &&
+	    yamalloc_resize(ptr, size) == 0) {
+		new_ptr = ptr;
+		PROFILE_FREE(ptr);
+		stats_record_realloc(size, old_usable,
+				     yamalloc_usable_size(ptr));
+		TRACE_RECORD(YAMALLOC_TRACE_REALLOC, size, ptr, ptr);
+		PROFILE_ALLOC(ptr, size);
+	} else if (flags & YAMALLOCX_NO_MOVE) {
+		return NULL;
+	} else {
+		new_ptr = yamallocx(size, flags & ~YAMALLOCX_ZERO);
+		if (!new_ptr) {
+			return NULL;
+		}
+		memcpy(new_ptr, ptr, old_usable < size ? old_usable : size);
+		yafree(ptr);
+	}
+	if ((flags & YAMALLOCX_ZERO) && size > old_usable) {
+		memset((char *)new_ptr + old_usable, 0, size - old_usable);
+	}
+	return new_ptr;
+}
+
+/**
+ * @brief Returns the usable size of a block of yamallocx()
+ *
+ * Arenas do not record the size of their allocations, so the usable size of
+ * arena memory is unknown.
+ *
+ * @param[in] ptr Block of yamallocx()
+ * @param[in] flags Flags the block was allocated with
+ * @return size_t Usable size (in bytes) of the block, 0 for arena memory
+ */
+size_t yasallocx(void *ptr, int flags)
+{
+	if ((flags & YAMALLOCX_ARENA_MASK) != 0) {
+		return 0;
+	}
+	return yamalloc_usable_size(ptr);
+}
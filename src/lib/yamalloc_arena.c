@@ -0,0 +1,298 @@
+#include "yamalloc_arena.h"
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Live arenas by index, so that yamallocx() flags can name them
+static YaArena *yaarena_registry[YAARENA_MAX_INDEX + 1];
+// Number of registered arenas, so that yaarena_owns() is free without any
+static unsigned yaarena_registered;
+
+// The registry lock also guards the chunk lists of the registered arenas,
+// which yaarena_owns() walks from any thread
+static void yaarena_lock(void)
+{
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&registry_lock);
+#endif
+}
+
+static void yaarena_unlock(void)
+{
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&registry_lock);
+#endif
+}
+
+static void yaarena_register(YaArena *arena)
+{
+	arena->index = 0;
+	yaarena_lock();
+	for (unsigned i = 1; i <= YAARENA_MAX_INDEX; i++) {
+		if (!yaarena_registry[i]) {
+			arena->index = i;
+			__atomic_store_n(&yaarena_registry[i], arena,
+					 __ATOMIC_RELEASE);
+			__atomic_store_n(&yaarena_registered,
+					 yaarena_registered + 1,
+					 __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	yaarena_unlock();
+}
+
+/**
+ * @brief Tells whether a pointer lies in a chunk of a registered arena
+ *
+ * The cost is linear in the number of chunks of the registered arenas.
+ *
+ * @param[in] ptr Pointer to look up
+ * @return int 1 if ptr is arena memory, 0 otherwise
+ */
+int yaarena_owns(const void *ptr)
+{
+	int owns = 0;
+
+	if (__atomic_load_n(&yaarena_registered, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+	yaarena_lock();
+	for (unsigned i = 1; i <= YAARENA_MAX_INDEX && !owns; i++) {
+		YaArena *arena = yaarena_registry[i];
+		if (!arena) {
+			continue;
+		}
+		for (YaArenaChunk *chunk = arena->chunks; chunk;
+		     chunk = chunk->next) {
+			const char *start = (const char *)(chunk + 1);
+			if ((const char *)ptr >= start &&
+			    (const char *)ptr < start + chunk->size) {
+				owns = 1;
+				break;
+			}
+		}
+	}
+	yaarena_unlock();
+	return owns;
+}
+
+/**
+ * @brief Returns the arena registered at index
+ *
+ * @param[in] index Index returned by yaarena_index()
+ * @return YaArena* The arena, NULL if no arena has that index
+ */
+YaArena *yaarena_lookup(unsigned index)
+{
+	if (index == 0 || index > YAARENA_MAX_INDEX) {
+		return NULL;
+	}
+	return __atomic_load_n(&yaarena_registry[index], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Returns the index that YAMALLOCX_ARENA() takes to target an arena
+ *
+ * Indexes are reused once their arena is destroyed.
+ *
+ * @param[in] arena Arena
+ * @return unsigned Index of the arena, 0 if more than YAARENA_MAX_INDEX
+ * arenas were alive when it was created
+ */
+unsigned yaarena_index(const YaArena *arena)
+{
+	return arena->index;
+}
+
+/**
+ * @brief Creates an arena
+ *
+ * The arena itself and its chunks are allocated with yamalloc().
+ *
+ * @param[in] chunk_size Size (in bytes) of the chunks, 0 for the default
+ * @param[in] flags YAARENA_RETAIN or 0
+ * @return YaArena* The new arena, NULL on failure
+ *
+ * @note Remember to release the arena using yaarena_destroy()
+ */
+YaArena *yaarena_create(size_t chunk_size, int flags)
+{
+	YaArena *arena = (YaArena *)yamalloc(sizeof(YaArena));
+	if (!arena) {
+		return NULL;
+	}
+	if (chunk_size == 0) {
+		chunk_size = YAARENA_DEFAULT_CHUNK_SIZE;
+	}
+	arena->chunks = NULL;
+	arena->spare = NULL;
+	arena->ptr = NULL;
+	arena->end = NULL;
+	arena->chunk_size = chunk_size;
+	arena->flags = flags;
+	yaarena_register(arena);
+	return arena;
+}
+
+/**
+ * @brief Gets a chunk able to hold size bytes
+ *
+ * Regular chunks are taken from the retained ones when possible. Requests
+ * larger than a chunk get a chunk of their own, which is linked behind the
+ * current one so that the space left in the current chunk is not lost.
+ *
+ * @param[in, out] arena Arena to grow
+ * @param[in] size Size (in bytes) that has to fit in the chunk
+ * @return YaArenaChunk* The chunk, NULL on failure
+ */
+static YaArenaChunk *yaarena_grow(YaArena *arena, size_t size)
+{
+	YaArenaChunk *chunk;
+
+	if (size > arena->chunk_size) {
+		chunk = (YaArenaChunk *)yamalloc(sizeof(YaArenaChunk) + size);
+		if (!chunk) {
+			return NULL;
+		}
+		chunk->size = size;
+		yaarena_lock();
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+			arena->ptr = arena->end = (char *)(chunk + 1) + size;
+		}
+		yaarena_unlock();
+		return chunk;
+	}
+
+	if (arena->spare) {
+		chunk = arena->spare;
+		arena->spare = chunk->next;
+	} else {
+		chunk = (YaArenaChunk *)yamalloc(sizeof(YaArenaChunk) +
+						 arena->chunk_size);
+		if (!chunk) {
+			return NULL;
+		}
+		chunk->size = arena->chunk_size;
+	}
+	yaarena_lock();
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	yaarena_unlock();
+	arena->ptr = (char *)(chunk + 1);
+	arena->end = arena->ptr + chunk->size;
+	return chunk;
+}
+
+/**
+ * @brief Allocates memory from an arena
+ *
+ * The memory is aligned to YAARENA_ALIGNMENT and lives until the next
+ * yaarena_reset() or yaarena_destroy(); it must not be passed to yafree().
+ *
+ * @param[in, out] arena Arena to allocate from
+ * @param[in] size Size (in bytes) to allocate
+ * @return void* Pointer to the memory, NULL on failure
+ */
+void *yaarena_alloc(YaArena *arena, size_t size)
+{
+	void *ptr;
+
+	if (size > ~(size_t)0 - YAARENA_ALIGNMENT - sizeof(YaArenaChunk)) {
+		return NULL;
+	}
+	// Zero-sized requests get their own bytes, so that they never see
+	// the NULL pointers of a fresh arena nor share an address
+	if (size == 0) {
+		size = YAARENA_ALIGNMENT;
+	}
+	size = (size + YAARENA_ALIGNMENT - 1) &
+	       ~(size_t)(YAARENA_ALIGNMENT - 1);
+
+	if ((size_t)(arena->end - arena->ptr) >= size) {
+		ptr = arena->ptr;
+		arena->ptr += size;
+		return ptr;
+	}
+
+	YaArenaChunk *chunk = yaarena_grow(arena, size);
+	if (!chunk) {
+		return NULL;
+	}
+	if (size > arena->chunk_size) {
+		return (void *)(chunk + 1);
+	}
+	ptr = arena->ptr;
+	arena->ptr += size;
+	return ptr;
+}
+
+/**
+ * @brief Releases every allocation of an arena at once
+ *
+ * With YAARENA_RETAIN the regular chunks are kept for the next allocations,
+ * so their pages are not faulted in again; oversized chunks are always
+ * freed. The cost is linear in the number of chunks.
+ *
+ * @param[in, out] arena Arena to reset
+ * @return void
+ */
+void yaarena_reset(YaArena *arena)
+{
+	YaArenaChunk *chunk;
+
+	yaarena_lock();
+	chunk = arena->chunks;
+	arena->chunks = NULL;
+	yaarena_unlock();
+	while (chunk) {
+		YaArenaChunk *next = chunk->next;
+		if ((arena->flags & YAARENA_RETAIN) &&
+		    chunk->size == arena->chunk_size) {
+			chunk->next = arena->spare;
+			arena->spare = chunk;
+		} else {
+			yafree_sized(chunk, sizeof(YaArenaChunk) + chunk->size);
+		}
+		chunk = next;
+	}
+	arena->ptr = NULL;
+	arena->end = NULL;
+}
+
+/**
+ * @brief Destroys an arena and releases all of its memory
+ *
+ * @param[in] arena Arena to destroy
+ * @return void
+ */
+void yaarena_destroy(YaArena *arena)
+{
+	if (!arena) {
+		return;
+	}
+	if (arena->index != 0) {
+		yaarena_lock();
+		__atomic_store_n(&yaarena_registry[arena->index], NULL,
+				 __ATOMIC_RELEASE);
+		__atomic_store_n(&yaarena_registered, yaarena_registered - 1,
+				 __ATOMIC_RELAXED);
+		yaarena_unlock();
+	}
+	arena->flags &= ~YAARENA_RETAIN;
+	yaarena_reset(arena);
+	while (arena->spare) {
+		YaArenaChunk *next = arena->spare->next;
+		yafree_sized(arena->spare,
+			     sizeof(YaArenaChunk) + arena->spare->size);
+		arena->spare = next;
+	}
+	yafree_sized(arena, sizeof(YaArena));
+}
@@ -1,4 +1,11 @@
 #include "yamalloc_free_list_ll.h"
+#include "yamalloc_instrument.h"
+#include "yamalloc_limit.h"
+#include "yamalloc_os.h"
+#include "yamalloc_stats.h"
+#ifdef YAMALLOC_PAGE_MAP
+#include "yamalloc_page_map.h"
+#endif
 #include <stdio.h>
 #include <string.h>
 
@@ -39,98 +46,488 @@ void *sbrk(intptr_t increment)
 #endif
 
 #define ALIGNMENT 8
-
-static FreeListLLNode *free_list_ll = NULL;
+// Minimum amount of memory requested to the kernel at once
+#define GROW_SIZE (64 * 1024)
+
+// Every region obtained from sbrk starts with a chunk descriptor and ends with
+// a fencepost (a zero-sized in-use header), so that the blocks of a chunk can
+// be walked by size and the last block never looks past the region.
+typedef struct FreeListLLChunk {
+	struct FreeListLLChunk *next;
+	size_t size;
+} FreeListLLChunk;
+
+// The free list of the process heap, whose links are plain addresses
+static uint64_t free_list_ll_head = 0;
+static FreeListLL free_list_ll = {NULL, &free_list_ll_head};
+static FreeListLLChunk *free_list_ll_chunks = NULL;
 
 #ifdef YAMALLOC_THREAD_SAFE
 #include <pthread.h>
 static pthread_mutex_t malloc_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+// Blocks freed while malloc_lock may be held by someone else. They are pushed
+// here under free_lock and merged into free_list_ll by the next allocation.
+static uint64_t free_list_ll_pending = 0;
 #endif
 
-void *free_list_ll_request_space(size_t size)
+/**
+ * @brief Rounds the requested payload size up to a whole block size
+ *
+ * @param[in] size Size (in bytes) of the payload
+ * @return size_t Size (in bytes) of the block, header included
+ */
+size_t free_list_ll_block_size(size_t size)
 {
-	FreeListLLNode *node;
-	size_t total_size =
-	    size + sizeof(FreeListLLNode) + sizeof(FreeListLLHeader);
-	node = sbrk((intptr_t)total_size);
-	if (node == (void *)-1) {
-		return NULL;
+	size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+	size += sizeof(FreeListLLHeader);
+	if (size < sizeof(FreeListLLNode)) {
+		size = sizeof(FreeListLLNode);
 	}
-	node = (FreeListLLNode *)((char *)node + sizeof(FreeListLLHeader));
+	return size;
+}
 
-	node->size = size;
-	node->next = NULL;
+/**
+ * @brief Returns the header of an allocated block
+ *
+ * @param[in] ptr Pointer to the payload
+ * @return FreeListLLHeader* Header of the block, found through the padding
+ * marker when the block has padding
+ */
+static FreeListLLHeader *free_list_ll_header(void *ptr)
+{
+	FreeListLLHeader *header =
+	    (FreeListLLHeader *)((char *)ptr - sizeof(FreeListLLHeader));
 
-	return node;
+	if (header->info & FREE_LIST_LL_PAD_MARK) {
+		header = (FreeListLLHeader *)((char *)header -
+					      free_list_ll_padding(header));
+	}
+	return header;
 }
 
-void *free_list_ll_yamalloc(size_t size)
+static FreeListLLHeader *free_list_ll_next_header(FreeListLLHeader *header)
+{
+	return (FreeListLLHeader *)((char *)header + free_list_ll_size(header));
+}
+
+/**
+ * @brief Returns a block to an address-ordered free list
+ *
+ * The block is marked as free, inserted after the last free node that
+ * precedes it and coalesced with its neighbours.
+ *
+ * @param[in, out] list Free list
+ * @param[in] node Block to release
+ * @return void
+ */
+void free_list_ll_release(FreeListLL *list, FreeListLLNode *node)
 {
-#if defined(YAMALLOC_THREAD_SAFE)
-	pthread_mutex_lock(&malloc_lock);
-#endif
-	size_t padding = 0;
 	FreeListLLNode *prev = NULL;
-	FreeListLLNode *node = NULL;
-	FreeListLLHeader *header = NULL;
-	size_t alignment_padding;
-	size_t required_space;
-	size_t remaining_space;
+	FreeListLLNode *cur = free_list_ll_first(list);
+	INSTRUMENT_START(t);
 
-	if (size < sizeof(FreeListLLNode)) {
-		size = sizeof(FreeListLLNode);
+	// Free nodes have no padding, their sizes are added up by coalescing
+	node->header.info &= ~FREE_LIST_LL_PADDING_MASK;
+	node->header.info |= FREE_LIST_LL_FREE;
+
+	while (cur != NULL && cur < node) {
+		prev = cur;
+		cur = free_list_ll_next(list, cur);
 	}
+	free_list_ll_insert_node(list, prev, node);
+	free_list_ll_coalesce(list, prev, node);
+	INSTRUMENT_END(YAMALLOC_PATH_COALESCE, t);
+}
 
-	if (!free_list_ll) {
-		node = free_list_ll_request_space(size);
-		if (!node) {
-#if defined(YAMALLOC_THREAD_SAFE)
-			pthread_mutex_unlock(&malloc_lock);
+#ifdef YAMALLOC_THREAD_SAFE
+static void free_list_ll_drain_pending(void)
+{
+	FreeListLLNode *node;
+
+	INSTRUMENT_LOCK(&free_lock);
+	node = free_list_ll_node(&free_list_ll, free_list_ll_pending);
+	free_list_ll_pending = 0;
+	pthread_mutex_unlock(&free_lock);
+
+	while (node != NULL) {
+		FreeListLLNode *next = free_list_ll_next(&free_list_ll, node);
+		free_list_ll_release(&free_list_ll, node);
+		node = next;
+	}
+}
 #endif
-			return NULL;
+
+/**
+ * @brief Gives back the end of the heap after a failed growth
+ *
+ * The program break only moves back when nobody else moved it since;
+ * otherwise the region stays ours, and in the footprint.
+ *
+ * @param[in] mem Start of the region obtained from sbrk
+ * @param[in] size Size (in bytes) of the region
+ * @return void
+ */
+static void free_list_ll_give_back(char *mem, size_t size)
+{
+	if (sbrk(0) == mem + size) {
+		sbrk(-(intptr_t)size);
+		stats_record_sbrk(-(intptr_t)size);
+		limit_release(size);
+	}
+}
+
+/**
+ * @brief Requests space to the kernel
+ *
+ * At least GROW_SIZE bytes are requested. When the new region directly
+ * follows the last chunk, the old fencepost becomes the header of the new
+ * free block and the chunk is extended; otherwise a new chunk is started.
+ * The new memory is handed to the free list as a single free block.
+ *
+ * Chunks start and end on page boundaries, so that no page holds both our
+ * blocks and the data of another user of the program break, and the page
+ * map only reports the pages we own.
+ *
+ * @param[in] size Size (in bytes) of the block that has to fit
+ * @return int 0 on success, -1 if the kernel refused to grow the heap or
+ * the growth would cross the hard watermark of yamalloc_set_limit()
+ */
+static int free_list_ll_request_space(size_t size)
+{
+	size_t total_size =
+	    size + sizeof(FreeListLLChunk) + sizeof(FreeListLLHeader);
+	size_t pad = 0;
+	FreeListLLHeader *fencepost;
+	FreeListLLNode *node;
+	char *mem;
+
+	total_size = (total_size + GROW_SIZE - 1) & ~(size_t)(GROW_SIZE - 1);
+	if (limit_charge(total_size) != 0) {
+		return -1;
+	}
+	INSTRUMENT_START(t);
+	mem = sbrk((intptr_t)total_size);
+	INSTRUMENT_END(YAMALLOC_PATH_OS_GROWTH, t);
+	if (mem == (void *)-1) {
+		limit_release(total_size);
+		return -1;
+	}
+	stats_record_sbrk((intptr_t)total_size);
+
+	int extend = free_list_ll_chunks != NULL &&
+		     mem == (char *)free_list_ll_chunks +
+				free_list_ll_chunks->size;
+	if (!extend) {
+		// sbrk is shared with other users of the program break, which
+		// may have left it inside a page.
+		pad = (0 - (uintptr_t)mem) & (YAMALLOC_OS_PAGE_SIZE - 1);
+		if (pad != 0) {
+			if (limit_charge(pad) != 0) {
+				free_list_ll_give_back(mem, total_size);
+				return -1;
+			}
+			if (sbrk((intptr_t)pad) == (void *)-1) {
+				limit_release(pad);
+				free_list_ll_give_back(mem, total_size);
+				return -1;
+			}
+			stats_record_sbrk((intptr_t)pad);
+			mem += pad;
 		}
-		free_list_ll = node;
+	}
+#ifdef YAMALLOC_PAGE_MAP
+	if (page_map_set(mem, total_size, PAGE_MAP_BACKEND) != 0) {
+		page_map_set(mem, total_size, PAGE_MAP_NONE);
+		free_list_ll_give_back(mem - pad, total_size + pad);
+		return -1;
+	}
+#endif
+
+	if (extend) {
+		node = (FreeListLLNode *)(mem - sizeof(FreeListLLHeader));
+		node->header.info = free_list_ll_pack(total_size, 0, 0, 0);
+		free_list_ll_chunks->size += total_size;
 	} else {
+		FreeListLLChunk *chunk = (FreeListLLChunk *)mem;
+		chunk->next = free_list_ll_chunks;
+		chunk->size = total_size;
+		free_list_ll_chunks = chunk;
+
+		node = (FreeListLLNode *)(chunk + 1);
+		node->header.info = free_list_ll_pack(
+		    total_size - sizeof(FreeListLLChunk) -
+			sizeof(FreeListLLHeader),
+		    0, 0, 0);
+	}
+
+	fencepost = free_list_ll_next_header(&node->header);
+	fencepost->info = free_list_ll_pack(0, 0, 0, 0);
+
+	node->header.info &= ~FREE_LIST_LL_FREE;
+	free_list_ll_release(&free_list_ll, node);
+	return 0;
+}
+
+/**
+ * @brief Turns a free node into an allocated block
+ *
+ * The node is unlinked from the free list; the tail that is not needed is
+ * split off and put back in its place when it can hold a free node.
+ *
+ * @param[in, out] list Free list holding node
+ * @param[in] prev Free node preceding node in the list (or NULL)
+ * @param[in] node Free node large enough for the block
+ * @param[in] block_size Size (in bytes) of the block, header included
+ * @return void* Pointer to the payload
+ */
+void *free_list_ll_carve(FreeListLL *list, FreeListLLNode *prev,
+			 FreeListLLNode *node, size_t block_size)
+{
+	size_t node_size = free_list_ll_size(&node->header);
+
+	free_list_ll_remove_node(list, prev, node);
+
+	if (node_size - block_size >= sizeof(FreeListLLNode)) {
+		FreeListLLNode *rest =
+		    (FreeListLLNode *)((char *)node + block_size);
+		rest->header.info = free_list_ll_pack(node_size - block_size, 0,
+						      0, FREE_LIST_LL_FREE);
+		free_list_ll_insert_node(list, prev, rest);
+		node_size = block_size;
+	}
+
+	node->header.info = free_list_ll_pack(node_size, 0, 0, 0);
+
+	return (void *)((char *)node + sizeof(FreeListLLHeader));
+}
+
+/**
+ * @brief Splits a block off the end of a free node
+ *
+ * Short-lived blocks are carved this way from the highest free node, which
+ * is usually the top of the heap, away from the long-lived blocks that
+ * fill it from the bottom.
+ *
+ * @param[in] prev Free node preceding node in the list (or NULL)
+ * @param[in] node Free node large enough for the block
+ * @param[in] block_size Size (in bytes) of the block, header included
+ * @return void* Pointer to the payload
+ */
+static void *free_list_ll_carve_tail(FreeListLLNode *prev, FreeListLLNode *node,
+				     size_t block_size)
+{
+	size_t node_size = free_list_ll_size(&node->header);
+	FreeListLLNode *block;
+
+	if (node_size - block_size < sizeof(FreeListLLNode)) {
+		return free_list_ll_carve(&free_list_ll, prev, node,
+					  block_size);
+	}
+	node->header.info = free_list_ll_pack(node_size - block_size, 0, 0,
+					      FREE_LIST_LL_FREE);
+	block = (FreeListLLNode *)free_list_ll_next_header(&node->header);
+	block->header.info = free_list_ll_pack(block_size, 0, 0, 0);
+
+	return (void *)((char *)block + sizeof(FreeListLLHeader));
+}
+
+/**
+ * @brief Finds the free node of highest address that fits a block
+ *
+ * @param[out] prev_node Free node preceding the one found (or NULL)
+ * @param[in] block_size Size (in bytes) of the block, header included
+ * @return FreeListLLNode* The node, NULL if none fits
+ */
+static FreeListLLNode *free_list_ll_find_last(FreeListLLNode **prev_node,
+					      size_t block_size)
+{
+	FreeListLLNode *prev = NULL;
+	FreeListLLNode *last = NULL;
+	size_t probes = 0;
+	INSTRUMENT_START(t);
+
+	*prev_node = NULL;
+	for (FreeListLLNode *node = free_list_ll_first(&free_list_ll); node;
+	     node = free_list_ll_next(&free_list_ll, node)) {
+		probes++;
+		if (free_list_ll_size(&node->header) >= block_size) {
+			*prev_node = prev;
+			last = node;
+		}
+		prev = node;
+	}
+	INSTRUMENT_SEARCH_END(t, probes);
+
+	return last;
+}
+
+static FreeListLLNode *free_list_ll_find(FreeListLLNode **prev,
+					 size_t block_size, int lifetime)
+{
+	size_t padding = 0;
+
+	if (lifetime & YAMALLOCX_SHORT_LIVED) {
+		return free_list_ll_find_last(prev, block_size);
+	}
+	// Long-lived blocks are packed at the bottom of the heap
+	if (lifetime & YAMALLOCX_LONG_LIVED) {
+		return free_list_ll_find_first(&free_list_ll, prev, block_size,
+					       &padding);
+	}
 #if defined(YAMALLOC_FREE_LIST_LL_FIND_FIRST)
-		node = free_list_ll_find_first(&prev, size, &padding);
+	return free_list_ll_find_first(&free_list_ll, prev, block_size,
+				       &padding);
 #elif defined(YAMALLOC_FREE_LIST_LL_FIND_BEST)
-		node = free_list_ll_find_best(&prev, size, &padding);
+	return free_list_ll_find_best(&free_list_ll, prev, block_size,
+				      &padding);
 #endif
-		if (!node) {
-			node = free_list_ll_request_space(size);
-			if (!node) {
-				return NULL;
-			}
+}
+
+/**
+ * @brief Takes a block out of the free list, growing the heap if needed
+ *
+ * Called with malloc_lock held.
+ *
+ * @param[in] block_size Size (in bytes) of the block, header included
+ * @param[in] lifetime YAMALLOCX_SHORT_LIVED, YAMALLOCX_LONG_LIVED or 0
+ * @return void* Pointer to the payload, NULL if the heap cannot grow
+ */
+static void *free_list_ll_take(size_t block_size, int lifetime)
+{
+	FreeListLLNode *prev = NULL;
+	FreeListLLNode *node = free_list_ll_find(&prev, block_size, lifetime);
+
+	if (!node) {
+		if (free_list_ll_request_space(block_size) != 0) {
+			return NULL;
 		}
+		node = free_list_ll_find(&prev, block_size, lifetime);
+	}
+
+	if (lifetime & YAMALLOCX_SHORT_LIVED) {
+		return free_list_ll_carve_tail(prev, node, block_size);
 	}
+	return free_list_ll_carve(&free_list_ll, prev, node, block_size);
+}
+
+void *free_list_ll_yamalloc(size_t size)
+{
+	return free_list_ll_yamallocx(size, 0);
+}
 
-	alignment_padding = padding - sizeof(FreeListLLHeader);
-	required_space = size + padding;
-	remaining_space = node->size - required_space;
+/**
+ * @brief Allocates a block placed according to its expected lifetime
+ *
+ * @param[in] size Size (in bytes) of the payload
+ * @param[in] lifetime YAMALLOCX_SHORT_LIVED, YAMALLOCX_LONG_LIVED or 0
+ * @return void* Pointer to the payload, NULL on failure
+ */
+void *free_list_ll_yamallocx(size_t size, int lifetime)
+{
+	void *ptr;
 
-	if (remaining_space > 0) {
-		FreeListLLNode *new_node =
-		    (FreeListLLNode *)((char *)node + required_space);
-		new_node->size = remaining_space;
-		free_list_ll_insert_node(prev, new_node);
+	if (size > FREE_LIST_LL_SIZE_MASK - GROW_SIZE) {
+		return NULL;
 	}
 
-	free_list_ll_remove_node(prev, node);
+#if defined(YAMALLOC_THREAD_SAFE)
+	INSTRUMENT_LOCK(&malloc_lock);
+	free_list_ll_drain_pending();
+#endif
+	ptr = free_list_ll_take(free_list_ll_block_size(size), lifetime);
+#if defined(YAMALLOC_THREAD_SAFE)
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+
+	return ptr;
+}
 
-	header = (FreeListLLHeader *)((char *)node + alignment_padding);
-	header->size = required_space;
-	header->padding = alignment_padding;
+/**
+ * @brief Allocates a block whose payload is aligned
+ *
+ * A block large enough for any position of the payload is taken from the
+ * free list. The space in front of the aligned payload is given back to the
+ * free list when it can hold a free node, and kept as padding otherwise;
+ * the unused tail is given back as well.
+ *
+ * @param[in] alignment Alignment (in bytes), a power of two
+ * @param[in] size Size (in bytes) of the payload
+ * @return void* Pointer to the payload, NULL on failure
+ */
+void *free_list_ll_yaaligned_alloc(size_t alignment, size_t size)
+{
+	size_t block_size;
+	size_t padding = 0;
+	FreeListLLNode *node;
+	char *ptr;
+
+	if (alignment <= ALIGNMENT) {
+		return free_list_ll_yamalloc(size);
+	}
+	if (alignment > FREE_LIST_LL_SIZE_MASK / 4 ||
+	    size > FREE_LIST_LL_SIZE_MASK - GROW_SIZE - 2 * alignment) {
+		return NULL;
+	}
+	block_size = free_list_ll_block_size(size);
 
+#if defined(YAMALLOC_THREAD_SAFE)
+	INSTRUMENT_LOCK(&malloc_lock);
+	free_list_ll_drain_pending();
+#endif
+	ptr = (char *)free_list_ll_take(block_size + alignment - ALIGNMENT, 0);
+	if (ptr) {
+		size_t front = (0 - (uintptr_t)ptr) & (alignment - 1);
+
+		node = (FreeListLLNode *)(ptr - sizeof(FreeListLLHeader));
+		if (front >= sizeof(FreeListLLNode)) {
+			size_t size_left =
+			    free_list_ll_size(&node->header) - front;
+			FreeListLLNode *block =
+			    (FreeListLLNode *)((char *)node + front);
+
+			block->header.info =
+			    free_list_ll_pack(size_left, 0, 0, 0);
+			node->header.info = free_list_ll_pack(front, 0, 0, 0);
+			free_list_ll_release(&free_list_ll, node);
+			node = block;
+		} else if (front != 0) {
+			FreeListLLHeader *mark =
+			    (FreeListLLHeader *)(ptr + front) - 1;
+
+			padding = front;
+			mark->info = free_list_ll_pack(0, padding, 0,
+						       FREE_LIST_LL_PAD_MARK);
+			block_size += padding;
+		}
+		ptr += front;
+		if (free_list_ll_size(&node->header) - block_size >=
+		    sizeof(FreeListLLNode)) {
+			FreeListLLNode *rest =
+			    (FreeListLLNode *)((char *)node + block_size);
+			rest->header.info = free_list_ll_pack(
+			    free_list_ll_size(&node->header) - block_size, 0, 0,
+			    0);
+			node->header.info =
+			    free_list_ll_pack(block_size, padding, 0, 0);
+			free_list_ll_release(&free_list_ll, rest);
+		} else {
+			node->header.info = free_list_ll_pack(
+			    free_list_ll_size(&node->header), padding, 0, 0);
+		}
+	}
 #if defined(YAMALLOC_THREAD_SAFE)
 	pthread_mutex_unlock(&malloc_lock);
 #endif
 
-	return (void *)((char *)header + sizeof(FreeListLLHeader));
+	return ptr;
 }
 
 void *free_list_ll_yacalloc(size_t num, size_t size)
 {
+	if (size != 0 && num > ~(size_t)0 / size) {
+		return NULL;
+	}
 	size_t total_size = num * size;
 	void *ptr = free_list_ll_yamalloc(total_size);
 	if (ptr) {
@@ -148,12 +545,15 @@ void *free_list_ll_yarealloc(void *ptr, size_t size)
 		return free_list_ll_yamalloc(size);
 	}
 
-	FreeListLLHeader *header =
-	    (FreeListLLHeader *)((char *)ptr - sizeof(FreeListLLHeader));
+	size_t old_size = free_list_ll_usable_size(ptr);
+	if (old_size >= size) {
+		return ptr;
+	}
+
 	void *new_ptr = free_list_ll_yamalloc(size);
 	if (new_ptr) {
 		uint8_t *p = (uint8_t *)new_ptr;
-		for (size_t i = 0; i < header->size; i++) {
+		for (size_t i = 0; i < old_size; i++) {
 			p[i] = ((uint8_t *)ptr)[i];
 		}
 		free_list_ll_yafree(ptr);
@@ -162,41 +562,230 @@ void *free_list_ll_yarealloc(void *ptr, size_t size)
 	return new_ptr;
 }
 
-void free_list_ll_yafree(void *ptr)
+/**
+ * @brief Resizes a block without moving it
+ *
+ * A block shrinks by giving its tail back to the free list and grows into
+ * the free block that follows it, if any.
+ *
+ * @param[in] ptr Pointer to the payload
+ * @param[in] size New size (in bytes) of the payload
+ * @return int 0 on success, -1 if the block cannot hold size bytes in place
+ */
+int free_list_ll_resize(void *ptr, size_t size)
+{
+	FreeListLLNode *node = (FreeListLLNode *)free_list_ll_header(ptr);
+	size_t block_size;
+	size_t node_size;
+	FreeListLLHeader *next;
+	int ret = 0;
+
+	if (size > FREE_LIST_LL_SIZE_MASK - GROW_SIZE ||
+	    free_list_ll_padding(&node->header) != 0) {
+		return -1;
+	}
+	block_size = free_list_ll_block_size(size);
+
+#if defined(YAMALLOC_THREAD_SAFE)
+	INSTRUMENT_LOCK(&malloc_lock);
+	free_list_ll_drain_pending();
+#endif
+	node_size = free_list_ll_size(&node->header);
+	next = free_list_ll_next_header(&node->header);
+	if (node_size < block_size) {
+		FreeListLLNode *prev = NULL;
+		FreeListLLNode *cur = free_list_ll_first(&free_list_ll);
+
+		if (!free_list_ll_is_free(next) ||
+		    node_size + free_list_ll_size(next) < block_size) {
+			ret = -1;
+		} else {
+			while (cur != (FreeListLLNode *)next) {
+				prev = cur;
+				cur = free_list_ll_next(&free_list_ll, cur);
+			}
+			free_list_ll_remove_node(&free_list_ll, prev, cur);
+			node_size += free_list_ll_size(next);
+			node->header.info =
+			    free_list_ll_pack(node_size, 0, 0, 0);
+		}
+	}
+	if (ret == 0 && node_size - block_size >= sizeof(FreeListLLNode)) {
+		FreeListLLNode *rest =
+		    (FreeListLLNode *)((char *)node + block_size);
+		rest->header.info =
+		    free_list_ll_pack(node_size - block_size, 0, 0, 0);
+		node->header.info = free_list_ll_pack(block_size, 0, 0, 0);
+		free_list_ll_release(&free_list_ll, rest);
+	}
+#if defined(YAMALLOC_THREAD_SAFE)
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+
+	return ret;
+}
+
+/**
+ * @brief Gives the free memory of the heap back to the kernel
+ *
+ * A free block at the top of the newest chunk, when nobody else moved the
+ * program break past it, is cut down to one page and the rest released
+ * with sbrk. The whole pages inside the other free blocks are purged.
+ *
+ * @return size_t Bytes released with sbrk
+ */
+size_t free_list_ll_trim(void)
 {
+	FreeListLLNode *last = NULL;
+	size_t released = 0;
+
 #if defined(YAMALLOC_THREAD_SAFE)
-	pthread_mutex_lock(&free_lock);
+	INSTRUMENT_LOCK(&malloc_lock);
+	free_list_ll_drain_pending();
 #endif
-	FreeListLLHeader *header;
+	for (FreeListLLNode *node = free_list_ll_first(&free_list_ll); node;
+	     node = free_list_ll_next(&free_list_ll, node)) {
+		yamalloc_os_purge((char *)node + sizeof(FreeListLLNode),
+				  free_list_ll_size(&node->header) -
+				      sizeof(FreeListLLNode));
+		last = node;
+	}
+	if (last && free_list_ll_chunks) {
+		char *end =
+		    (char *)free_list_ll_chunks + free_list_ll_chunks->size;
+		// The node and the new fencepost, rounded up to a page
+		char *keep = (char *)last + sizeof(FreeListLLNode) +
+			     sizeof(FreeListLLHeader) + YAMALLOC_OS_PAGE_SIZE -
+			     1;
+
+		keep -= (uintptr_t)keep & (YAMALLOC_OS_PAGE_SIZE - 1);
+
+		if ((char *)free_list_ll_next_header(&last->header) ==
+			end - sizeof(FreeListLLHeader) &&
+		    keep < end && sbrk(0) == end) {
+			FreeListLLHeader *fencepost;
+
+			released = (size_t)(end - keep);
+			last->header.info = free_list_ll_pack(
+			    (size_t)(keep - (char *)last) -
+				sizeof(FreeListLLHeader),
+			    0, 0, FREE_LIST_LL_FREE);
+			fencepost = free_list_ll_next_header(&last->header);
+			fencepost->info = free_list_ll_pack(0, 0, 0, 0);
+			free_list_ll_chunks->size -= released;
+#ifdef YAMALLOC_PAGE_MAP
+			page_map_set(keep, released, PAGE_MAP_NONE);
+#endif
+			sbrk(-(intptr_t)released);
+			stats_record_sbrk(-(intptr_t)released);
+			limit_release(released);
+		}
+	}
+#if defined(YAMALLOC_THREAD_SAFE)
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+
+	return released;
+}
+
+void free_list_ll_yafree(void *ptr)
+{
 	FreeListLLNode *free_node;
-	FreeListLLNode *prev = NULL;
-	FreeListLLNode *node = free_list_ll;
 
 	if (!ptr)
 		return;
 
-	header = (FreeListLLHeader *)((char *)ptr - sizeof(FreeListLLHeader));
-	free_node = (FreeListLLNode *)header;
-	free_node->size = header->size - header->padding;
-	free_node->next = NULL;
+	free_node = (FreeListLLNode *)free_list_ll_header(ptr);
 
-	while (node != NULL) {
-		if (ptr < (void *)node) {
-			free_list_ll_insert_node(prev, free_node);
-			break;
+#if defined(YAMALLOC_THREAD_SAFE)
+	INSTRUMENT_LOCK(&free_lock);
+	free_node->next = free_list_ll_pending;
+	free_list_ll_pending = free_list_ll_link(&free_list_ll, free_node);
+	pthread_mutex_unlock(&free_lock);
+#else
+	free_list_ll_release(&free_list_ll, free_node);
+#endif
+}
+
+size_t free_list_ll_usable_size(void *ptr)
+{
+	FreeListLLHeader *header = free_list_ll_header(ptr);
+
+	return free_list_ll_size(header) - sizeof(FreeListLLHeader) -
+	       free_list_ll_padding(header);
+}
+
+/**
+ * @brief Sums up the free blocks of the heap
+ *
+ * @param[out] bytes Bytes of the free blocks, headers included
+ * @param[out] blocks Number of free blocks
+ * @param[out] largest Size (in bytes) of the largest free block
+ * @return void
+ */
+void free_list_ll_free_stats(size_t *bytes, size_t *blocks, size_t *largest)
+{
+	*bytes = 0;
+	*blocks = 0;
+	*largest = 0;
+
+#if defined(YAMALLOC_THREAD_SAFE)
+	pthread_mutex_lock(&malloc_lock);
+	free_list_ll_drain_pending();
+#endif
+	for (FreeListLLNode *node = free_list_ll_first(&free_list_ll); node;
+	     node = free_list_ll_next(&free_list_ll, node)) {
+		size_t size = free_list_ll_size(&node->header);
+		*bytes += size;
+		*blocks += 1;
+		if (size > *largest) {
+			*largest = size;
 		}
-		prev = node;
-		node = node->next;
 	}
+#if defined(YAMALLOC_THREAD_SAFE)
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+}
 
-	if (!prev && free_node) {
-		free_list_ll = (void *)free_node;
-	}
+/**
+ * @brief Visits every block of the heap, chunk by chunk
+ *
+ * Blocks waiting in the pending list are released first, so that they are
+ * reported as free.
+ *
+ * @param[in] callback Function called on each block
+ * @param[in] ctx Argument passed to callback
+ * @return int 0, or the non-zero value that stopped the walk
+ */
+int free_list_ll_heap_walk(YamallocWalkCallback callback, void *ctx)
+{
+	struct yamalloc_block block;
+	int ret = 0;
 
-	free_list_ll_coalesce(prev, free_node);
 #if defined(YAMALLOC_THREAD_SAFE)
-	pthread_mutex_unlock(&free_lock);
+	pthread_mutex_lock(&malloc_lock);
+	free_list_ll_drain_pending();
 #endif
+	for (FreeListLLChunk *chunk = free_list_ll_chunks; chunk && !ret;
+	     chunk = chunk->next) {
+		FreeListLLHeader *header = (FreeListLLHeader *)(chunk + 1);
+		// The fencepost closing the chunk is the only empty block
+		while (ret == 0 && free_list_ll_size(header) != 0) {
+			block.address = header;
+			block.size = free_list_ll_size(header);
+			block.free = free_list_ll_is_free(header);
+			block.padding = block.free
+					    ? 0
+					    : sizeof(FreeListLLHeader) +
+						  free_list_ll_padding(header);
+			ret = callback(&block, ctx);
+			header = free_list_ll_next_header(header);
+		}
+	}
+#if defined(YAMALLOC_THREAD_SAFE)
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+	return ret;
 }
 
 size_t get_padding_with_header(uintptr_t payload, size_t header_size)
@@ -223,23 +812,29 @@ size_t get_padding_with_header(uintptr_t payload, size_t header_size)
 	return (size_t)padding;
 }
 
-FreeListLLNode *free_list_ll_find_first(FreeListLLNode **prev_node, size_t size,
+FreeListLLNode *free_list_ll_find_first(const FreeListLL *list,
+					FreeListLLNode **prev_node, size_t size,
 					size_t *padding)
 {
-	FreeListLLNode *node = free_list_ll;
+	FreeListLLNode *node = free_list_ll_first(list);
 	FreeListLLNode *prev = NULL;
 	size_t padding_size = 0;
+	size_t probes = 0;
+	INSTRUMENT_START(t);
 
 	while (node != NULL) {
+		probes++;
 		padding_size = get_padding_with_header(
 		    (uintptr_t)node, sizeof(FreeListLLHeader));
-		size_t required_size = size + padding_size;
-		if (node->size >= required_size) {
+		size_t required_size =
+		    size + padding_size - sizeof(FreeListLLHeader);
+		if (free_list_ll_size(&node->header) >= required_size) {
 			break;
 		}
 		prev = node;
-		node = node->next;
+		node = free_list_ll_next(list, node);
 	}
+	INSTRUMENT_SEARCH_END(t, probes);
 
 	if (prev_node)
 		*prev_node = prev;
@@ -248,74 +843,82 @@ FreeListLLNode *free_list_ll_find_first(FreeListLLNode **prev_node, size_t size,
 	return node;
 }
 
-FreeListLLNode *free_list_ll_find_best(FreeListLLNode **prev_node, size_t size,
+FreeListLLNode *free_list_ll_find_best(const FreeListLL *list,
+				       FreeListLLNode **prev_node, size_t size,
 				       size_t *padding)
 {
 	size_t smallest_size = ~(size_t)0;
-	FreeListLLNode *node = free_list_ll;
+	FreeListLLNode *node = free_list_ll_first(list);
 	FreeListLLNode *prev = NULL;
 	FreeListLLNode *best = NULL;
+	FreeListLLNode *best_prev = NULL;
+	size_t best_padding = 0;
 	size_t padding_size = 0;
+	size_t probes = 0;
+	INSTRUMENT_START(t);
 
 	while (node != NULL) {
+		probes++;
 		padding_size = get_padding_with_header(
 		    (uintptr_t)node, sizeof(FreeListLLHeader));
-		size_t required_size = size + padding_size;
-		if (node->size >= required_size &&
-		    (node->size - required_size) < smallest_size) {
+		size_t required_size =
+		    size + padding_size - sizeof(FreeListLLHeader);
+		size_t node_size = free_list_ll_size(&node->header);
+		if (node_size >= required_size &&
+		    (node_size - required_size) < smallest_size) {
+			smallest_size = node_size - required_size;
 			best = node;
+			best_prev = prev;
+			best_padding = padding_size;
+			if (smallest_size == 0) {
+				break;
+			}
 		}
 		prev = node;
-		node = node->next;
+		node = free_list_ll_next(list, node);
 	}
+	INSTRUMENT_SEARCH_END(t, probes);
 
 	if (prev_node)
-		*prev_node = prev;
+		*prev_node = best_prev;
 	if (padding)
-		*padding = padding_size;
+		*padding = best_padding;
 	return best;
 }
 
-void free_list_ll_coalesce(FreeListLLNode *prev, FreeListLLNode *free_node)
+void free_list_ll_coalesce(FreeListLL *list, FreeListLLNode *prev,
+			   FreeListLLNode *free_node)
 {
-	if (free_node->next != NULL &&
-	    (void *)((char *)free_node + free_node->size) ==
-		(void *)free_node->next) {
-		free_node->size += free_node->next->size;
-		free_list_ll_remove_node(free_node, free_node->next);
+	FreeListLLNode *next = free_list_ll_next(list, free_node);
+
+	if (next != NULL &&
+	    (void *)free_list_ll_next_header(&free_node->header) ==
+		(void *)next) {
+		free_node->header.info += free_list_ll_size(&next->header);
+		free_list_ll_remove_node(list, free_node, next);
 	}
 
 	if (prev != NULL &&
-	    (void *)((char *)prev + prev->size) == (void *)free_node) {
-		prev->size += free_node->size;
-		free_list_ll_remove_node(prev, free_node);
+	    (void *)free_list_ll_next_header(&prev->header) ==
+		(void *)free_node) {
+		prev->header.info += free_list_ll_size(&free_node->header);
+		free_list_ll_remove_node(list, prev, free_node);
 	}
 }
 
-void free_list_ll_insert_node(FreeListLLNode *prev, FreeListLLNode *new_node)
+void free_list_ll_insert_node(FreeListLL *list, FreeListLLNode *prev,
+			      FreeListLLNode *new_node)
 {
-	if (!prev) {
-		if (free_list_ll) {
-			new_node->next = free_list_ll;
-		} else {
-			free_list_ll = new_node;
-		}
-	} else {
-		if (!prev->next) {
-			prev->next = new_node;
-			new_node->next = NULL;
-		} else {
-			new_node->next = prev->next;
-			prev->next = new_node;
-		}
-	}
+	uint64_t *link = prev ? &prev->next : list->head;
+
+	new_node->next = *link;
+	*link = free_list_ll_link(list, new_node);
 }
 
-void free_list_ll_remove_node(FreeListLLNode *prev, FreeListLLNode *del_node)
+void free_list_ll_remove_node(FreeListLL *list, FreeListLLNode *prev,
+			      FreeListLLNode *del_node)
 {
-	if (!prev) {
-		free_list_ll = del_node->next;
-	} else {
-		prev->next = del_node->next;
-	}
+	uint64_t *link = prev ? &prev->next : list->head;
+
+	*link = del_node->next;
 }
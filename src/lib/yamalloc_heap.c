@@ -0,0 +1,645 @@
+#include "yamalloc_heap.h"
+#include "yamalloc_os.h"
+#include <errno.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define YAHEAP_SUPPORTED
+#endif
+
+#ifdef YAHEAP_SUPPORTED
+// Offset of the first block
+#define YAHEAP_FIRST                                                           \
+	((sizeof(YaHeapHeader) + YAHEAP_ALIGNMENT - 1) &                       \
+	 ~(size_t)(YAHEAP_ALIGNMENT - 1))
+// Smallest heap: the header, one free node and the fencepost
+#define YAHEAP_MIN_SIZE                                                        \
+	(YAHEAP_FIRST + sizeof(FreeListLLNode) + sizeof(FreeListLLHeader))
+
+static YaHeapHeader *yaheap_header(const YaHeap *heap)
+{
+	return (YaHeapHeader *)heap->base;
+}
+
+static FreeListLLNode *yaheap_node(const YaHeap *heap, uint64_t offset)
+{
+	return free_list_ll_node(&heap->free_list, offset);
+}
+
+static uint64_t yaheap_offset_of(const YaHeap *heap, const void *ptr)
+{
+	return ptr == NULL ? 0 : (uint64_t)((const char *)ptr - heap->base);
+}
+
+// Points the free list of heap at its mapping
+static void yaheap_bind(YaHeap *heap)
+{
+	heap->free_list.base = heap->base;
+	heap->free_list.head = &yaheap_header(heap)->free_list;
+}
+
+// YAHEAP_MAGIC as the word stored in YaHeapHeader.magic
+static uint64_t yaheap_magic_word(void)
+{
+	char magic[sizeof(uint64_t)] = YAHEAP_MAGIC;
+	uint64_t word;
+
+	memcpy(&word, magic, sizeof(word));
+	return word;
+}
+
+// Makes a formatted heap visible to yaheap_published(), after everything
+// else in its header
+static void yaheap_publish(YaHeap *heap)
+{
+	__atomic_store_n(&yaheap_header(heap)->magic_word, yaheap_magic_word(),
+			 __ATOMIC_RELEASE);
+}
+
+static int yaheap_published(const YaHeap *heap)
+{
+	return __atomic_load_n(&yaheap_header(heap)->magic_word,
+			       __ATOMIC_ACQUIRE) == yaheap_magic_word();
+}
+
+/**
+ * @brief Lays out an empty heap: the header and a single free block
+ *
+ * The magic is left unset, for yaheap_publish() to write once the heap is
+ * ready.
+ *
+ * @param[in, out] heap Heap to format
+ * @return void
+ */
+static void yaheap_format(YaHeap *heap)
+{
+	YaHeapHeader *header = yaheap_header(heap);
+	FreeListLLNode *node = yaheap_node(heap, YAHEAP_FIRST);
+	size_t size = heap->size - YAHEAP_FIRST - sizeof(FreeListLLHeader);
+
+	memset(header, 0, sizeof(YaHeapHeader));
+	header->version = YAHEAP_VERSION;
+	header->size = heap->size;
+	header->free_list = YAHEAP_FIRST;
+	node->header.info = free_list_ll_pack(size, 0, 0, FREE_LIST_LL_FREE);
+	node->next = 0;
+	yaheap_node(heap, YAHEAP_FIRST + size)->header.info =
+	    free_list_ll_pack(0, 0, 0, 0);
+}
+
+/**
+ * @brief Rebuilds the free list of a heap that was not closed
+ *
+ * The block headers are walked from the first one to the fencepost:
+ * adjacent free blocks are merged and the free list is relinked in address
+ * order.
+ *
+ * @param[in, out] heap Heap to recover
+ * @return int 0 on success, -1 if the block headers are corrupted
+ */
+static int yaheap_recover(YaHeap *heap)
+{
+	size_t offset = YAHEAP_FIRST;
+	size_t end = heap->size - sizeof(FreeListLLHeader);
+	FreeListLLNode *last_free = NULL;
+	FreeListLLNode *prev = NULL;
+
+	yaheap_header(heap)->free_list = 0;
+	while (offset < end) {
+		FreeListLLNode *node = yaheap_node(heap, offset);
+		size_t size = free_list_ll_size(&node->header);
+
+		if (size < sizeof(FreeListLLNode) || size > end - offset ||
+		    (size & (YAHEAP_ALIGNMENT - 1)) != 0) {
+			return -1;
+		}
+		if (!free_list_ll_is_free(&node->header)) {
+			last_free = NULL;
+		} else if (last_free) {
+			last_free->header.info += size;
+		} else {
+			free_list_ll_insert_node(&heap->free_list, prev, node);
+			prev = last_free = node;
+		}
+		offset += size;
+	}
+	if (offset != end) {
+		return -1;
+	}
+	yaheap_node(heap, end)->header.info = free_list_ll_pack(0, 0, 0, 0);
+	return 0;
+}
+
+// Writes the heap back to its file; the header goes last when closing
+static int yaheap_sync(YaHeap *heap, uint32_t state)
+{
+	if (msync(heap->base, heap->size, MS_SYNC) != 0) {
+		return -1;
+	}
+	if (yaheap_header(heap)->state != state) {
+		yaheap_header(heap)->state = state;
+		return msync(heap->base, sizeof(YaHeapHeader), MS_SYNC);
+	}
+	return 0;
+}
+
+/**
+ * @brief Locks a heap
+ *
+ * Persistent heaps are only locked in thread-safe builds; shared heaps
+ * always are. When a process died holding the lock of a shared heap, the
+ * free list it may have left half updated is rebuilt. If its block headers
+ * are corrupted, the lock is given up without being made consistent, so the
+ * heap becomes unusable for every process instead of being handed out.
+ *
+ * @param[in] heap Heap to lock
+ * @return int 0 once locked, -1 if the heap cannot be used
+ */
+static int yaheap_lock(YaHeap *heap)
+{
+	pthread_mutex_t *lock = &yaheap_header(heap)->lock;
+	int ret;
+
+#ifndef YAMALLOC_THREAD_SAFE
+	if (!heap->shared) {
+		return 0;
+	}
+#endif
+	ret = pthread_mutex_lock(lock);
+#ifdef __linux__
+	if (ret == EOWNERDEAD) {
+		if (yaheap_recover(heap) != 0) {
+			// Unlocked while inconsistent: ENOTRECOVERABLE
+			pthread_mutex_unlock(lock);
+			return -1;
+		}
+		ret = pthread_mutex_consistent(lock);
+		if (ret != 0) {
+			pthread_mutex_unlock(lock);
+		}
+	}
+#endif
+	return ret == 0 ? 0 : -1;
+}
+
+static void yaheap_unlock(YaHeap *heap)
+{
+#ifndef YAMALLOC_THREAD_SAFE
+	if (!heap->shared) {
+		return;
+	}
+#endif
+	pthread_mutex_unlock(&yaheap_header(heap)->lock);
+}
+
+/**
+ * @brief Maps the file of a heap, formatting or recovering it as needed
+ *
+ * @param[in, out] heap Heap whose fd is open
+ * @param[in] size Size (in bytes) of a new heap
+ * @return int 0 on success, -1 on failure, with nothing left mapped
+ */
+static int yaheap_map(YaHeap *heap, size_t size)
+{
+	YaHeapHeader *header;
+	struct stat st;
+	int created;
+
+	if (flock(heap->fd, LOCK_EX | LOCK_NB) != 0 ||
+	    fstat(heap->fd, &st) != 0) {
+		return -1;
+	}
+	created = st.st_size == 0;
+	if (created) {
+		size = (size + YAMALLOC_OS_PAGE_SIZE - 1) &
+		       ~(size_t)(YAMALLOC_OS_PAGE_SIZE - 1);
+		if (size < YAHEAP_MIN_SIZE ||
+		    ftruncate(heap->fd, (off_t)size) != 0) {
+			return -1;
+		}
+	} else {
+		size = (size_t)st.st_size;
+		if (size < YAHEAP_MIN_SIZE) {
+			return -1;
+		}
+	}
+	heap->size = size;
+	heap->base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, heap->fd, 0);
+	if (heap->base == (char *)MAP_FAILED) {
+		return -1;
+	}
+	yaheap_bind(heap);
+
+	header = yaheap_header(heap);
+	if (created) {
+		yaheap_format(heap);
+		yaheap_publish(heap);
+	} else if (!yaheap_published(heap) ||
+		   header->version != YAHEAP_VERSION || header->size != size ||
+		   (header->state != YAHEAP_CLEAN &&
+		    yaheap_recover(heap) != 0)) {
+		munmap(heap->base, size);
+		return -1;
+	}
+	// A crash from now on is detected by the next opening
+	if (yaheap_sync(heap, YAHEAP_DIRTY) != 0) {
+		munmap(heap->base, size);
+		return -1;
+	}
+	return 0;
+}
+#endif // YAHEAP_SUPPORTED
+
+/**
+ * @brief Opens a persistent heap, creating it if the file is empty
+ *
+ * The file is mapped shared and locked against other processes. A new heap
+ * takes size bytes, rounded up to whole pages; an existing heap keeps the
+ * size of its file and size is ignored. A heap that was not closed is
+ * recovered from its block headers.
+ *
+ * @param[in] path File backing the heap
+ * @param[in] size Size (in bytes) of a new heap
+ * @return YaHeap* Heap handle, NULL on failure
+ */
+YaHeap *yamalloc_heap_open(const char *path, size_t size)
+{
+#ifdef YAHEAP_SUPPORTED
+	YaHeap *heap = (YaHeap *)yamalloc(sizeof(YaHeap));
+
+	if (!heap) {
+		return NULL;
+	}
+	heap->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (heap->fd < 0) {
+		yafree(heap);
+		return NULL;
+	}
+	heap->shared = 0;
+	if (yaheap_map(heap, size) != 0) {
+		close(heap->fd);
+		yafree(heap);
+		return NULL;
+	}
+	// The lock left in the file by the last opening is stale
+	pthread_mutex_init(&yaheap_header(heap)->lock, NULL);
+	return heap;
+#else
+	(void)path;
+	(void)size;
+	return NULL;
+#endif
+}
+
+/**
+ * @brief Allocates a block in a persistent heap, first fit
+ *
+ * The free list of the heap is searched and carved by the free_list_ll
+ * backend, as the one of the process heap.
+ *
+ * @param[in] heap Heap to allocate from
+ * @param[in] size Size (in bytes) of the payload
+ * @return void* Pointer to the payload, NULL if the heap is full or its
+ * block headers were found corrupted
+ */
+void *yamalloc_heap_alloc(YaHeap *heap, size_t size)
+{
+#ifdef YAHEAP_SUPPORTED
+	FreeListLLNode *prev = NULL;
+	FreeListLLNode *node;
+	size_t block_size;
+	void *ptr = NULL;
+
+	if (size > heap->size) {
+		return NULL;
+	}
+	block_size = free_list_ll_block_size(size);
+
+	if (yaheap_lock(heap) != 0) {
+		return NULL;
+	}
+	node = free_list_ll_find_first(&heap->free_list, &prev, block_size,
+				       NULL);
+	if (node) {
+		ptr = free_list_ll_carve(&heap->free_list, prev, node,
+					 block_size);
+	}
+	yaheap_unlock(heap);
+	return ptr;
+#else
+	(void)heap;
+	(void)size;
+	return NULL;
+#endif
+}
+
+/**
+ * @brief Returns a block to its persistent heap
+ *
+ * The block is inserted in the address-ordered free list and coalesced with
+ * its free neighbours. Nothing is done once the block headers of a shared
+ * heap were found corrupted.
+ *
+ * @param[in] heap Heap the block was allocated from
+ * @param[in] ptr Payload returned by yamalloc_heap_alloc(), or NULL
+ * @return void
+ */
+void yamalloc_heap_free(YaHeap *heap, void *ptr)
+{
+#ifdef YAHEAP_SUPPORTED
+	if (!ptr) {
+		return;
+	}
+	if (yaheap_lock(heap) != 0) {
+		return;
+	}
+	free_list_ll_release(&heap->free_list,
+			     (FreeListLLNode *)((char *)ptr -
+						sizeof(FreeListLLHeader)));
+	yaheap_unlock(heap);
+#else
+	(void)heap;
+	(void)ptr;
+#endif
+}
+
+/**
+ * @brief Returns the root object of a persistent heap
+ *
+ * @param[in] heap Heap
+ * @return void* Root object, NULL if none was set
+ */
+void *yamalloc_heap_root(YaHeap *heap)
+{
+#ifdef YAHEAP_SUPPORTED
+	uint64_t root =
+	    __atomic_load_n(&yaheap_header(heap)->root, __ATOMIC_ACQUIRE);
+
+	return root == 0 ? NULL : heap->base + root;
+#else
+	(void)heap;
+	return NULL;
+#endif
+}
+
+/**
+ * @brief Sets the root object of a persistent heap
+ *
+ * The root is the entry point to the data kept in the heap: it is the only
+ * object a reopened heap can find by itself.
+ *
+ * @param[in] heap Heap
+ * @param[in] ptr Object allocated in heap, or NULL to clear the root
+ * @return void
+ */
+void yamalloc_heap_set_root(YaHeap *heap, void *ptr)
+{
+#ifdef YAHEAP_SUPPORTED
+	__atomic_store_n(&yaheap_header(heap)->root,
+			 yaheap_offset_of(heap, ptr), __ATOMIC_RELEASE);
+#else
+	(void)heap;
+	(void)ptr;
+#endif
+}
+
+/**
+ * @brief Converts a pointer into a persistent heap to an offset
+ *
+ * Objects of the heap must link to each other by offset: the heap is mapped
+ * at a different address each time it is opened.
+ *
+ * @param[in] heap Heap
+ * @param[in] ptr Pointer into heap, or NULL
+ * @return uint64_t Offset of ptr, 0 for NULL
+ */
+uint64_t yamalloc_heap_offset(YaHeap *heap, const void *ptr)
+{
+#ifdef YAHEAP_SUPPORTED
+	return yaheap_offset_of(heap, ptr);
+#else
+	(void)heap;
+	(void)ptr;
+	return 0;
+#endif
+}
+
+/**
+ * @brief Converts an offset returned by yamalloc_heap_offset() to a pointer
+ *
+ * @param[in] heap Heap
+ * @param[in] offset Offset into heap, or 0
+ * @return void* Pointer at offset, NULL for 0
+ */
+void *yamalloc_heap_pointer(YaHeap *heap, uint64_t offset)
+{
+#ifdef YAHEAP_SUPPORTED
+	return offset == 0 ? NULL : heap->base + offset;
+#else
+	(void)heap;
+	(void)offset;
+	return NULL;
+#endif
+}
+
+/**
+ * @brief Writes a persistent heap back to its file
+ *
+ * The heap stays open: a crash after the flush still makes the next opening
+ * recover the free list. Shared heaps have no file to write to.
+ *
+ * @param[in] heap Heap to flush
+ * @return int 0 on success, -1 on failure
+ */
+int yamalloc_heap_flush(YaHeap *heap)
+{
+#ifdef YAHEAP_SUPPORTED
+	int ret;
+
+	if (heap->shared) {
+		return 0;
+	}
+	if (yaheap_lock(heap) != 0) {
+		return -1;
+	}
+	ret = yaheap_sync(heap, YAHEAP_DIRTY);
+	yaheap_unlock(heap);
+	return ret;
+#else
+	(void)heap;
+	return -1;
+#endif
+}
+
+/**
+ * @brief Detaches from a heap, flushing and marking clean a persistent one
+ *
+ * A persistent heap is marked clean only once all its blocks have reached
+ * the file. A shared heap lives on until yamalloc_shm_unlink() and the last
+ * detach. No other thread may use the handle during or after the call.
+ *
+ * @param[in] heap Heap to close
+ * @return int 0 on success, -1 if the heap could not be written back
+ */
+int yamalloc_heap_close(YaHeap *heap)
+{
+#ifdef YAHEAP_SUPPORTED
+	int ret = 0;
+
+	if (!heap->shared) {
+		ret = yaheap_sync(heap, YAHEAP_CLEAN);
+		pthread_mutex_destroy(&yaheap_header(heap)->lock);
+	}
+	munmap(heap->base, heap->size);
+	close(heap->fd);
+	yafree(heap);
+	return ret;
+#else
+	(void)heap;
+	return -1;
+#endif
+}
+
+#ifdef YAHEAP_SUPPORTED
+// Maps a shared memory object of size bytes
+static YaHeap *yaheap_shm_map(int fd, size_t size)
+{
+	YaHeap *heap = (YaHeap *)yamalloc(sizeof(YaHeap));
+
+	if (!heap) {
+		return NULL;
+	}
+	heap->base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, fd, 0);
+	if (heap->base == (char *)MAP_FAILED) {
+		yafree(heap);
+		return NULL;
+	}
+	heap->size = size;
+	heap->fd = fd;
+	heap->shared = 1;
+	yaheap_bind(heap);
+	return heap;
+}
+#endif // YAHEAP_SUPPORTED
+
+/**
+ * @brief Creates a heap in a new POSIX shared memory object
+ *
+ * The heap and its lock can be used by every process that attaches to it:
+ * processes exchange offsets from yamalloc_heap_offset(), since each one
+ * maps the heap at its own address. The lock is robust: the death of a
+ * process holding it makes the next locker rebuild the free list.
+ *
+ * @param[in] name Name of the object, as for shm_open(); it must not exist
+ * @param[in] size Size (in bytes) of the heap, rounded up to whole pages
+ * @return YaHeap* Heap handle, NULL on failure
+ */
+YaHeap *yamalloc_shm_create(const char *name, size_t size)
+{
+#ifdef YAHEAP_SUPPORTED
+	pthread_mutexattr_t attr;
+	YaHeap *heap;
+	int fd;
+
+	size = (size + YAMALLOC_OS_PAGE_SIZE - 1) &
+	       ~(size_t)(YAMALLOC_OS_PAGE_SIZE - 1);
+	if (size < YAHEAP_MIN_SIZE) {
+		return NULL;
+	}
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return NULL;
+	}
+	heap = ftruncate(fd, (off_t)size) == 0 ? yaheap_shm_map(fd, size)
+					       : NULL;
+	if (!heap) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	yaheap_format(heap);
+	yaheap_header(heap)->state = YAHEAP_DIRTY;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+	pthread_mutex_init(&yaheap_header(heap)->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	// Processes attaching from now on find the lock initialized
+	yaheap_publish(heap);
+	return heap;
+#else
+	(void)name;
+	(void)size;
+	return NULL;
+#endif
+}
+
+/**
+ * @brief Attaches to a heap made by yamalloc_shm_create()
+ *
+ * A heap that is still being created is not attached to, as if the object
+ * held no heap.
+ *
+ * @param[in] name Name of the shared memory object
+ * @return YaHeap* Heap handle, NULL if the object does not hold a heap
+ */
+YaHeap *yamalloc_shm_attach(const char *name)
+{
+#ifdef YAHEAP_SUPPORTED
+	YaHeapHeader *header;
+	struct stat st;
+	YaHeap *heap;
+	int fd = shm_open(name, O_RDWR, 0);
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < YAHEAP_MIN_SIZE) {
+		close(fd);
+		return NULL;
+	}
+	heap = yaheap_shm_map(fd, (size_t)st.st_size);
+	if (!heap) {
+		close(fd);
+		return NULL;
+	}
+	header = yaheap_header(heap);
+	if (!yaheap_published(heap) || header->version != YAHEAP_VERSION ||
+	    header->size != heap->size) {
+		yamalloc_heap_close(heap);
+		return NULL;
+	}
+	return heap;
+#else
+	(void)name;
+	return NULL;
+#endif
+}
+
+/**
+ * @brief Removes the name of a shared heap
+ *
+ * Attached processes keep using the heap; its memory is released by the
+ * last yamalloc_heap_close().
+ *
+ * @param[in] name Name passed to yamalloc_shm_create()
+ * @return int 0 on success, -1 on failure
+ */
+int yamalloc_shm_unlink(const char *name)
+{
+#ifdef YAHEAP_SUPPORTED
+	return shm_unlink(name);
+#else
+	(void)name;
+	return -1;
+#endif
+}
@@ -0,0 +1,224 @@
+#include "yamalloc_limit.h"
+#include "yamalloc_pool.h"
+
+#ifdef YAMALLOC_LINKED_LIST
+#include "yamalloc_linked_list.h"
+#endif // YAMALLOC_LINKED_LIST
+
+#ifdef YAMALLOC_FREE_LIST_LL
+#include "yamalloc_free_list_ll.h"
+#endif // YAMALLOC_FREE_LIST_LL
+
+// Bytes obtained from the kernel, and the watermarks (0 when unset)
+static size_t limit_footprint = 0;
+static size_t limit_soft = 0;
+static size_t limit_hard = 0;
+int limit_pressure = 0;
+
+static LimitCallback limit_callbacks[YAMALLOC_PRESSURE_CALLBACKS];
+static size_t limit_callback_count = 0;
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * @brief Accounts for memory about to be requested to the kernel
+ *
+ * Called before every sbrk or mmap of the allocator.
+ *
+ * @param[in] size Size (in bytes) of the request
+ * @return int 0 if the request may proceed, -1 if it would cross the hard
+ * watermark
+ */
+int limit_charge(size_t size)
+{
+	size_t footprint = __atomic_load_n(&limit_footprint, __ATOMIC_RELAXED);
+	size_t hard = __atomic_load_n(&limit_hard, __ATOMIC_RELAXED);
+	size_t soft;
+
+	do {
+		if (hard != 0 && (size > hard || footprint > hard - size)) {
+			__atomic_store_n(&limit_pressure, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&limit_footprint, &footprint,
+					      footprint + size, 1,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	// Only the charge that crosses the soft watermark raises the pressure:
+	// growing further above it does not relieve again, until the footprint
+	// has fallen back below it
+	soft = __atomic_load_n(&limit_soft, __ATOMIC_RELAXED);
+	if (soft != 0 && footprint <= soft && footprint + size > soft) {
+		__atomic_store_n(&limit_pressure, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/**
+ * @brief Accounts for memory given back to the kernel, or not obtained
+ * after limit_charge()
+ *
+ * @param[in] size Size (in bytes) released
+ * @return void
+ */
+void limit_release(size_t size)
+{
+	__atomic_fetch_sub(&limit_footprint, size, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sheds memory after the footprint crossed the soft watermark
+ *
+ * The calling thread flushes its pool magazines, then the pressure
+ * callbacks drop what they can, and the free memory of the backend is
+ * trimmed from the top of the heap and purged from the other free blocks.
+ * One thread relieves each crossing; the others keep allocating.
+ *
+ * @return void
+ */
+void limit_relieve(void)
+{
+	LimitCallback callbacks[YAMALLOC_PRESSURE_CALLBACKS];
+	size_t count;
+
+	if (!__atomic_exchange_n(&limit_pressure, 0, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	yapool_flush_thread_cache();
+
+	// Callbacks may free memory or unregister themselves: they run
+	// outside the lock, on a copy of the table
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&limit_lock);
+#endif
+	count = limit_callback_count;
+	for (size_t i = 0; i < count; i++) {
+		callbacks[i] = limit_callbacks[i];
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&limit_lock);
+#endif
+	for (size_t i = 0; i < count; i++) {
+		callbacks[i].callback(yamalloc_footprint(), callbacks[i].ctx);
+	}
+
+#ifdef YAMALLOC_LINKED_LIST
+	linked_list_trim();
+#elif YAMALLOC_FREE_LIST_LL
+	free_list_ll_trim();
+#elif YAMALLOC_FREE_LIST_RBT
+	free_list_rbt_trim();
+#endif
+}
+
+/**
+ * @brief Sets the memory budget of the allocator
+ *
+ * The hard watermark is bytes and the soft one 7/8 of it, see
+ * yamalloc_set_soft_limit() to move it. A footprint already past the soft
+ * watermark is relieved by the next allocation.
+ *
+ * @param[in] bytes Largest footprint, 0 to remove both watermarks
+ * @return void
+ */
+void yamalloc_set_limit(size_t bytes)
+{
+	size_t soft = bytes / LIMIT_SOFT_DENOMINATOR * LIMIT_SOFT_NUMERATOR;
+
+	__atomic_store_n(&limit_hard, bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&limit_soft, soft, __ATOMIC_RELAXED);
+	if (soft != 0 && yamalloc_footprint() > soft) {
+		__atomic_store_n(&limit_pressure, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @brief Moves the soft watermark
+ *
+ * @param[in] bytes Footprint past which memory is shed, 0 to never shed
+ * @return int 0 on success, -1 if bytes is above the hard watermark
+ */
+int yamalloc_set_soft_limit(size_t bytes)
+{
+	size_t hard = __atomic_load_n(&limit_hard, __ATOMIC_RELAXED);
+
+	if (hard != 0 && bytes > hard) {
+		return -1;
+	}
+	__atomic_store_n(&limit_soft, bytes, __ATOMIC_RELAXED);
+	if (bytes != 0 && yamalloc_footprint() > bytes) {
+		__atomic_store_n(&limit_pressure, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+size_t yamalloc_footprint(void)
+{
+	return __atomic_load_n(&limit_footprint, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Registers a function called when the soft watermark is crossed
+ *
+ * The callback runs in the thread whose allocation noticed the pressure,
+ * outside the allocator locks: it may free memory, or allocate.
+ *
+ * @param[in] callback Function called with the footprint and ctx
+ * @param[in] ctx Argument passed to callback
+ * @return int 0 on success, -1 if YAMALLOC_PRESSURE_CALLBACKS callbacks are
+ * already registered
+ */
+int yamalloc_add_pressure_callback(YamallocPressureCallback callback,
+				   void *ctx)
+{
+	int ret = -1;
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&limit_lock);
+#endif
+	if (limit_callback_count < YAMALLOC_PRESSURE_CALLBACKS) {
+		limit_callbacks[limit_callback_count].callback = callback;
+		limit_callbacks[limit_callback_count].ctx = ctx;
+		limit_callback_count++;
+		ret = 0;
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&limit_lock);
+#endif
+	return ret;
+}
+
+/**
+ * @brief Unregisters a callback of yamalloc_add_pressure_callback()
+ *
+ * @param[in] callback Function registered
+ * @param[in] ctx Argument it was registered with
+ * @return int 0 on success, -1 if the pair was not registered
+ */
+int yamalloc_remove_pressure_callback(YamallocPressureCallback callback,
+				      void *ctx)
+{
+	int ret = -1;
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&limit_lock);
+#endif
+	for (size_t i = 0; i < limit_callback_count; i++) {
+		if (limit_callbacks[i].callback == callback &&
+		    limit_callbacks[i].ctx == ctx) {
+			limit_callbacks[i] =
+			    limit_callbacks[--limit_callback_count];
+			ret = 0;
+			break;
+		}
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&limit_lock);
+#endif
+	return ret;
+}
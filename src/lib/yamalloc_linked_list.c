@@ -1,4 +1,11 @@
 #include "yamalloc_linked_list.h"
+#include "yamalloc_instrument.h"
+#include "yamalloc_limit.h"
+#include "yamalloc_os.h"
+#include "yamalloc_stats.h"
+#ifdef YAMALLOC_PAGE_MAP
+#include "yamalloc_page_map.h"
+#endif
 #include <string.h>
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -39,6 +46,11 @@ void *sbrk(intptr_t increment)
 
 #define ALIGNMENT 8
 static BlockHeaderLinkedList *linked_list = NULL;
+// Blocks are carved from whole pages obtained with sbrk, so that no page
+// holds both our blocks and the data of another user of the program break.
+// The next block starts at linked_list_top, the pages end at linked_list_end.
+static char *linked_list_top = NULL;
+static char *linked_list_end = NULL;
 
 #ifdef YAMALLOC_THREAD_SAFE
 #include <pthread.h>
@@ -75,7 +87,10 @@ static void align(size_t *size)
 void *linked_list_yamalloc(size_t size)
 {
 #ifdef YAMALLOC_THREAD_SAFE
-	pthread_mutex_lock(&malloc_lock);
+	INSTRUMENT_LOCK(&malloc_lock);
+	// Frees coalesce the list under free_lock, so it is held as well while
+	// the list is walked and extended.
+	INSTRUMENT_LOCK(&free_lock);
 #endif
 
 	align(&size);
@@ -86,6 +101,7 @@ void *linked_list_yamalloc(size_t size)
 		block = linked_list_request_space(NULL, size);
 		if (!block) {
 #ifdef YAMALLOC_THREAD_SAFE
+			pthread_mutex_unlock(&free_lock);
 			pthread_mutex_unlock(&malloc_lock);
 #endif
 			return NULL;
@@ -95,11 +111,12 @@ void *linked_list_yamalloc(size_t size)
 		BlockHeaderLinkedList *last = linked_list;
 		block = linked_list_find_free_block(&last, size);
 		if (block) {
-			block->is_free = 0;
+			block->size_and_free &= ~LINKED_LIST_FREE;
 		} else {
 			block = linked_list_request_space(last, size);
 			if (!block) {
 #ifdef YAMALLOC_THREAD_SAFE
+				pthread_mutex_unlock(&free_lock);
 				pthread_mutex_unlock(&malloc_lock);
 #endif
 				return NULL;
@@ -107,11 +124,99 @@ void *linked_list_yamalloc(size_t size)
 		}
 	}
 #ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&free_lock);
 	pthread_mutex_unlock(&malloc_lock);
 #endif
 	return (void *)(block + 1);
 }
 
+/**
+ * @brief Allocates a block whose payload is aligned
+ *
+ * Free blocks that are already aligned are reused. Otherwise the heap grows
+ * by a free block filling the gap up to the next aligned payload, then by
+ * the block itself.
+ *
+ * @param[in] alignment Alignment (in bytes), a power of two
+ * @param[in] size Size (in bytes) of the block to allocate
+ * @return void* Pointer to the allocated block of memory, NULL on failure
+ */
+void *linked_list_yaaligned_alloc(size_t alignment, size_t size)
+{
+	BlockHeaderLinkedList *block = linked_list;
+	BlockHeaderLinkedList *last = NULL;
+
+	if (alignment <= ALIGNMENT) {
+		return linked_list_yamalloc(size);
+	}
+	if (size > ~(size_t)0 / 2 || alignment > ~(size_t)0 / 4) {
+		return NULL;
+	}
+	align(&size);
+
+#ifdef YAMALLOC_THREAD_SAFE
+	INSTRUMENT_LOCK(&malloc_lock);
+	INSTRUMENT_LOCK(&free_lock);
+#endif
+	while (block && !(linked_list_is_free(block) &&
+			  linked_list_size(block) >= size &&
+			  ((uintptr_t)(block + 1) & (alignment - 1)) == 0)) {
+		last = block;
+		block = block->next;
+	}
+	if (block) {
+		block->size_and_free &= ~LINKED_LIST_FREE;
+	}
+	while (!block) {
+		uintptr_t brk = linked_list_top ? (uintptr_t)linked_list_top
+						: (uintptr_t)sbrk(0);
+		uintptr_t payload =
+		    (brk + sizeof(BlockHeaderLinkedList) + alignment - 1) &
+		    ~(uintptr_t)(alignment - 1);
+		size_t gap = payload - sizeof(BlockHeaderLinkedList) - brk;
+
+		// The gap is only usable as a block of its own
+		if (gap != 0 && gap < sizeof(BlockHeaderLinkedList)) {
+			gap += alignment;
+		}
+		if (gap != 0) {
+			BlockHeaderLinkedList *front;
+
+			front = linked_list_request_space(
+			    last, gap - sizeof(BlockHeaderLinkedList));
+			if (!front) {
+				break;
+			}
+			front->size_and_free |= LINKED_LIST_FREE;
+			if (!linked_list) {
+				linked_list = front;
+			}
+			last = front;
+			// The heap went on in pages away from the top
+			if ((uintptr_t)front != brk) {
+				continue;
+			}
+		}
+		block = linked_list_request_space(last, size);
+		if (!block) {
+			break;
+		}
+		if (!linked_list) {
+			linked_list = block;
+		}
+		if (((uintptr_t)(block + 1) & (alignment - 1)) != 0) {
+			block->size_and_free |= LINKED_LIST_FREE;
+			last = block;
+			block = NULL;
+		}
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&free_lock);
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+	return block ? (void *)(block + 1) : NULL;
+}
+
 /**
  * @brief Allocates a block of memory of the given size and initializes it to
  * zero
@@ -129,6 +234,9 @@ void *linked_list_yamalloc(size_t size)
  */
 void *linked_list_yacalloc(size_t num, size_t size)
 {
+	if (size != 0 && num > ~(size_t)0 / size) {
+		return NULL;
+	}
 	size_t total_size = num * size;
 	void *ptr = linked_list_yamalloc(total_size);
 	if (ptr) {
@@ -162,13 +270,14 @@ void *linked_list_yarealloc(void *ptr, size_t size)
 		return linked_list_yamalloc(size);
 	}
 	BlockHeaderLinkedList *block = (BlockHeaderLinkedList *)ptr - 1;
-	if (block->size >= size) {
+	size_t old_size = linked_list_size(block);
+	if (old_size >= size) {
 		return ptr;
 	}
 	void *new_ptr = linked_list_yamalloc(size);
 	if (new_ptr) {
 		uint8_t *p = (uint8_t *)new_ptr;
-		for (size_t i = 0; i < block->size; i++) {
+		for (size_t i = 0; i < old_size; i++) {
 			p[i] = ((uint8_t *)ptr)[i];
 		}
 		linked_list_yafree(ptr);
@@ -191,7 +300,7 @@ void linked_list_yafree(void *ptr)
 		return;
 	}
 #ifdef YAMALLOC_THREAD_SAFE
-	pthread_mutex_lock(&free_lock);
+	INSTRUMENT_LOCK(&free_lock);
 #endif
 	// Clear the memory
 	// for (size_t i = 0; i < ((BlockHeaderLinkedList *)ptr - 1)->size; i++)
@@ -202,13 +311,239 @@ void linked_list_yafree(void *ptr)
 	// (BlockHeaderLinkedList *)((uint8_t *)ptr -
 	// sizeof(BlockHeaderLinkedList))
 	BlockHeaderLinkedList *block = (BlockHeaderLinkedList *)ptr - 1;
-	block->is_free = 1;
+	block->size_and_free |= LINKED_LIST_FREE;
 	linked_list_coalesce_free_blocks();
 #ifdef YAMALLOC_THREAD_SAFE
 	pthread_mutex_unlock(&free_lock);
 #endif
 }
 
+size_t linked_list_usable_size(void *ptr)
+{
+	return linked_list_size((BlockHeaderLinkedList *)ptr - 1);
+}
+
+/**
+ * @brief Resizes a block without moving it
+ *
+ * Blocks are never split nor extended, so only sizes that already fit
+ * succeed.
+ *
+ * @param[in] ptr Pointer to the block
+ * @param[in] size New size (in bytes) of the block
+ * @return int 0 on success, -1 if the block is too small
+ */
+int linked_list_resize(void *ptr, size_t size)
+{
+	return linked_list_usable_size(ptr) >= size ? 0 : -1;
+}
+
+/**
+ * @brief Gives the free memory of the heap back to the kernel
+ *
+ * The last block, when it is free and nobody else moved the program break
+ * past our pages, goes back above the top of the heap, and the whole pages
+ * above it are released with sbrk. The whole pages inside the other free
+ * blocks are purged.
+ *
+ * @return size_t Bytes released with sbrk
+ */
+size_t linked_list_trim(void)
+{
+	BlockHeaderLinkedList *prev = NULL;
+	BlockHeaderLinkedList *last = linked_list;
+	size_t released = 0;
+
+#ifdef YAMALLOC_THREAD_SAFE
+	INSTRUMENT_LOCK(&malloc_lock);
+	INSTRUMENT_LOCK(&free_lock);
+#endif
+	while (last && last->next) {
+		if (linked_list_is_free(last)) {
+			yamalloc_os_purge(last + 1, linked_list_size(last));
+		}
+		prev = last;
+		last = last->next;
+	}
+	if (last && linked_list_is_free(last)) {
+		char *end = (char *)(last + 1) + linked_list_size(last);
+
+		if (end == linked_list_top && sbrk(0) == linked_list_end) {
+			char *keep = (char *)last + YAMALLOC_OS_PAGE_SIZE - 1;
+
+			keep -= (uintptr_t)keep & (YAMALLOC_OS_PAGE_SIZE - 1);
+			if (prev) {
+				prev->next = NULL;
+			} else {
+				linked_list = NULL;
+			}
+			linked_list_top = (char *)last;
+			released = (size_t)(linked_list_end - keep);
+			if (released != 0) {
+#ifdef YAMALLOC_PAGE_MAP
+				page_map_set(keep, released, PAGE_MAP_NONE);
+#endif
+				sbrk(-(intptr_t)released);
+				stats_record_sbrk(-(intptr_t)released);
+				limit_release(released);
+				linked_list_end = keep;
+			}
+		} else {
+			yamalloc_os_purge(last + 1, linked_list_size(last));
+		}
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&free_lock);
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+	return released;
+}
+
+/**
+ * @brief Sums up the free blocks of the heap
+ *
+ * @param[out] bytes Bytes of the free blocks, headers included
+ * @param[out] blocks Number of free blocks
+ * @param[out] largest Size (in bytes) of the largest free block
+ * @return void
+ */
+void linked_list_free_stats(size_t *bytes, size_t *blocks, size_t *largest)
+{
+	*bytes = 0;
+	*blocks = 0;
+	*largest = 0;
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&malloc_lock);
+	pthread_mutex_lock(&free_lock);
+#endif
+	for (BlockHeaderLinkedList *block = linked_list; block;
+	     block = block->next) {
+		if (linked_list_is_free(block)) {
+			size_t size = sizeof(BlockHeaderLinkedList) +
+				      linked_list_size(block);
+			*bytes += size;
+			*blocks += 1;
+			if (size > *largest) {
+				*largest = size;
+			}
+		}
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&free_lock);
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+}
+
+/**
+ * @brief Visits every block of the heap, in list order
+ *
+ * @param[in] callback Function called on each block
+ * @param[in] ctx Argument passed to callback
+ * @return int 0, or the non-zero value that stopped the walk
+ */
+int linked_list_heap_walk(YamallocWalkCallback callback, void *ctx)
+{
+	struct yamalloc_block info;
+	int ret = 0;
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&malloc_lock);
+	pthread_mutex_lock(&free_lock);
+#endif
+	for (BlockHeaderLinkedList *block = linked_list; block && !ret;
+	     block = block->next) {
+		info.address = block;
+		info.size =
+		    sizeof(BlockHeaderLinkedList) + linked_list_size(block);
+		info.free = linked_list_is_free(block);
+		info.padding = info.free ? 0 : sizeof(BlockHeaderLinkedList);
+		ret = callback(&info, ctx);
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&free_lock);
+	pthread_mutex_unlock(&malloc_lock);
+#endif
+	return ret;
+}
+
+/**
+ * @brief Gives back the end of the heap after a failed growth
+ *
+ * The program break only moves back when nobody else moved it since;
+ * otherwise the region stays ours, and in the footprint.
+ *
+ * @param[in] mem Start of the region obtained from sbrk
+ * @param[in] size Size (in bytes) of the region
+ * @return void
+ */
+static void linked_list_give_back(char *mem, size_t size)
+{
+	if (sbrk(0) == mem + size) {
+		sbrk(-(intptr_t)size);
+		stats_record_sbrk(-(intptr_t)size);
+		limit_release(size);
+	}
+}
+
+/**
+ * @brief Obtains whole pages from the kernel for the blocks to come
+ *
+ * The pages extend the heap when they directly follow it. Otherwise the
+ * blocks go on from the first page boundary of the new region, and the end
+ * of the old pages is left unused.
+ *
+ * @param[in] size Size (in bytes) needed past linked_list_top
+ * @return int 0 on success, -1 if the kernel refused to grow the heap or the
+ * growth would cross the hard watermark of yamalloc_set_limit()
+ */
+static int linked_list_grow(size_t size)
+{
+	size_t grow = (size + YAMALLOC_OS_PAGE_SIZE - 1) &
+		      ~(size_t)(YAMALLOC_OS_PAGE_SIZE - 1);
+	size_t pad = 0;
+	char *mem;
+
+	if (limit_charge(grow) != 0) {
+		return -1;
+	}
+	INSTRUMENT_START(t);
+	mem = (char *)sbrk((intptr_t)grow);
+	INSTRUMENT_END(YAMALLOC_PATH_OS_GROWTH, t);
+	if (mem == (void *)-1) {
+		limit_release(grow);
+		return -1;
+	}
+	stats_record_sbrk((intptr_t)grow);
+	if (mem != linked_list_end) {
+		pad = (0 - (uintptr_t)mem) & (YAMALLOC_OS_PAGE_SIZE - 1);
+		if (pad != 0) {
+			if (limit_charge(pad) != 0) {
+				linked_list_give_back(mem, grow);
+				return -1;
+			}
+			if (sbrk((intptr_t)pad) == (void *)-1) {
+				limit_release(pad);
+				linked_list_give_back(mem, grow);
+				return -1;
+			}
+			stats_record_sbrk((intptr_t)pad);
+		}
+	}
+#ifdef YAMALLOC_PAGE_MAP
+	if (page_map_set(mem + pad, grow, PAGE_MAP_BACKEND) != 0) {
+		page_map_set(mem + pad, grow, PAGE_MAP_NONE);
+		linked_list_give_back(mem, grow + pad);
+		return -1;
+	}
+#endif
+	if (mem != linked_list_end) {
+		linked_list_top = mem + pad;
+	}
+	linked_list_end = mem + pad + grow;
+	return 0;
+}
+
 /**
  * @brief Requests space to the kernel
  *
@@ -217,20 +552,28 @@ void linked_list_yafree(void *ptr)
  *
  * @param[in] last Pointer to the last block in the free list
  * @param[in] size Size (in bytes) of the block to allocate
- * @return BlockHeaderLinkedList* Pointer to the allocated block of memory
+ * @return BlockHeaderLinkedList* Pointer to the allocated block of memory,
+ * NULL on failure or past the hard watermark of yamalloc_set_limit()
  */
 BlockHeaderLinkedList *linked_list_request_space(BlockHeaderLinkedList *last,
 						 size_t size)
 {
 	BlockHeaderLinkedList *block;
+	size_t total_size;
+
+	if (size > ~(size_t)0 / 4) {
+		return NULL;
+	}
 	align(&size);
-	size_t total_size = sizeof(BlockHeaderLinkedList) + size;
-	block = (BlockHeaderLinkedList *)sbrk((intptr_t)total_size);
-	if (block == (void *)-1) {
+	total_size = sizeof(BlockHeaderLinkedList) + size;
+	if ((linked_list_top == NULL ||
+	     (size_t)(linked_list_end - linked_list_top) < total_size) &&
+	    linked_list_grow(total_size) != 0) {
 		return NULL;
 	}
-	block->size = size;
-	block->is_free = 0;
+	block = (BlockHeaderLinkedList *)linked_list_top;
+	linked_list_top += total_size;
+	block->size_and_free = size;
 	block->next = NULL;
 	if (last) {
 		last->next = block;
@@ -246,7 +589,8 @@ BlockHeaderLinkedList *linked_list_request_space(BlockHeaderLinkedList *last,
  * The algorithm used is first-fit, i.e., the first block that is large enough
  * to hold the requested size is returned.
  *
- * @param[in] last Pointer to the last block in the free list
+ * @param[out] last Pointer to the last block visited, i.e., the found block
+ * or the tail of the list when no block fits
  * @param[in] size Size (in bytes) of the block to allocate
  * @return BlockHeaderLinkedList* Pointer to the free block of memory
  */
@@ -254,9 +598,16 @@ BlockHeaderLinkedList *linked_list_find_free_block(BlockHeaderLinkedList **last,
 						   size_t size)
 {
 	BlockHeaderLinkedList *current = linked_list;
-	while (current && !(current->size >= size && current->is_free)) {
+	size_t probes = 1;
+	INSTRUMENT_START(t);
+
+	while (current && !(linked_list_size(current) >= size &&
+			    linked_list_is_free(current))) {
+		*last = current;
 		current = current->next;
+		probes++;
 	}
+	INSTRUMENT_SEARCH_END(t, probes);
 	if (current) {
 		*last = current;
 	}
@@ -275,13 +626,22 @@ BlockHeaderLinkedList *linked_list_find_free_block(BlockHeaderLinkedList **last,
 void linked_list_coalesce_free_blocks(void)
 {
 	BlockHeaderLinkedList *current = linked_list;
+	INSTRUMENT_START(t);
+
 	while (current) {
-		if (current->is_free && current->next &&
-		    current->next->is_free) {
-			current->size +=
-			    current->next->size + sizeof(BlockHeaderLinkedList);
+		// Blocks are only merged when they are adjacent: sbrk is shared
+		// with other users of the program break.
+		if (linked_list_is_free(current) && current->next &&
+		    linked_list_is_free(current->next) &&
+		    (char *)(current + 1) + linked_list_size(current) ==
+			(char *)current->next) {
+			current->size_and_free +=
+			    linked_list_size(current->next) +
+			    sizeof(BlockHeaderLinkedList);
 			current->next = current->next->next;
+			continue;
 		}
 		current = current->next;
 	}
+	INSTRUMENT_END(YAMALLOC_PATH_COALESCE, t);
 }
@@ -0,0 +1,97 @@
+#include "yamalloc_os.h"
+#include "yamalloc_instrument.h"
+#include "yamalloc_limit.h"
+#include "yamalloc_stats.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#elif defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+/**
+ * @brief Maps zeroed, page-aligned memory directly from the kernel
+ *
+ * Used for allocator metadata and for memory that must not share pages with
+ * the sbrk heap.
+ *
+ * @param[in] size Size (in bytes) to map, rounded up to whole pages
+ * @return void* Pointer to the mapping, NULL on failure or past the hard
+ * watermark of yamalloc_set_limit()
+ */
+void *yamalloc_os_map(size_t size)
+{
+	void *ptr;
+
+	size = (size + YAMALLOC_OS_PAGE_SIZE - 1) &
+	       ~(size_t)(YAMALLOC_OS_PAGE_SIZE - 1);
+	if (limit_charge(size) != 0) {
+		return NULL;
+	}
+	INSTRUMENT_START(t);
+#if defined(_WIN32) || defined(_WIN64)
+	ptr = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE,
+			   PAGE_READWRITE);
+#else
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		ptr = NULL;
+	}
+#endif
+	INSTRUMENT_END(YAMALLOC_PATH_OS_GROWTH, t);
+	if (ptr) {
+		stats_record_mmap(size);
+	} else {
+		limit_release(size);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Returns memory obtained with yamalloc_os_map() to the kernel
+ *
+ * @param[in] ptr Pointer returned by yamalloc_os_map()
+ * @param[in] size Size (in bytes) passed to yamalloc_os_map()
+ * @return void
+ */
+void yamalloc_os_unmap(void *ptr, size_t size)
+{
+	size = (size + YAMALLOC_OS_PAGE_SIZE - 1) &
+	       ~(size_t)(YAMALLOC_OS_PAGE_SIZE - 1);
+#if defined(_WIN32) || defined(_WIN64)
+	(void)size;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, size);
+#endif
+	stats_record_munmap(size);
+	limit_release(size);
+}
+
+/**
+ * @brief Lets the kernel reclaim the whole pages of a free range
+ *
+ * The pages stay mapped and read back as zeros, or as their old contents
+ * where the kernel did not reclaim them.
+ *
+ * @param[in] ptr First byte of the range
+ * @param[in] size Size (in bytes) of the range
+ * @return void
+ */
+void yamalloc_os_purge(void *ptr, size_t size)
+{
+	uintptr_t start = ((uintptr_t)ptr + YAMALLOC_OS_PAGE_SIZE - 1) &
+			  ~(uintptr_t)(YAMALLOC_OS_PAGE_SIZE - 1);
+	uintptr_t end =
+	    ((uintptr_t)ptr + size) & ~(uintptr_t)(YAMALLOC_OS_PAGE_SIZE - 1);
+
+	if (end <= start) {
+		return;
+	}
+#if defined(_WIN32) || defined(_WIN64)
+	VirtualAlloc((void *)start, end - start, MEM_RESET, PAGE_READWRITE);
+#else
+	madvise((void *)start, end - start, MADV_DONTNEED);
+#endif
+}
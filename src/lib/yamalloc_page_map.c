@@ -0,0 +1,133 @@
+#include "yamalloc_page_map.h"
+#include "yamalloc_os.h"
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+static pthread_mutex_t page_map_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+typedef struct PageMapLeaf {
+	uintptr_t values[PAGE_MAP_LEVEL_SIZE];
+} PageMapLeaf;
+
+typedef struct PageMapNode {
+	PageMapLeaf *leaves[PAGE_MAP_LEVEL_SIZE];
+} PageMapNode;
+
+static PageMapNode *page_map_root[PAGE_MAP_LEVEL_SIZE];
+
+#define PAGE_MAP_INDEX(page, level)                                            \
+	(((page) >> ((level) * PAGE_MAP_LEVEL_BITS)) &                         \
+	 (PAGE_MAP_LEVEL_SIZE - 1))
+
+/**
+ * @brief Returns the leaf covering the given page
+ *
+ * @param[in] page Page number
+ * @param[in] create Whether a missing leaf is created
+ * @return PageMapLeaf* Leaf of the page, NULL if it is missing and create is
+ * not set, or if the kernel refused memory
+ */
+static PageMapLeaf *page_map_leaf(uintptr_t page, int create)
+{
+	PageMapNode **node_slot = &page_map_root[PAGE_MAP_INDEX(page, 2)];
+	PageMapLeaf **leaf_slot;
+
+	if (*node_slot == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		PageMapNode *node = yamalloc_os_map(sizeof(PageMapNode));
+		if (!node) {
+			return NULL;
+		}
+		__atomic_store_n(node_slot, node, __ATOMIC_RELEASE);
+	}
+
+	leaf_slot = &(*node_slot)->leaves[PAGE_MAP_INDEX(page, 1)];
+	if (*leaf_slot == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		PageMapLeaf *leaf = yamalloc_os_map(sizeof(PageMapLeaf));
+		if (!leaf) {
+			return NULL;
+		}
+		__atomic_store_n(leaf_slot, leaf, __ATOMIC_RELEASE);
+	}
+
+	return *leaf_slot;
+}
+
+/**
+ * @brief Records the owner of every page overlapping [addr, addr + size)
+ *
+ * Nodes are never freed, so lookups can run concurrently without locks.
+ * Clearing a range (PAGE_MAP_NONE) never allocates nodes, so it cannot
+ * fail, which lets callers undo a partial page_map_set().
+ *
+ * @param[in] addr Start of the range
+ * @param[in] size Size (in bytes) of the range
+ * @param[in] value Value stored for each page (PAGE_MAP_* kind)
+ * @return int 0 on success, -1 if the kernel refused memory for the map
+ */
+int page_map_set(const void *addr, size_t size, uintptr_t value)
+{
+	uintptr_t page = (uintptr_t)addr >> PAGE_MAP_PAGE_SHIFT;
+	uintptr_t last = ((uintptr_t)addr + size - 1) >> PAGE_MAP_PAGE_SHIFT;
+	int result = 0;
+
+	if (size == 0) {
+		return 0;
+	}
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&page_map_lock);
+#endif
+	for (; page <= last; page++) {
+		PageMapLeaf *leaf = page_map_leaf(page, value != PAGE_MAP_NONE);
+		if (!leaf && value == PAGE_MAP_NONE) {
+			continue;
+		}
+		if (!leaf) {
+			result = -1;
+			break;
+		}
+		__atomic_store_n(&leaf->values[PAGE_MAP_INDEX(page, 0)], value,
+				 __ATOMIC_RELEASE);
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&page_map_lock);
+#endif
+
+	return result;
+}
+
+/**
+ * @brief Looks up the owner of the page containing addr
+ *
+ * @param[in] addr Any address
+ * @return uintptr_t Value of the page, PAGE_MAP_NONE if it is not ours
+ */
+uintptr_t page_map_get(const void *addr)
+{
+	uintptr_t page = (uintptr_t)addr >> PAGE_MAP_PAGE_SHIFT;
+	PageMapNode *node;
+	PageMapLeaf *leaf;
+
+	if ((page >> (3 * PAGE_MAP_LEVEL_BITS)) != 0) {
+		return PAGE_MAP_NONE;
+	}
+	node = __atomic_load_n(&page_map_root[PAGE_MAP_INDEX(page, 2)],
+			       __ATOMIC_ACQUIRE);
+	if (!node) {
+		return PAGE_MAP_NONE;
+	}
+	leaf = __atomic_load_n(&node->leaves[PAGE_MAP_INDEX(page, 1)],
+			       __ATOMIC_ACQUIRE);
+	if (!leaf) {
+		return PAGE_MAP_NONE;
+	}
+	return __atomic_load_n(&leaf->values[PAGE_MAP_INDEX(page, 0)],
+			       __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,412 @@
+#include "yamalloc_pool.h"
+
+#ifdef YAMALLOC_THREAD_SAFE
+// Live pools, looked up by id when a magazine is flushed: the pool that
+// filled a magazine may have been destroyed in the meantime.
+static pthread_mutex_t yapool_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static YaPool *yapool_registry = NULL;
+static uint64_t yapool_next_id = 1;
+static pthread_key_t yapool_key;
+static pthread_once_t yapool_key_once = PTHREAD_ONCE_INIT;
+static __thread YaPoolMagazine yapool_magazines[YAPOOL_MAGAZINE_SLOTS];
+static __thread uint64_t yapool_clock = 0;
+#endif
+
+static void **yapool_link(const YaPool *pool, void *obj)
+{
+	return (void **)((char *)obj + pool->link_offset);
+}
+
+/**
+ * @brief Adds a chunk to the pool
+ *
+ * The chunk is carved lazily by yapool_pop(), so its pages are only touched
+ * when its objects are handed out.
+ *
+ * @param[in, out] pool Pool to grow
+ * @return int 0 on success, -1 on failure
+ */
+static int yapool_grow(YaPool *pool)
+{
+	size_t objs_size = pool->stride * pool->objs_per_chunk;
+	YaPoolChunk *chunk = (YaPoolChunk *)yamalloc(
+	    sizeof(YaPoolChunk) + pool->align - 1 + objs_size);
+	if (!chunk) {
+		return -1;
+	}
+	chunk->objs =
+	    (char *)(((uintptr_t)(chunk + 1) + pool->align - 1) &
+		     ~(uintptr_t)(pool->align - 1));
+	chunk->next = pool->chunks;
+	pool->chunks = chunk;
+	pool->bump = chunk->objs;
+	pool->end = chunk->objs + objs_size;
+	return 0;
+}
+
+static void *yapool_pop(YaPool *pool)
+{
+	void *obj = pool->free;
+
+	if (obj) {
+		pool->free = *yapool_link(pool, obj);
+		return obj;
+	}
+	if (pool->bump == pool->end && yapool_grow(pool) != 0) {
+		return NULL;
+	}
+	obj = pool->bump;
+	pool->bump += pool->stride;
+	if (pool->init) {
+		pool->init(obj, pool->ctx);
+	}
+	return obj;
+}
+
+static void yapool_push(YaPool *pool, void *obj)
+{
+	*yapool_link(pool, obj) = pool->free;
+	pool->free = obj;
+}
+
+#ifdef YAMALLOC_THREAD_SAFE
+/**
+ * @brief Gives every object of a magazine back to the pool that owns it
+ *
+ * The objects are dropped when the pool no longer exists: its chunks are
+ * gone with it.
+ *
+ * @param[in, out] mag Magazine to empty
+ * @return void
+ */
+static void yapool_flush_magazine(YaPoolMagazine *mag)
+{
+	YaPool *pool;
+
+	pthread_mutex_lock(&yapool_registry_lock);
+	for (pool = yapool_registry; pool; pool = pool->next) {
+		if (pool->id == mag->pool_id) {
+			break;
+		}
+	}
+	if (pool) {
+		pthread_mutex_lock(&pool->lock);
+		while (mag->count > 0) {
+			yapool_push(pool, mag->objs[--mag->count]);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	pthread_mutex_unlock(&yapool_registry_lock);
+	mag->count = 0;
+	mag->pool_id = 0;
+}
+
+static void yapool_thread_exit(void *mags)
+{
+	YaPoolMagazine *mag = (YaPoolMagazine *)mags;
+
+	for (size_t i = 0; i < YAPOOL_MAGAZINE_SLOTS; i++) {
+		if (mag[i].count > 0) {
+			yapool_flush_magazine(&mag[i]);
+		}
+	}
+}
+
+/**
+ * @brief Gives the objects cached by the calling thread back to their pools
+ *
+ * @return void
+ */
+void yapool_flush_thread_cache(void) { yapool_thread_exit(yapool_magazines); }
+
+static void yapool_key_init(void)
+{
+	pthread_key_create(&yapool_key, yapool_thread_exit);
+}
+
+/**
+ * @brief Looks up the calling thread's magazine of a pool
+ *
+ * @param[in] id Id of the pool
+ * @return YaPoolMagazine* Magazine of the pool, NULL if it has none
+ */
+static YaPoolMagazine *yapool_find_magazine(uint64_t id)
+{
+	for (size_t i = 0; i < YAPOOL_MAGAZINE_SLOTS; i++) {
+		if (yapool_magazines[i].pool_id == id) {
+			return &yapool_magazines[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Picks the calling thread's magazine to give to another pool
+ *
+ * An unused slot is preferred, then an empty one, which needs no flush,
+ * then the least recently used one.
+ *
+ * @return YaPoolMagazine* Magazine to evict
+ */
+static YaPoolMagazine *yapool_victim_magazine(void)
+{
+	YaPoolMagazine *victim = &yapool_magazines[0];
+
+	for (size_t i = 0; i < YAPOOL_MAGAZINE_SLOTS; i++) {
+		YaPoolMagazine *slot = &yapool_magazines[i];
+
+		if (slot->pool_id == 0) {
+			return slot;
+		}
+		if ((slot->count == 0) != (victim->count == 0)) {
+			if (slot->count == 0) {
+				victim = slot;
+			}
+		} else if (slot->last_use < victim->last_use) {
+			victim = slot;
+		}
+	}
+	return victim;
+}
+
+/**
+ * @brief Returns the calling thread's magazine for the pool
+ *
+ * A pool without a magazine evicts one, flushing the objects it caches.
+ *
+ * @param[in] pool Pool
+ * @return YaPoolMagazine* Magazine of the pool
+ */
+static YaPoolMagazine *yapool_magazine(YaPool *pool)
+{
+	YaPoolMagazine *mag = yapool_find_magazine(pool->id);
+
+	if (!mag) {
+		mag = yapool_victim_magazine();
+		if (mag->count > 0) {
+			yapool_flush_magazine(mag);
+		}
+		pthread_once(&yapool_key_once, yapool_key_init);
+		pthread_setspecific(yapool_key, yapool_magazines);
+		mag->pool_id = pool->id;
+	}
+	mag->last_use = ++yapool_clock;
+	return mag;
+}
+#else
+// Without YAMALLOC_THREAD_SAFE there are no magazines
+void yapool_flush_thread_cache(void) {}
+#endif
+
+/**
+ * @brief Creates a pool of objects of the same size
+ *
+ * @param[in] obj_size Size (in bytes) of the objects
+ * @param[in] align Alignment of the objects (power of two, 0 for default)
+ * @param[in] objs_per_chunk Number of objects per chunk (0 for default)
+ * @return YaPool* The new pool, NULL on failure
+ *
+ * @note Remember to release the pool using yapool_destroy()
+ */
+YaPool *yapool_create(size_t obj_size, size_t align, size_t objs_per_chunk)
+{
+	return yapool_create_ex(obj_size, align, objs_per_chunk, NULL, NULL,
+				NULL);
+}
+
+/**
+ * @brief Creates a pool of pre-constructed objects
+ *
+ * init is called once on every object when its chunk is carved and fini on
+ * every carved object by yapool_destroy(). Since the objects keep their
+ * state while they are free, the free-stack link is stored past the object.
+ *
+ * @param[in] obj_size Size (in bytes) of the objects
+ * @param[in] align Alignment of the objects (power of two, 0 for default)
+ * @param[in] objs_per_chunk Number of objects per chunk (0 for default)
+ * @param[in] init Constructor, or NULL
+ * @param[in] fini Destructor, or NULL
+ * @param[in] ctx Argument passed to init and fini
+ * @return YaPool* The new pool, NULL on failure
+ */
+YaPool *yapool_create_ex(size_t obj_size, size_t align, size_t objs_per_chunk,
+			 YaPoolCallback init, YaPoolCallback fini, void *ctx)
+{
+	YaPool *pool;
+	size_t link_offset;
+	size_t slot_size;
+	size_t stride;
+
+	if (align < YAPOOL_MIN_ALIGNMENT) {
+		align = YAPOOL_MIN_ALIGNMENT;
+	}
+	if ((align & (align - 1)) != 0 || align > ~(size_t)0 / 4 ||
+	    obj_size > ~(size_t)0 / 4) {
+		return NULL;
+	}
+	if (objs_per_chunk == 0) {
+		objs_per_chunk = YAPOOL_DEFAULT_OBJS_PER_CHUNK;
+	}
+
+	if (init || fini) {
+		link_offset = (obj_size + sizeof(void *) - 1) &
+			      ~(sizeof(void *) - 1);
+		slot_size = link_offset + sizeof(void *);
+	} else {
+		link_offset = 0;
+		slot_size = obj_size < sizeof(void *) ? sizeof(void *)
+						      : obj_size;
+	}
+	stride = (slot_size + align - 1) & ~(align - 1);
+	// A chunk must not wrap around the address space
+	if (objs_per_chunk >
+	    (~(size_t)0 - sizeof(YaPoolChunk) - align) / stride) {
+		return NULL;
+	}
+
+	pool = (YaPool *)yamalloc(sizeof(YaPool));
+	if (!pool) {
+		return NULL;
+	}
+
+	pool->link_offset = link_offset;
+	pool->align = align;
+	pool->stride = stride;
+	pool->objs_per_chunk = objs_per_chunk;
+	pool->chunks = NULL;
+	pool->bump = NULL;
+	pool->end = NULL;
+	pool->free = NULL;
+	pool->init = init;
+	pool->fini = fini;
+	pool->ctx = ctx;
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_lock(&yapool_registry_lock);
+	pool->id = yapool_next_id++;
+	pool->next = yapool_registry;
+	yapool_registry = pool;
+	pthread_mutex_unlock(&yapool_registry_lock);
+#endif
+
+	return pool;
+}
+
+/**
+ * @brief Allocates an object from the pool
+ *
+ * @param[in, out] pool Pool to allocate from
+ * @return void* Pointer to the object, NULL on failure
+ */
+void *yapool_alloc(YaPool *pool)
+{
+#ifdef YAMALLOC_THREAD_SAFE
+	YaPoolMagazine *mag = yapool_magazine(pool);
+
+	if (mag->count == 0) {
+		pthread_mutex_lock(&pool->lock);
+		while (mag->count < YAPOOL_MAGAZINE_SIZE / 2) {
+			void *obj = yapool_pop(pool);
+			if (!obj) {
+				break;
+			}
+			mag->objs[mag->count++] = obj;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (mag->count == 0) {
+			return NULL;
+		}
+	}
+	return mag->objs[--mag->count];
+#else
+	return yapool_pop(pool);
+#endif
+}
+
+/**
+ * @brief Returns an object to the pool
+ *
+ * @param[in, out] pool Pool the object was allocated from
+ * @param[in] obj Pointer returned by yapool_alloc()
+ * @return void
+ */
+void yapool_free(YaPool *pool, void *obj)
+{
+	if (!obj) {
+		return;
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	YaPoolMagazine *mag = yapool_magazine(pool);
+
+	if (mag->count == YAPOOL_MAGAZINE_SIZE) {
+		pthread_mutex_lock(&pool->lock);
+		while (mag->count > YAPOOL_MAGAZINE_SIZE / 2) {
+			yapool_push(pool, mag->objs[--mag->count]);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	mag->objs[mag->count++] = obj;
+#else
+	yapool_push(pool, obj);
+#endif
+}
+
+/**
+ * @brief Destroys a pool and releases all of its chunks
+ *
+ * Objects still allocated, or cached by other threads, become invalid.
+ *
+ * @param[in] pool Pool to destroy
+ * @return void
+ */
+void yapool_destroy(YaPool *pool)
+{
+	YaPoolChunk *chunk;
+	YaPoolChunk *next;
+	char *carved_end;
+	size_t objs_size;
+
+	if (!pool) {
+		return;
+	}
+
+#ifdef YAMALLOC_THREAD_SAFE
+	YaPool **link;
+
+	pthread_mutex_lock(&yapool_registry_lock);
+	for (link = &yapool_registry; *link; link = &(*link)->next) {
+		if (*link == pool) {
+			*link = pool->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&yapool_registry_lock);
+
+	YaPoolMagazine *mag = yapool_find_magazine(pool->id);
+	if (mag) {
+		mag->count = 0;
+		mag->pool_id = 0;
+	}
+	pthread_mutex_destroy(&pool->lock);
+#endif
+
+	// Only the first chunk may be partially carved
+	objs_size = pool->stride * pool->objs_per_chunk;
+	carved_end = pool->bump;
+	for (chunk = pool->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		if (pool->fini) {
+			for (char *obj = chunk->objs; obj < carved_end;
+			     obj += pool->stride) {
+				pool->fini(obj, pool->ctx);
+			}
+		}
+		yafree_sized(chunk,
+			     sizeof(YaPoolChunk) + pool->align - 1 + objs_size);
+		if (next) {
+			carved_end = next->objs + objs_size;
+		}
+	}
+	yafree_sized(pool, sizeof(YaPool));
+}
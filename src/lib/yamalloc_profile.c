@@ -0,0 +1,344 @@
+#include "yamalloc_profile.h"
+
+#ifdef YAMALLOC_PROFILE
+#include "yamalloc_os.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <execinfo.h>
+#endif
+
+static size_t profile_interval = YAMALLOC_PROFILE_DEFAULT_INTERVAL;
+uint8_t profile_filter[PROFILE_FILTER_SIZE];
+
+// Live samples, hashed by address, and the recycled sample records
+static ProfileSample *profile_table[PROFILE_BUCKETS];
+static ProfileSample *profile_spare = NULL;
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread int64_t profile_countdown = 0;
+static __thread uint64_t profile_random_state = 0;
+#else
+int64_t profile_countdown = 0;
+static uint64_t profile_random_state = 0;
+#endif
+
+static size_t profile_bucket(uintptr_t ptr)
+{
+	return (size_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 32) %
+	       PROFILE_BUCKETS;
+}
+
+/**
+ * @brief Draws the number of bytes before the next sample of the thread
+ *
+ * The gaps follow an exponential distribution of mean profile_interval, so
+ * that each allocated byte has the same chance of being sampled.
+ *
+ * @return int64_t Bytes before the next sample
+ */
+static int64_t profile_next_gap(void)
+{
+	size_t interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+	uint64_t x;
+	double u;
+
+	if (interval == 0) {
+		return PROFILE_DISABLED_RECHECK;
+	}
+	if (profile_random_state == 0) {
+		uint64_t seed = (uint64_t)(uintptr_t)&profile_countdown;
+		profile_random_state = (seed ^ (uint64_t)time(NULL)) | 1;
+	}
+	// xorshift64*
+	x = profile_random_state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	profile_random_state = x;
+	u = (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+	return (int64_t)(-log(1.0 - u) * (double)interval) + 1;
+}
+
+/**
+ * @brief Takes a sample, or schedules the first one of the thread
+ *
+ * Called once the countdown of the thread has run out.
+ *
+ * @param[in] ptr Allocated object
+ * @param[in] size Size (in bytes) requested
+ * @return void
+ */
+void profile_sample(void *ptr, size_t size)
+{
+	ProfileSample *sample;
+	int first = profile_random_state == 0;
+	size_t interval;
+
+	do {
+		profile_countdown += profile_next_gap();
+	} while (profile_countdown < 0);
+	// The countdown of a new thread starts at zero: its first allocation
+	// only draws the real gap.
+	interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+	if (first || interval == 0) {
+		return;
+	}
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&profile_lock);
+#endif
+	sample = profile_spare;
+	if (sample) {
+		profile_spare = sample->next;
+	} else {
+		// Records are carved from whole pages and never returned
+		size_t count = YAMALLOC_OS_PAGE_SIZE / sizeof(ProfileSample);
+
+		sample =
+		    (ProfileSample *)yamalloc_os_map(YAMALLOC_OS_PAGE_SIZE);
+		if (!sample) {
+#ifdef YAMALLOC_THREAD_SAFE
+			pthread_mutex_unlock(&profile_lock);
+#endif
+			return;
+		}
+		for (size_t i = 1; i < count; i++) {
+			sample[i].next = profile_spare;
+			profile_spare = &sample[i];
+		}
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&profile_lock);
+#endif
+
+	sample->ptr = (uintptr_t)ptr;
+	sample->size = size;
+#if defined(__linux__) || defined(__APPLE__)
+	{
+		// One more frame than kept: profile_sample() itself is dropped
+		void *stack[PROFILE_MAX_DEPTH + 1];
+		int depth = backtrace(stack, PROFILE_MAX_DEPTH + 1);
+
+		sample->depth = depth > 1 ? (size_t)depth - 1 : 0;
+		memcpy(sample->stack, stack + 1,
+		       sample->depth * sizeof(void *));
+	}
+#else
+	sample->depth = 0;
+#endif
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&profile_lock);
+#endif
+	size_t bucket = profile_bucket(sample->ptr);
+	size_t index = profile_filter_index(ptr);
+	sample->next = profile_table[bucket];
+	profile_table[bucket] = sample;
+	// A saturated counter stays set: frees of its addresses always look
+	// up the table
+	if (profile_filter[index] != UINT8_MAX) {
+		__atomic_store_n(&profile_filter[index],
+				 (uint8_t)(profile_filter[index] + 1),
+				 __ATOMIC_RELAXED);
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+/**
+ * @brief Takes the sample of an object out of the table of live samples
+ *
+ * The filter may report objects that were never sampled: the table is then
+ * left untouched.
+ *
+ * @param[in] ptr Sampled object
+ * @return ProfileSample* The sample, NULL if ptr was not sampled
+ */
+ProfileSample *profile_detach(void *ptr)
+{
+	ProfileSample **link;
+	ProfileSample *sample = NULL;
+	size_t index = profile_filter_index(ptr);
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&profile_lock);
+#endif
+	for (link = &profile_table[profile_bucket((uintptr_t)ptr)]; *link;
+	     link = &(*link)->next) {
+		if ((*link)->ptr == (uintptr_t)ptr) {
+			sample = *link;
+			*link = sample->next;
+			if (profile_filter[index] != UINT8_MAX) {
+				__atomic_store_n(
+				    &profile_filter[index],
+				    (uint8_t)(profile_filter[index] - 1),
+				    __ATOMIC_RELAXED);
+			}
+			break;
+		}
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&profile_lock);
+#endif
+	return sample;
+}
+
+/**
+ * @brief Puts a sample of profile_detach() back in the table
+ *
+ * Used when the object turned out to stay with its owner.
+ *
+ * @param[in] sample Detached sample
+ * @return void
+ */
+void profile_attach(ProfileSample *sample)
+{
+	size_t index = profile_filter_index((void *)sample->ptr);
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&profile_lock);
+#endif
+	size_t bucket = profile_bucket(sample->ptr);
+	sample->next = profile_table[bucket];
+	profile_table[bucket] = sample;
+	if (profile_filter[index] != UINT8_MAX) {
+		__atomic_store_n(&profile_filter[index],
+				 (uint8_t)(profile_filter[index] + 1),
+				 __ATOMIC_RELAXED);
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+/**
+ * @brief Recycles a sample of profile_detach() whose object is gone
+ *
+ * @param[in] sample Detached sample
+ * @return void
+ */
+void profile_drop(ProfileSample *sample)
+{
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&profile_lock);
+#endif
+	sample->next = profile_spare;
+	profile_spare = sample;
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+/**
+ * @brief Stops tracking a sampled object that is being freed
+ *
+ * @param[in] ptr Object being freed
+ * @return void
+ */
+void profile_forget(void *ptr)
+{
+	ProfileSample *sample = profile_detach(ptr);
+
+	if (sample) {
+		profile_drop(sample);
+	}
+}
+#endif // YAMALLOC_PROFILE
+
+/**
+ * @brief Sets the mean number of bytes allocated between two samples
+ *
+ * Threads pick up the new interval at their next sample, or within
+ * PROFILE_DISABLED_RECHECK bytes when sampling was off.
+ *
+ * @param[in] bytes Mean interval, 0 to stop sampling
+ * @return int 0 on success, -1 if yamalloc was built without
+ * YAMALLOC_PROFILE
+ */
+int yamalloc_profile_set_interval(size_t bytes)
+{
+#ifdef YAMALLOC_PROFILE
+	__atomic_store_n(&profile_interval, bytes, __ATOMIC_RELAXED);
+	return 0;
+#else
+	(void)bytes;
+	return -1;
+#endif
+}
+
+/**
+ * @brief Writes the live samples in the legacy pprof heap profile format
+ *
+ * Each sample is written with its requested size; the heap_v2 header gives
+ * the sampling interval, from which pprof estimates the unsampled totals.
+ * The memory mappings of the process follow, so that pprof can symbolize
+ * the addresses.
+ *
+ * @param[in] path File to write, truncated if it exists
+ * @return int 0 on success, -1 if the file cannot be written or yamalloc was
+ * built without YAMALLOC_PROFILE
+ */
+int yamalloc_profile_dump(const char *path)
+{
+#ifdef YAMALLOC_PROFILE
+	size_t objects = 0;
+	size_t bytes = 0;
+	FILE *out = fopen(path, "w");
+	FILE *maps;
+	int ret = 0;
+
+	if (!out) {
+		return -1;
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&profile_lock);
+#endif
+	for (size_t b = 0; b < PROFILE_BUCKETS; b++) {
+		for (ProfileSample *s = profile_table[b]; s; s = s->next) {
+			objects++;
+			bytes += s->size;
+		}
+	}
+	fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+		objects, bytes, objects, bytes,
+		__atomic_load_n(&profile_interval, __ATOMIC_RELAXED));
+	for (size_t b = 0; b < PROFILE_BUCKETS; b++) {
+		for (ProfileSample *s = profile_table[b]; s; s = s->next) {
+			fprintf(out, "1: %zu [1: %zu] @", s->size, s->size);
+			for (size_t i = 0; i < s->depth; i++) {
+				fprintf(out, " %p", s->stack[i]);
+			}
+			fputc('\n', out);
+		}
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&profile_lock);
+#endif
+
+	fprintf(out, "\nMAPPED_LIBRARIES:\n");
+	maps = fopen("/proc/self/maps", "r");
+	if (maps) {
+		char line[512];
+		while (fgets(line, sizeof(line), maps)) {
+			fputs(line, out);
+		}
+		fclose(maps);
+	}
+	if (ferror(out)) {
+		ret = -1;
+	}
+	if (fclose(out) != 0) {
+		ret = -1;
+	}
+	return ret;
+#else
+	(void)path;
+	return -1;
+#endif
+}
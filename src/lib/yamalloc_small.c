@@ -0,0 +1,283 @@
+#include "yamalloc_small.h"
+#include "yamalloc_instrument.h"
+#include "yamalloc_os.h"
+#include "yamalloc_page_map.h"
+#include <stdlib.h>
+#include <string.h>
+
+static SmallClass small_classes[SMALL_CLASS_COUNT];
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+static pthread_mutex_t small_locks[SMALL_CLASS_COUNT];
+static pthread_once_t small_locks_once = PTHREAD_ONCE_INIT;
+
+static void small_init_locks(void)
+{
+	for (size_t i = 0; i < SMALL_CLASS_COUNT; i++) {
+		pthread_mutex_init(&small_locks[i], NULL);
+	}
+}
+#endif
+
+/**
+ * @brief Makes room for one more span in the span table of a class
+ *
+ * @param[in, out] cls Class whose table has to grow
+ * @return int 0 on success, -1 if the kernel refused memory
+ */
+static int small_reserve_span(SmallClass *cls)
+{
+	size_t capacity;
+	char **spans;
+
+	if (cls->span_count < cls->span_capacity) {
+		return 0;
+	}
+	capacity = cls->span_capacity == 0
+		       ? YAMALLOC_OS_PAGE_SIZE / sizeof(char *)
+		       : cls->span_capacity * 2;
+	spans = (char **)yamalloc_os_map(capacity * sizeof(char *));
+	if (!spans) {
+		return -1;
+	}
+	if (cls->spans) {
+		memcpy(spans, cls->spans, cls->span_count * sizeof(char *));
+		yamalloc_os_unmap(cls->spans,
+				  cls->span_capacity * sizeof(char *));
+	}
+	cls->spans = spans;
+	cls->span_capacity = capacity;
+	return 0;
+}
+
+/**
+ * @brief Maps a new span for the given size class
+ *
+ * Spans are page aligned and registered in the page map, so that every
+ * object inside them can be traced back to its class without a header.
+ * Spans are kept for the lifetime of the process.
+ *
+ * @param[in, out] cls Class to refill
+ * @param[in] class_index Index of cls
+ * @return int 0 on success, -1 if the kernel refused memory
+ */
+static int small_refill(SmallClass *cls, size_t class_index)
+{
+	if (small_reserve_span(cls) != 0) {
+		return -1;
+	}
+	char *span = yamalloc_os_map(SMALL_SPAN_SIZE);
+	if (!span) {
+		return -1;
+	}
+	if (page_map_set(span, SMALL_SPAN_SIZE,
+			 PAGE_MAP_SMALL |
+			     (class_index << PAGE_MAP_CLASS_SHIFT)) != 0) {
+		yamalloc_os_unmap(span, SMALL_SPAN_SIZE);
+		return -1;
+	}
+	cls->spans[cls->span_count++] = span;
+	cls->bump = span;
+	cls->end = span + SMALL_SPAN_SIZE -
+		   SMALL_SPAN_SIZE % small_class_size(class_index);
+	return 0;
+}
+
+/**
+ * @brief Allocates a small object
+ *
+ * Objects are popped from the free stack of their class, or bumped out of
+ * the current span when the stack is empty.
+ *
+ * @param[in] size Size (in bytes), at most SMALL_MAX_SIZE
+ * @return void* Pointer to the object, NULL on failure
+ */
+void *small_yamalloc(size_t size)
+{
+	size_t class_index = small_class_of(size);
+	SmallClass *cls = &small_classes[class_index];
+	void *ptr = NULL;
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_once(&small_locks_once, small_init_locks);
+	INSTRUMENT_LOCK(&small_locks[class_index]);
+#endif
+	if (cls->free) {
+		INSTRUMENT_START(t);
+		ptr = cls->free;
+		cls->free = cls->free->next;
+		cls->free_count--;
+		INSTRUMENT_END(YAMALLOC_PATH_CACHE_HIT, t);
+	} else if (cls->bump != cls->end ||
+		   small_refill(cls, class_index) == 0) {
+		ptr = cls->bump;
+		cls->bump += small_class_size(class_index);
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&small_locks[class_index]);
+#endif
+
+	return ptr;
+}
+
+/**
+ * @brief Frees a small object
+ *
+ * @param[in] ptr Pointer returned by small_yamalloc()
+ * @param[in] class_index Size class of ptr
+ * @return void
+ */
+void small_yafree(void *ptr, size_t class_index)
+{
+	SmallClass *cls = &small_classes[class_index];
+	SmallFreeObject *object = (SmallFreeObject *)ptr;
+
+#ifdef YAMALLOC_THREAD_SAFE
+	INSTRUMENT_LOCK(&small_locks[class_index]);
+#endif
+	object->next = cls->free;
+	cls->free = object;
+	cls->free_count++;
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&small_locks[class_index]);
+#endif
+}
+
+/**
+ * @brief Sums up the free small objects
+ *
+ * The part of each span that has not been carved yet counts as one free
+ * block.
+ *
+ * @param[out] bytes Bytes of the free objects
+ * @param[out] blocks Number of free objects
+ * @param[out] largest Size (in bytes) of the largest free block
+ * @return void
+ */
+void small_free_stats(size_t *bytes, size_t *blocks, size_t *largest)
+{
+	*bytes = 0;
+	*blocks = 0;
+	*largest = 0;
+
+	for (size_t i = 0; i < SMALL_CLASS_COUNT; i++) {
+		SmallClass *cls = &small_classes[i];
+		size_t rest;
+
+#ifdef YAMALLOC_THREAD_SAFE
+		pthread_once(&small_locks_once, small_init_locks);
+		pthread_mutex_lock(&small_locks[i]);
+#endif
+		rest = (size_t)(cls->end - cls->bump);
+		*bytes += cls->free_count * small_class_size(i) + rest;
+		*blocks += cls->free_count + (rest != 0);
+		if (cls->free_count != 0 && small_class_size(i) > *largest) {
+			*largest = small_class_size(i);
+		}
+		if (rest > *largest) {
+			*largest = rest;
+		}
+#ifdef YAMALLOC_THREAD_SAFE
+		pthread_mutex_unlock(&small_locks[i]);
+#endif
+	}
+}
+
+static int small_compare_objects(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)*(void *const *)a;
+	uintptr_t y = (uintptr_t)*(void *const *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Visits the objects of a size class
+ *
+ * The free stack is copied and sorted first, so that each object is looked
+ * up in logarithmic time. The part of the last span that has not been
+ * carved yet is reported as a single free block.
+ *
+ * @param[in] cls Class to walk, locked by the caller
+ * @param[in] class_index Index of cls
+ * @param[in] callback Function called on each block
+ * @param[in] ctx Argument passed to callback
+ * @return int 0, the non-zero value that stopped the walk, or -1 if the
+ * kernel refused memory for the sorted copy
+ */
+static int small_walk_class(SmallClass *cls, size_t class_index,
+			    YamallocWalkCallback callback, void *ctx)
+{
+	size_t object_size = small_class_size(class_index);
+	size_t carved_size = SMALL_SPAN_SIZE - SMALL_SPAN_SIZE % object_size;
+	size_t map_size = cls->free_count * sizeof(void *);
+	void **free_objects = NULL;
+	struct yamalloc_block block;
+	int ret = 0;
+
+	if (map_size != 0) {
+		free_objects = (void **)yamalloc_os_map(map_size);
+		if (!free_objects) {
+			return -1;
+		}
+		size_t i = 0;
+		for (SmallFreeObject *obj = cls->free; obj; obj = obj->next) {
+			free_objects[i++] = obj;
+		}
+		qsort(free_objects, cls->free_count, sizeof(void *),
+		      small_compare_objects);
+	}
+
+	block.size = object_size;
+	block.padding = 0;
+	for (size_t s = 0; s < cls->span_count && !ret; s++) {
+		char *span = cls->spans[s];
+		int last = s == cls->span_count - 1;
+		char *end = last ? cls->bump : span + carved_size;
+
+		for (char *obj = span; obj < end && !ret; obj += object_size) {
+			block.address = obj;
+			block.free = map_size != 0 &&
+				     bsearch(&obj, free_objects,
+					     cls->free_count, sizeof(void *),
+					     small_compare_objects) != NULL;
+			ret = callback(&block, ctx);
+		}
+		if (last && !ret && cls->bump != cls->end) {
+			struct yamalloc_block rest = {
+			    cls->bump, (size_t)(cls->end - cls->bump), 0, 1};
+			ret = callback(&rest, ctx);
+		}
+	}
+
+	if (map_size != 0) {
+		yamalloc_os_unmap(free_objects, map_size);
+	}
+	return ret;
+}
+
+/**
+ * @brief Visits every small object, class by class
+ *
+ * @param[in] callback Function called on each block
+ * @param[in] ctx Argument passed to callback
+ * @return int 0, the non-zero value that stopped the walk, or -1 if the
+ * kernel refused memory for the walk
+ */
+int small_heap_walk(YamallocWalkCallback callback, void *ctx)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < SMALL_CLASS_COUNT && !ret; i++) {
+#ifdef YAMALLOC_THREAD_SAFE
+		pthread_once(&small_locks_once, small_init_locks);
+		pthread_mutex_lock(&small_locks[i]);
+#endif
+		ret = small_walk_class(&small_classes[i], i, callback, ctx);
+#ifdef YAMALLOC_THREAD_SAFE
+		pthread_mutex_unlock(&small_locks[i]);
+#endif
+	}
+	return ret;
+}
@@ -0,0 +1,489 @@
+#include "yamalloc_stats.h"
+#include "yamalloc_instrument.h"
+#include <string.h>
+
+#ifdef YAMALLOC_LINKED_LIST
+#include "yamalloc_linked_list.h"
+#endif // YAMALLOC_LINKED_LIST
+
+#ifdef YAMALLOC_FREE_LIST_LL
+#include "yamalloc_free_list_ll.h"
+#endif // YAMALLOC_FREE_LIST_LL
+
+#ifdef YAMALLOC_PAGE_MAP
+#include "yamalloc_small.h"
+#endif // YAMALLOC_PAGE_MAP
+
+// Counters of the rare kernel requests, shared by all threads
+static size_t stats_heap_size = 0;
+static uint64_t stats_sbrk_calls = 0;
+static uint64_t stats_mmap_calls = 0;
+static uint64_t stats_munmap_calls = 0;
+
+#ifdef YAMALLOC_THREAD_SAFE
+#include <pthread.h>
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+// Counters of the live threads, and the sum of the exited ones
+static YamallocThreadStats *stats_threads = NULL;
+static YamallocThreadStats stats_retired;
+static __thread YamallocThreadStats stats_local;
+static __thread int stats_registered = 0;
+#else
+static YamallocThreadStats stats_local;
+#endif
+
+// Only the owning thread writes its counters: a relaxed load and store is
+// enough and, unlike an atomic add, it needs no locked instruction.
+#define STATS_ADD(counter, n)                                                  \
+	__atomic_store_n(&(counter),                                           \
+			 __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n),  \
+			 __ATOMIC_RELAXED)
+#define STATS_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+#ifdef YAMALLOC_THREAD_SAFE
+static void stats_merge(YamallocThreadStats *into,
+			const YamallocThreadStats *from)
+{
+	into->bytes_in_use += STATS_LOAD(from->bytes_in_use);
+	into->blocks_in_use += STATS_LOAD(from->blocks_in_use);
+	into->alloc_count += STATS_LOAD(from->alloc_count);
+	into->free_count += STATS_LOAD(from->free_count);
+	for (size_t i = 0; i < YAMALLOC_STATS_HISTOGRAM_SIZE; i++) {
+		into->size_histogram[i] += STATS_LOAD(from->size_histogram[i]);
+	}
+#ifdef YAMALLOC_INSTRUMENT
+	for (size_t p = 0; p < YAMALLOC_PATH_COUNT; p++) {
+		into->latency.count[p] += STATS_LOAD(from->latency.count[p]);
+		into->latency.total_ticks[p] +=
+		    STATS_LOAD(from->latency.total_ticks[p]);
+		for (size_t i = 0; i < YAMALLOC_LATENCY_BUCKETS; i++) {
+			into->latency.histogram[p][i] +=
+			    STATS_LOAD(from->latency.histogram[p][i]);
+		}
+	}
+	for (size_t i = 0; i < YAMALLOC_LATENCY_BUCKETS; i++) {
+		into->latency.probe_histogram[i] +=
+		    STATS_LOAD(from->latency.probe_histogram[i]);
+	}
+#endif
+}
+
+static void stats_thread_exit(void *local)
+{
+	YamallocThreadStats **link;
+
+	pthread_mutex_lock(&stats_lock);
+	for (link = &stats_threads; *link; link = &(*link)->next) {
+		if (*link == local) {
+			*link = (*link)->next;
+			break;
+		}
+	}
+	stats_merge(&stats_retired, (YamallocThreadStats *)local);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_key_init(void)
+{
+	pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static YamallocThreadStats *stats_thread(void)
+{
+	if (!stats_registered) {
+		stats_registered = 1;
+		pthread_once(&stats_key_once, stats_key_init);
+		pthread_setspecific(stats_key, &stats_local);
+		pthread_mutex_lock(&stats_lock);
+		stats_local.next = stats_threads;
+		stats_threads = &stats_local;
+		pthread_mutex_unlock(&stats_lock);
+	}
+	return &stats_local;
+}
+#else
+static YamallocThreadStats *stats_thread(void) { return &stats_local; }
+#endif
+
+static size_t stats_bucket(size_t size)
+{
+	size_t bucket = 0;
+
+	while (bucket < YAMALLOC_STATS_HISTOGRAM_SIZE - 1 &&
+	       ((size_t)1 << bucket) < size) {
+		bucket++;
+	}
+	return bucket;
+}
+
+/**
+ * @brief Records a successful allocation
+ *
+ * @param[in] size Size (in bytes) requested by the caller
+ * @param[in] usable_size Size (in bytes) actually reserved for the payload
+ * @return void
+ */
+void stats_record_alloc(size_t size, size_t usable_size)
+{
+	YamallocThreadStats *local = stats_thread();
+
+	STATS_ADD(local->bytes_in_use, (int64_t)usable_size);
+	STATS_ADD(local->blocks_in_use, 1);
+	STATS_ADD(local->alloc_count, 1);
+	STATS_ADD(local->size_histogram[stats_bucket(size)], 1);
+}
+
+/**
+ * @brief Records a free
+ *
+ * @param[in] usable_size Size (in bytes) reserved for the freed payload
+ * @return void
+ */
+void stats_record_free(size_t usable_size)
+{
+	YamallocThreadStats *local = stats_thread();
+
+	STATS_ADD(local->bytes_in_use, -(int64_t)usable_size);
+	STATS_ADD(local->blocks_in_use, -1);
+	STATS_ADD(local->free_count, 1);
+}
+
+/**
+ * @brief Records a successful reallocation
+ *
+ * A reallocation is not counted as an allocation plus a free: only the bytes
+ * in use and the histogram change.
+ *
+ * @param[in] size Size (in bytes) requested by the caller
+ * @param[in] old_usable_size Size (in bytes) reserved before
+ * @param[in] new_usable_size Size (in bytes) reserved after
+ * @return void
+ */
+void stats_record_realloc(size_t size, size_t old_usable_size,
+			  size_t new_usable_size)
+{
+	YamallocThreadStats *local = stats_thread();
+
+	STATS_ADD(local->bytes_in_use,
+		  (int64_t)new_usable_size - (int64_t)old_usable_size);
+	STATS_ADD(local->size_histogram[stats_bucket(size)], 1);
+}
+
+#ifdef YAMALLOC_INSTRUMENT
+static size_t stats_latency_bucket(uint64_t value)
+{
+	size_t bucket = 0;
+
+	while (bucket < YAMALLOC_LATENCY_BUCKETS - 1 && value != 0) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/**
+ * @brief Records the time spent on an internal path
+ *
+ * @param[in] path One of the YAMALLOC_PATH_* values
+ * @param[in] ticks Elapsed time, in instrument_now() ticks
+ * @return void
+ */
+void instrument_record(int path, uint64_t ticks)
+{
+	struct yamalloc_latency *latency = &stats_thread()->latency;
+
+	STATS_ADD(latency->count[path], 1);
+	STATS_ADD(latency->total_ticks[path], ticks);
+	STATS_ADD(latency->histogram[path][stats_latency_bucket(ticks)], 1);
+}
+
+/**
+ * @brief Records a free list search
+ *
+ * A search that stops at the first node it visits is a cache hit.
+ *
+ * @param[in] ticks Elapsed time, in instrument_now() ticks
+ * @param[in] probes Number of nodes visited
+ * @return void
+ */
+void instrument_record_search(uint64_t ticks, size_t probes)
+{
+	struct yamalloc_latency *latency = &stats_thread()->latency;
+
+	instrument_record(probes <= 1 ? YAMALLOC_PATH_CACHE_HIT
+				      : YAMALLOC_PATH_LIST_SEARCH,
+			  ticks);
+	STATS_ADD(latency->probe_histogram[stats_latency_bucket(probes)], 1);
+}
+#endif // YAMALLOC_INSTRUMENT
+
+void stats_record_sbrk(intptr_t increment)
+{
+	__atomic_fetch_add(&stats_sbrk_calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats_heap_size, (size_t)increment,
+			   __ATOMIC_RELAXED);
+}
+
+void stats_record_mmap(size_t size)
+{
+	__atomic_fetch_add(&stats_mmap_calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats_heap_size, size, __ATOMIC_RELAXED);
+}
+
+void stats_record_munmap(size_t size)
+{
+	__atomic_fetch_add(&stats_munmap_calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&stats_heap_size, size, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Takes a snapshot of the allocator statistics
+ *
+ * The per-thread counters are summed up without stopping the other threads,
+ * so the snapshot is only approximately consistent. The free blocks are
+ * counted by walking the free structures of the backend under its locks.
+ *
+ * @param[out] stats Snapshot
+ * @return void
+ */
+void yamalloc_stats(struct yamalloc_stats *stats)
+{
+	YamallocThreadStats total;
+	size_t bytes = 0;
+	size_t blocks = 0;
+	size_t largest = 0;
+
+	memset(&total, 0, sizeof(total));
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(&total, &stats_retired);
+	for (YamallocThreadStats *t = stats_threads; t; t = t->next) {
+		stats_merge(&total, t);
+	}
+	pthread_mutex_unlock(&stats_lock);
+#else
+	total = stats_local;
+#endif
+
+	memset(stats, 0, sizeof(*stats));
+	stats->bytes_in_use =
+	    total.bytes_in_use > 0 ? (size_t)total.bytes_in_use : 0;
+	stats->blocks_in_use =
+	    total.blocks_in_use > 0 ? (size_t)total.blocks_in_use : 0;
+	stats->alloc_count = total.alloc_count;
+	stats->free_count = total.free_count;
+	memcpy(stats->size_histogram, total.size_histogram,
+	       sizeof(stats->size_histogram));
+
+#ifdef YAMALLOC_LINKED_LIST
+	linked_list_free_stats(&bytes, &blocks, &largest);
+#elif YAMALLOC_FREE_LIST_LL
+	free_list_ll_free_stats(&bytes, &blocks, &largest);
+#endif
+	stats->bytes_free = bytes;
+	stats->blocks_free = blocks;
+	stats->largest_free_block = largest;
+#ifdef YAMALLOC_PAGE_MAP
+	small_free_stats(&bytes, &blocks, &largest);
+	stats->bytes_free += bytes;
+	stats->blocks_free += blocks;
+	if (largest > stats->largest_free_block) {
+		stats->largest_free_block = largest;
+	}
+#endif
+	stats->fragmentation =
+	    stats->bytes_free == 0
+		? 0.0
+		: 1.0 - (double)stats->largest_free_block /
+			    (double)stats->bytes_free;
+
+	stats->heap_size = STATS_LOAD(stats_heap_size);
+	stats->sbrk_calls = STATS_LOAD(stats_sbrk_calls);
+	stats->mmap_calls = STATS_LOAD(stats_mmap_calls);
+	stats->munmap_calls = STATS_LOAD(stats_munmap_calls);
+}
+
+/**
+ * @brief Prints a snapshot of the allocator statistics
+ *
+ * @param[in] out Stream to print to
+ * @param[in] format YAMALLOC_STATS_TEXT or YAMALLOC_STATS_JSON (one line)
+ * @return void
+ */
+void yamalloc_stats_print(FILE *out, int format)
+{
+	struct yamalloc_stats stats;
+	const char *sep = "";
+
+	yamalloc_stats(&stats);
+
+	if (format == YAMALLOC_STATS_JSON) {
+		fprintf(out,
+			"{\"heap_size\":%zu,\"bytes_in_use\":%zu,"
+			"\"blocks_in_use\":%zu,\"bytes_free\":%zu,"
+			"\"blocks_free\":%zu,\"largest_free_block\":%zu,"
+			"\"fragmentation\":%.4f,\"alloc_count\":%llu,"
+			"\"free_count\":%llu,\"sbrk_calls\":%llu,"
+			"\"mmap_calls\":%llu,\"munmap_calls\":%llu,"
+			"\"size_histogram\":{",
+			stats.heap_size, stats.bytes_in_use,
+			stats.blocks_in_use, stats.bytes_free,
+			stats.blocks_free, stats.largest_free_block,
+			stats.fragmentation,
+			(unsigned long long)stats.alloc_count,
+			(unsigned long long)stats.free_count,
+			(unsigned long long)stats.sbrk_calls,
+			(unsigned long long)stats.mmap_calls,
+			(unsigned long long)stats.munmap_calls);
+		for (size_t i = 0; i < YAMALLOC_STATS_HISTOGRAM_SIZE; i++) {
+			if (stats.size_histogram[i] == 0) {
+				continue;
+			}
+			fprintf(out, "%s\"%zu\":%llu", sep, (size_t)1 << i,
+				(unsigned long long)stats.size_histogram[i]);
+			sep = ",";
+		}
+		fprintf(out, "}}\n");
+		return;
+	}
+
+	fprintf(out, "heap size:          %zu bytes\n", stats.heap_size);
+	fprintf(out, "in use:             %zu bytes in %zu blocks\n",
+		stats.bytes_in_use, stats.blocks_in_use);
+	fprintf(out, "free:               %zu bytes in %zu blocks\n",
+		stats.bytes_free, stats.blocks_free);
+	fprintf(out, "largest free block: %zu bytes\n",
+		stats.largest_free_block);
+	fprintf(out, "fragmentation:      %.2f%%\n",
+		stats.fragmentation * 100.0);
+	fprintf(out, "allocs / frees:     %llu / %llu\n",
+		(unsigned long long)stats.alloc_count,
+		(unsigned long long)stats.free_count);
+	fprintf(out, "sbrk / mmap / munmap calls: %llu / %llu / %llu\n",
+		(unsigned long long)stats.sbrk_calls,
+		(unsigned long long)stats.mmap_calls,
+		(unsigned long long)stats.munmap_calls);
+	fprintf(out, "request sizes:\n");
+	for (size_t i = 0; i < YAMALLOC_STATS_HISTOGRAM_SIZE; i++) {
+		if (stats.size_histogram[i] != 0) {
+			fprintf(out, "  <= %-12zu %llu\n", (size_t)1 << i,
+				(unsigned long long)stats.size_histogram[i]);
+		}
+	}
+}
+
+/**
+ * @brief Takes a snapshot of the latency histograms
+ *
+ * @param[out] latency Snapshot
+ * @return int 0 on success, -1 if yamalloc was built without
+ * YAMALLOC_INSTRUMENT
+ */
+int yamalloc_latency(struct yamalloc_latency *latency)
+{
+#ifdef YAMALLOC_INSTRUMENT
+	YamallocThreadStats total;
+
+	memset(&total, 0, sizeof(total));
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(&total, &stats_retired);
+	for (YamallocThreadStats *t = stats_threads; t; t = t->next) {
+		stats_merge(&total, t);
+	}
+	pthread_mutex_unlock(&stats_lock);
+#else
+	total = stats_local;
+#endif
+	*latency = total.latency;
+	return 0;
+#else
+	(void)latency;
+	return -1;
+#endif
+}
+
+#ifdef YAMALLOC_INSTRUMENT
+static const char *const stats_path_names[YAMALLOC_PATH_COUNT] = {
+    "cache_hit", "list_search", "coalesce", "os_growth", "lock_wait"};
+
+static void stats_print_buckets(FILE *out, int format, const uint64_t *buckets)
+{
+	const char *sep = "";
+
+	for (size_t i = 0; i < YAMALLOC_LATENCY_BUCKETS; i++) {
+		if (buckets[i] == 0) {
+			continue;
+		}
+		if (format == YAMALLOC_STATS_JSON) {
+			fprintf(out, "%s\"%llu\":%llu", sep,
+				i == 0 ? 0ULL : 1ULL << (i - 1),
+				(unsigned long long)buckets[i]);
+			sep = ",";
+		} else {
+			fprintf(out, "    >= %-12llu %llu\n",
+				i == 0 ? 0ULL : 1ULL << (i - 1),
+				(unsigned long long)buckets[i]);
+		}
+	}
+}
+#endif
+
+/**
+ * @brief Prints the latency histograms
+ *
+ * Each histogram line gives the lower bound of a power-of-two bucket, in
+ * ticks (or nodes, for the search lengths), and its number of samples.
+ *
+ * @param[in] out Stream to print to
+ * @param[in] format YAMALLOC_STATS_TEXT or YAMALLOC_STATS_JSON (one line)
+ * @return int 0 on success, -1 if yamalloc was built without
+ * YAMALLOC_INSTRUMENT
+ */
+int yamalloc_latency_print(FILE *out, int format)
+{
+#ifdef YAMALLOC_INSTRUMENT
+	struct yamalloc_latency latency;
+
+	yamalloc_latency(&latency);
+	if (format == YAMALLOC_STATS_JSON) {
+		fprintf(out, "{");
+	}
+	for (size_t p = 0; p < YAMALLOC_PATH_COUNT; p++) {
+		if (format == YAMALLOC_STATS_JSON) {
+			fprintf(out,
+				"\"%s\":{\"count\":%llu,\"total_ticks\":%llu,"
+				"\"histogram\":{",
+				stats_path_names[p],
+				(unsigned long long)latency.count[p],
+				(unsigned long long)latency.total_ticks[p]);
+			stats_print_buckets(out, format, latency.histogram[p]);
+			fprintf(out, "}},");
+			continue;
+		}
+		fprintf(out, "%s: %llu samples, %.1f ticks on average\n",
+			stats_path_names[p],
+			(unsigned long long)latency.count[p],
+			latency.count[p] == 0
+			    ? 0.0
+			    : (double)latency.total_ticks[p] /
+				  (double)latency.count[p]);
+		stats_print_buckets(out, format, latency.histogram[p]);
+	}
+	if (format == YAMALLOC_STATS_JSON) {
+		fprintf(out, "\"search_probes\":{");
+		stats_print_buckets(out, format, latency.probe_histogram);
+		fprintf(out, "}}\n");
+	} else {
+		fprintf(out, "search probes:\n");
+		stats_print_buckets(out, format, latency.probe_histogram);
+	}
+	return 0;
+#else
+	(void)out;
+	(void)format;
+	return -1;
+#endif
+}
@@ -0,0 +1,257 @@
+#include "yamalloc_trace.h"
+
+#ifdef YAMALLOC_TRACE
+#include "yamalloc_os.h"
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int trace_enabled = 0;
+static int trace_fd = -1;
+static uint64_t trace_epoch = 0;
+static uint32_t trace_next_thread = 0;
+static uint32_t trace_generation = 0;
+
+#ifdef YAMALLOC_THREAD_SAFE
+// Lock order: registry, then a buffer, then the file
+static pthread_mutex_t trace_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t trace_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static TraceBuffer *trace_buffers = NULL;
+static __thread TraceBuffer *trace_local = NULL;
+#else
+static TraceBuffer *trace_local = NULL;
+#endif
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Writes the records of a buffer to the trace file and empties it
+ *
+ * The records are dropped when the trace has been stopped.
+ *
+ * @param[in, out] buffer Buffer to flush, locked by the caller
+ * @return void
+ */
+static void trace_flush(TraceBuffer *buffer)
+{
+	const char *data = (const char *)buffer->records;
+	size_t left = buffer->count * sizeof(struct yamalloc_trace_record);
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&trace_file_lock);
+#endif
+	while (trace_fd >= 0 && left > 0) {
+		ssize_t written = write(trace_fd, data, left);
+		if (written <= 0) {
+			break;
+		}
+		data += written;
+		left -= (size_t)written;
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&trace_file_lock);
+#endif
+	buffer->count = 0;
+}
+
+#ifdef YAMALLOC_THREAD_SAFE
+static void trace_thread_exit(void *local)
+{
+	TraceBuffer *buffer = (TraceBuffer *)local;
+	TraceBuffer **link;
+
+	pthread_mutex_lock(&trace_registry_lock);
+	for (link = &trace_buffers; *link; link = &(*link)->next) {
+		if (*link == buffer) {
+			*link = buffer->next;
+			break;
+		}
+	}
+	pthread_mutex_lock(&buffer->lock);
+	trace_flush(buffer);
+	pthread_mutex_unlock(&buffer->lock);
+	pthread_mutex_unlock(&trace_registry_lock);
+	pthread_mutex_destroy(&buffer->lock);
+	yamalloc_os_unmap(buffer, sizeof(TraceBuffer));
+}
+
+static void trace_key_init(void)
+{
+	pthread_key_create(&trace_key, trace_thread_exit);
+}
+#endif
+
+/**
+ * @brief Returns the trace buffer of the calling thread
+ *
+ * The buffer is mapped directly from the kernel on the first traced call of
+ * the thread, so that tracing never calls back into yamalloc.
+ *
+ * @return TraceBuffer* The buffer, NULL if the kernel refused memory
+ */
+static TraceBuffer *trace_buffer(void)
+{
+	TraceBuffer *buffer = trace_local;
+
+	if (buffer) {
+		return buffer;
+	}
+	buffer = (TraceBuffer *)yamalloc_os_map(sizeof(TraceBuffer));
+	if (!buffer) {
+		return NULL;
+	}
+	buffer->count = 0;
+	buffer->generation = 0;
+	buffer->thread =
+	    __atomic_fetch_add(&trace_next_thread, 1, __ATOMIC_RELAXED);
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_init(&buffer->lock, NULL);
+	pthread_once(&trace_key_once, trace_key_init);
+	pthread_setspecific(trace_key, buffer);
+	pthread_mutex_lock(&trace_registry_lock);
+	buffer->next = trace_buffers;
+	trace_buffers = buffer;
+	pthread_mutex_unlock(&trace_registry_lock);
+#endif
+	trace_local = buffer;
+	return buffer;
+}
+
+/**
+ * @brief Appends a record to the buffer of the calling thread
+ *
+ * @param[in] op YAMALLOC_TRACE_* operation
+ * @param[in] size Size (in bytes) requested
+ * @param[in] id Object allocated, freed or reallocated
+ * @param[in] new_id Object returned by a reallocation, or NULL
+ * @return void
+ */
+void trace_record(uint32_t op, size_t size, const void *id, const void *new_id)
+{
+	TraceBuffer *buffer = trace_buffer();
+	struct yamalloc_trace_record *record;
+
+	if (!buffer) {
+		return;
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&buffer->lock);
+#endif
+	if (buffer->generation !=
+	    __atomic_load_n(&trace_generation, __ATOMIC_RELAXED)) {
+		buffer->generation =
+		    __atomic_load_n(&trace_generation, __ATOMIC_RELAXED);
+		buffer->count = 0;
+	}
+	if (buffer->count == TRACE_BUFFER_RECORDS) {
+		trace_flush(buffer);
+	}
+	record = &buffer->records[buffer->count++];
+	record->timestamp =
+	    trace_now() - __atomic_load_n(&trace_epoch, __ATOMIC_RELAXED);
+	record->size = size;
+	record->id = (uint64_t)(uintptr_t)id;
+	record->new_id = (uint64_t)(uintptr_t)new_id;
+	record->thread = buffer->thread;
+	record->op = op;
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&buffer->lock);
+#endif
+}
+#endif // YAMALLOC_TRACE
+
+/**
+ * @brief Starts recording the allocation calls to a file
+ *
+ * @param[in] path File to write, truncated if it exists
+ * @return int 0 on success, -1 if the file cannot be written, a trace is
+ * already running or yamalloc was built without YAMALLOC_TRACE
+ */
+int yamalloc_trace_start(const char *path)
+{
+#ifdef YAMALLOC_TRACE
+	struct yamalloc_trace_header header;
+	int fd;
+
+	if (__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, YAMALLOC_TRACE_MAGIC,
+	       sizeof(YAMALLOC_TRACE_MAGIC));
+	header.version = YAMALLOC_TRACE_VERSION;
+	header.record_size = sizeof(struct yamalloc_trace_record);
+	if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+		close(fd);
+		return -1;
+	}
+
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&trace_file_lock);
+#endif
+	__atomic_store_n(&trace_epoch, trace_now(), __ATOMIC_RELAXED);
+	trace_fd = fd;
+	__atomic_fetch_add(&trace_generation, 1, __ATOMIC_RELAXED);
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&trace_file_lock);
+#endif
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+	return 0;
+#else
+	(void)path;
+	return -1;
+#endif
+}
+
+/**
+ * @brief Stops the trace, flushing the buffers of every thread
+ *
+ * @return int 0 on success, -1 if no trace is running or yamalloc was built
+ * without YAMALLOC_TRACE
+ */
+int yamalloc_trace_stop(void)
+{
+#ifdef YAMALLOC_TRACE
+	int fd;
+
+	if (!__atomic_exchange_n(&trace_enabled, 0, __ATOMIC_ACQ_REL)) {
+		return -1;
+	}
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_lock(&trace_registry_lock);
+	for (TraceBuffer *buffer = trace_buffers; buffer;
+	     buffer = buffer->next) {
+		pthread_mutex_lock(&buffer->lock);
+		trace_flush(buffer);
+		pthread_mutex_unlock(&buffer->lock);
+	}
+	pthread_mutex_unlock(&trace_registry_lock);
+	pthread_mutex_lock(&trace_file_lock);
+#else
+	if (trace_local) {
+		trace_flush(trace_local);
+	}
+#endif
+	fd = trace_fd;
+	trace_fd = -1;
+#ifdef YAMALLOC_THREAD_SAFE
+	pthread_mutex_unlock(&trace_file_lock);
+#endif
+	return close(fd) == 0 ? 0 : -1;
+#else
+	return -1;
+#endif
+}
@@ -1,7 +1,9 @@
 #include "yamalloc.h"
+#include "yamalloc_heap.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #define RESET "\033[0m"
@@ -230,6 +232,703 @@ void test_yafree_3()
 	TestEnd();
 }
 
+void test_yamalloc_4()
+{
+	TestStart("test_yamalloc_4");
+	char *ptrs[64];
+	for (int i = 0; i < 64; ++i) {
+		ptrs[i] = (char *)yamalloc(24);
+		assert(ptrs[i] != NULL);
+		assert(((uintptr_t)ptrs[i] & 7) == 0);
+		memset(ptrs[i], i, 24);
+	}
+	for (int i = 0; i < 64; i += 2) {
+		yafree(ptrs[i]);
+	}
+	for (int i = 1; i < 64; i += 2) {
+		for (int j = 0; j < 24; ++j) {
+			assert(ptrs[i][j] == i);
+		}
+		yafree(ptrs[i]);
+	}
+	TestEnd();
+}
+
+void test_yafree_sized_1()
+{
+	TestStart("test_yafree_sized_1");
+	char *ptr = (char *)yamalloc(24);
+	assert(ptr != NULL);
+	char *old_ptr = ptr;
+	yafree_sized(ptr, 24);
+	ptr = (char *)yamalloc(24);
+	assert(ptr == old_ptr);
+	ptr = (char *)yarealloc(ptr, 4096);
+	assert(ptr != NULL);
+	yafree_sized(ptr, 4096);
+	TestEnd();
+}
+
+#ifdef YAMALLOC_FREE_LIST_LL
+static int test_padded_visit(const struct yamalloc_block *block, void *ctx)
+{
+	if (!block->free && block->padding > 8) {
+		(*(int *)ctx)++;
+	}
+	return 0;
+}
+#endif
+
+void test_yaaligned_alloc_1()
+{
+	TestStart("test_yaaligned_alloc_1");
+	void *ptrs[40];
+	size_t sizes[40];
+	assert(yaaligned_alloc(24, 100) == NULL);
+	for (size_t i = 0; i < 40; i++) {
+		size_t alignment = (size_t)1 << (i % 13);
+		// Interleaved blocks leave the break misaligned
+		void *filler = yamalloc(8 * (i + 1));
+		ptrs[i] = yaaligned_alloc(alignment, 10 + 37 * i);
+		assert(ptrs[i] != NULL);
+		assert(((uintptr_t)ptrs[i] & (alignment - 1)) == 0);
+		sizes[i] = (10 + 37 * i + alignment - 1) & ~(alignment - 1);
+		assert(yamalloc_usable_size(ptrs[i]) >= sizes[i]);
+		memset(ptrs[i], (int)i, sizes[i]);
+		yafree(filler);
+	}
+#ifdef YAMALLOC_FREE_LIST_LL
+	// Gaps too small to be freed are kept as padding
+	int padded = 0;
+	assert(yamalloc_heap_walk(test_padded_visit, &padded) == 0);
+	assert(padded > 0);
+#endif
+	for (size_t i = 0; i < 40; i++) {
+		for (size_t j = 0; j < sizes[i]; j++) {
+			assert(((unsigned char *)ptrs[i])[j] == i);
+		}
+		yafree_sized(ptrs[i], sizes[i]);
+	}
+	TestEnd();
+}
+
+void test_yamallocx_1()
+{
+	TestStart("test_yamallocx_1");
+	unsigned char *ptr = (unsigned char *)yamallocx(
+	    1000, YAMALLOCX_ZERO | YAMALLOCX_ALIGN(64));
+	assert(ptr != NULL && ((uintptr_t)ptr & 63) == 0);
+	for (size_t i = 0; i < 1000; i++) {
+		assert(ptr[i] == 0);
+	}
+	assert(yasallocx(ptr, 0) >= 1000);
+	memset(ptr, 0xAB, 1000);
+	// Shrinking never moves a block
+	assert(yareallocx(ptr, 600, YAMALLOCX_NO_MOVE) == ptr);
+	assert(yareallocx(ptr, (size_t)1 << 40, YAMALLOCX_NO_MOVE) == NULL);
+#ifdef YAMALLOC_FREE_LIST_LL
+	// ...and the tail it gave back lets it grow again in place
+	assert(yareallocx(ptr, 1000, YAMALLOCX_NO_MOVE) == ptr);
+#endif
+	ptr = (unsigned char *)yareallocx(ptr, 8000, YAMALLOCX_ZERO);
+	assert(ptr != NULL);
+	assert(ptr[599] == 0xAB && ptr[7999] == 0);
+	yafree(ptr);
+
+	char *long_lived = (char *)yamallocx(512, YAMALLOCX_LONG_LIVED);
+	char *short_lived = (char *)yamallocx(512, YAMALLOCX_SHORT_LIVED);
+	assert(long_lived != NULL && short_lived != NULL);
+#ifdef YAMALLOC_FREE_LIST_LL
+	assert(short_lived > long_lived);
+#endif
+	yafree(short_lived);
+	yafree(long_lived);
+
+	YaArena *arena = yaarena_create(0, 0);
+	assert(yaarena_index(arena) != 0);
+	int flags = YAMALLOCX_ARENA(yaarena_index(arena)) | YAMALLOCX_ZERO;
+	ptr = (unsigned char *)yamallocx(100, flags | YAMALLOCX_ALIGN(256));
+	assert(ptr != NULL && ((uintptr_t)ptr & 255) == 0 && ptr[99] == 0);
+	assert(yareallocx(ptr, 200, flags) == NULL);
+	// Arena memory is refused even without the arena flag, and its size
+	// is not recorded
+	for (int i = 0; i < 4; i++) {
+		unsigned char *small = (unsigned char *)yamallocx(24, flags);
+		assert(small != NULL && yasallocx(small, flags) == 0);
+		assert(yareallocx(small, 48, 0) == NULL);
+	}
+	assert(yareallocx(ptr, 200, 0) == NULL);
+	char *big = (char *)yamallocx(128 * 1024, flags);
+	assert(big != NULL && yareallocx(big + 100, 8, 0) == NULL);
+	yaarena_destroy(arena);
+	assert(yamallocx(100, flags) == NULL);
+	TestEnd();
+}
+
+void test_yamalloc_owns_1()
+{
+	TestStart("test_yamalloc_owns_1");
+	char *ptr = (char *)yamalloc(100);
+	assert(yamalloc_owns(ptr));
+#ifdef YAMALLOC_PAGE_MAP
+	static char foreign[64];
+	assert(!yamalloc_owns(foreign));
+	// Foreign pointers are rejected instead of corrupting the heap
+	yafree(foreign);
+	// The heap goes on past someone else's memory, without sharing pages
+	char *other = (char *)sbrk(64);
+	char *big = (char *)yamalloc(256 * 1024);
+	assert(other != (void *)-1 && big != NULL);
+	assert(!yamalloc_owns(other) && !yamalloc_owns(other + 63));
+	assert(yamalloc_owns(big) && yamalloc_owns(big + 256 * 1024 - 1));
+	yafree(big);
+#endif
+	yafree(ptr);
+	TestEnd();
+}
+
+void test_yaarena_1()
+{
+	TestStart("test_yaarena_1");
+	YaArena *arena = yaarena_create(1024, YAARENA_RETAIN);
+	assert(arena != NULL);
+	// Zero bytes from a fresh arena are not a failure
+	char *empty = (char *)yaarena_alloc(arena, 0);
+	assert(empty != NULL && yaarena_alloc(arena, 0) != empty);
+	yaarena_reset(arena);
+	char *first = (char *)yaarena_alloc(arena, 10);
+	assert(first != NULL);
+	char *second = (char *)yaarena_alloc(arena, 10);
+	assert(second == first + 16);
+	for (int i = 0; i < 1000; ++i) {
+		char *ptr = (char *)yaarena_alloc(arena, 24);
+		assert(ptr != NULL && ((uintptr_t)ptr & 7) == 0);
+		memset(ptr, i, 24);
+	}
+	char *big = (char *)yaarena_alloc(arena, 4096);
+	assert(big != NULL);
+	memset(big, 0, 4096);
+	yaarena_reset(arena);
+	char *again = (char *)yaarena_alloc(arena, 10);
+	assert(again != NULL);
+	yaarena_destroy(arena);
+	TestEnd();
+}
+
+static void test_yapool_init(void *obj, void *ctx)
+{
+	*(int *)obj = 42;
+	++*(int *)ctx;
+}
+
+static void test_yapool_fini(void *obj, void *ctx)
+{
+	(void)obj;
+	--*(int *)ctx;
+}
+
+void test_yapool_1()
+{
+	TestStart("test_yapool_1");
+	YaPool *pool = yapool_create(24, 64, 16);
+	assert(pool != NULL);
+	void *objs[100];
+	for (int i = 0; i < 100; ++i) {
+		objs[i] = yapool_alloc(pool);
+		assert(objs[i] != NULL);
+		assert(((uintptr_t)objs[i] & 63) == 0);
+		memset(objs[i], i, 24);
+	}
+	for (int i = 0; i < 100; ++i) {
+		assert(*(unsigned char *)objs[i] == i);
+		yapool_free(pool, objs[i]);
+	}
+	void *obj = yapool_alloc(pool);
+	assert(obj == objs[99]);
+	yapool_free(pool, obj);
+	yapool_destroy(pool);
+
+	int live = 0;
+	pool = yapool_create_ex(sizeof(int), 0, 8, test_yapool_init,
+				test_yapool_fini, &live);
+	int *num = (int *)yapool_alloc(pool);
+	// Objects are constructed when their chunk is carved, possibly in
+	// batches
+	assert(*num == 42 && live >= 1);
+	*num = 7;
+	yapool_free(pool, num);
+	num = (int *)yapool_alloc(pool);
+	assert(*num == 7);
+	yapool_free(pool, num);
+	yapool_destroy(pool);
+	assert(live == 0);
+
+	// More pools than magazines, used in turn
+	YaPool *pools[12];
+	for (int i = 0; i < 12; ++i) {
+		pools[i] = yapool_create(16 * (i + 1), 0, 4);
+		assert(pools[i] != NULL);
+	}
+	for (int round = 0; round < 50; ++round) {
+		for (int i = 0; i < 12; ++i) {
+			objs[i] = yapool_alloc(pools[i]);
+			assert(objs[i] != NULL);
+			memset(objs[i], i, 16 * (i + 1));
+		}
+		for (int i = 0; i < 12; ++i) {
+			assert(*(unsigned char *)objs[i] == i);
+			yapool_free(pools[i], objs[i]);
+		}
+	}
+	for (int i = 0; i < 12; ++i) {
+		yapool_destroy(pools[i]);
+	}
+
+	// Chunks that would wrap around are refused
+	assert(yapool_create(~(size_t)0 - 4, 0, 0) == NULL);
+	assert(yapool_create(64, 0, ~(size_t)0 / 32) == NULL);
+	assert(yapool_create(64, (size_t)1 << 62, 1) == NULL);
+	TestEnd();
+}
+
+void test_yamalloc_stats_1()
+{
+	TestStart("test_yamalloc_stats_1");
+	struct yamalloc_stats before;
+	struct yamalloc_stats stats;
+	yamalloc_stats(&before);
+	char *ptr = (char *)yamalloc(1000);
+	assert(ptr != NULL);
+	yamalloc_stats(&stats);
+	assert(stats.bytes_in_use >= before.bytes_in_use + 1000);
+	assert(stats.blocks_in_use == before.blocks_in_use + 1);
+	assert(stats.alloc_count == before.alloc_count + 1);
+	assert(stats.size_histogram[10] == before.size_histogram[10] + 1);
+	assert(stats.heap_size >= stats.bytes_in_use + stats.bytes_free);
+	assert(stats.largest_free_block <= stats.bytes_free);
+	yafree(ptr);
+	yamalloc_stats(&stats);
+	assert(stats.bytes_in_use == before.bytes_in_use);
+	assert(stats.free_count == before.free_count + 1);
+
+	FILE *out = tmpfile();
+	yamalloc_stats_print(out, YAMALLOC_STATS_JSON);
+	assert(ftell(out) > 0);
+	fclose(out);
+	TestEnd();
+}
+
+void test_yamalloc_latency_1()
+{
+	TestStart("test_yamalloc_latency_1");
+	struct yamalloc_latency before;
+	struct yamalloc_latency latency;
+	if (yamalloc_latency(&before) != 0) {
+		// Built without YAMALLOC_INSTRUMENT
+		assert(yamalloc_latency_print(stdout, YAMALLOC_STATS_TEXT) ==
+		       -1);
+		TestEnd();
+		return;
+	}
+	char *ptr = (char *)yamalloc(1000);
+	assert(ptr != NULL);
+	yafree(ptr);
+	yamalloc_latency(&latency);
+	assert(latency.count[YAMALLOC_PATH_CACHE_HIT] +
+		   latency.count[YAMALLOC_PATH_LIST_SEARCH] >
+	       before.count[YAMALLOC_PATH_CACHE_HIT] +
+		   before.count[YAMALLOC_PATH_LIST_SEARCH]);
+	assert(latency.count[YAMALLOC_PATH_COALESCE] >=
+	       before.count[YAMALLOC_PATH_COALESCE]);
+
+	FILE *out = tmpfile();
+	assert(yamalloc_latency_print(out, YAMALLOC_STATS_JSON) == 0);
+	assert(ftell(out) > 0);
+	fclose(out);
+	TestEnd();
+}
+
+struct test_heap_walk {
+	char *ptr;
+	int found;
+	int free;
+	size_t bytes;
+};
+
+static int test_heap_walk_visit(const struct yamalloc_block *block, void *ctx)
+{
+	struct test_heap_walk *walk = (struct test_heap_walk *)ctx;
+	char *start = (char *)block->address;
+
+	walk->bytes += block->size;
+	if (walk->ptr >= start && walk->ptr < start + block->size) {
+		walk->found++;
+		walk->free = block->free;
+	}
+	return 0;
+}
+
+static void *test_limit_cache = NULL;
+static int test_limit_calls = 0;
+
+static void test_limit_pressure(size_t footprint, void *ctx)
+{
+	assert(footprint > 0 && ctx == &test_limit_cache);
+	test_limit_calls++;
+	yafree(test_limit_cache);
+	test_limit_cache = NULL;
+}
+
+void test_yamalloc_limit_1()
+{
+	TestStart("test_yamalloc_limit_1");
+	size_t footprint = yamalloc_footprint();
+	assert(yamalloc_add_pressure_callback(test_limit_pressure,
+					      &test_limit_cache) == 0);
+	yamalloc_set_limit(footprint + 8 * 1024 * 1024);
+	assert(yamalloc_set_soft_limit(footprint + 16 * 1024 * 1024) == -1);
+	assert(yamalloc_set_soft_limit(footprint + 1024 * 1024) == 0);
+
+	// Crossing the soft watermark is relieved by the next allocation
+	test_limit_cache = yamalloc(3 * 1024 * 1024);
+	assert(test_limit_cache != NULL);
+	size_t peak = yamalloc_footprint();
+	assert(peak > footprint + 1024 * 1024 && test_limit_calls == 0);
+	void *ptr = yamalloc(300);
+	assert(ptr != NULL && test_limit_calls == 1);
+	assert(test_limit_cache == NULL && yamalloc_footprint() < peak);
+
+	// The hard watermark fails the growth, and only the growth
+	assert(yamalloc(16 * 1024 * 1024) == NULL);
+	assert(yamalloc_footprint() <= footprint + 8 * 1024 * 1024);
+	yafree(ptr);
+	ptr = yamalloc(300);
+	assert(ptr != NULL);
+	yafree(ptr);
+
+	// Growing while above the soft watermark does not relieve again
+	int calls = test_limit_calls;
+	void *above = yamalloc(2 * 1024 * 1024);
+	assert(above != NULL && yamalloc_footprint() > footprint + 1024 * 1024);
+	ptr = yamalloc(300);
+	assert(ptr != NULL && test_limit_calls == calls + 1);
+	void *more = yamalloc(2 * 1024 * 1024);
+	assert(more != NULL);
+	yafree(ptr);
+	ptr = yamalloc(300);
+	assert(ptr != NULL && test_limit_calls == calls + 1);
+	yafree(ptr);
+	yafree(more);
+	yafree(above);
+
+	yamalloc_set_limit(0);
+	assert(yamalloc_remove_pressure_callback(test_limit_pressure,
+						 &test_limit_cache) == 0);
+	assert(yamalloc_remove_pressure_callback(test_limit_pressure,
+						 &test_limit_cache) == -1);
+	ptr = yamalloc(16 * 1024 * 1024);
+	assert(ptr != NULL);
+	yafree(ptr);
+	TestEnd();
+}
+
+void test_yamalloc_heap_walk_1()
+{
+	TestStart("test_yamalloc_heap_walk_1");
+	struct test_heap_walk walk = {NULL, 0, 0, 0};
+	struct yamalloc_stats stats;
+	walk.ptr = (char *)yamalloc(1000);
+	assert(walk.ptr != NULL);
+	assert(yamalloc_heap_walk(test_heap_walk_visit, &walk) == 0);
+	assert(walk.found == 1);
+	assert(!walk.free);
+	yamalloc_stats(&stats);
+	assert(walk.bytes <= stats.heap_size);
+	yafree(walk.ptr);
+	walk.found = 0;
+	assert(yamalloc_heap_walk(test_heap_walk_visit, &walk) == 0);
+	assert(walk.found == 1);
+	assert(walk.free);
+	TestEnd();
+}
+
+void test_yamalloc_trace_1()
+{
+	TestStart("test_yamalloc_trace_1");
+	const char *path = "test_yamalloc_trace.bin";
+	struct yamalloc_trace_header header;
+	struct yamalloc_trace_record record[2];
+	if (yamalloc_trace_start(path) != 0) {
+		// Built without YAMALLOC_TRACE
+		assert(yamalloc_trace_stop() == -1);
+		TestEnd();
+		return;
+	}
+	char *ptr = (char *)yamalloc(100);
+	assert(ptr != NULL);
+	yafree(ptr);
+	assert(yamalloc_trace_stop() == 0);
+
+	FILE *in = fopen(path, "rb");
+	assert(in != NULL);
+	assert(fread(&header, sizeof(header), 1, in) == 1);
+	assert(memcmp(header.magic, YAMALLOC_TRACE_MAGIC,
+		      sizeof(YAMALLOC_TRACE_MAGIC)) == 0);
+	assert(header.record_size == sizeof(struct yamalloc_trace_record));
+	assert(fread(record, sizeof(record[0]), 2, in) == 2);
+	assert(record[0].op == YAMALLOC_TRACE_MALLOC);
+	assert(record[0].size == 100);
+	assert(record[0].id == (uint64_t)(uintptr_t)ptr);
+	assert(record[1].op == YAMALLOC_TRACE_FREE);
+	assert(record[1].id == record[0].id);
+	assert(record[1].timestamp >= record[0].timestamp);
+	fclose(in);
+	remove(path);
+	TestEnd();
+}
+
+static int test_profile_contains(const char *path, const char *text)
+{
+	char line[4096];
+	int found = 0;
+	FILE *in = fopen(path, "r");
+	assert(in != NULL);
+	while (!found && fgets(line, sizeof(line), in)) {
+		found = strstr(line, text) != NULL;
+	}
+	fclose(in);
+	return found;
+}
+
+void test_yamalloc_profile_1()
+{
+	TestStart("test_yamalloc_profile_1");
+	const char *path = "test_yamalloc_profile.heap";
+	if (yamalloc_profile_set_interval(1) != 0) {
+		// Built without YAMALLOC_PROFILE
+		assert(yamalloc_profile_dump(path) == -1);
+		TestEnd();
+		return;
+	}
+	// Threads pick up the new interval at their next sample
+	for (int i = 0; i < 64; i++) {
+		yafree(yamalloc(1024 * 1024));
+	}
+	char *ptr = (char *)yamalloc(1000);
+	assert(ptr != NULL);
+	assert(yamalloc_profile_dump(path) == 0);
+	assert(test_profile_contains(path, "heap profile:"));
+	assert(test_profile_contains(path, "1: 1000 [1: 1000] @"));
+	assert(test_profile_contains(path, "MAPPED_LIBRARIES:"));
+	// A failed realloc leaves the block, and its sample, to the caller
+	assert(yarealloc(ptr, (size_t)1 << 62) == NULL);
+	assert(yamalloc_profile_dump(path) == 0);
+	assert(test_profile_contains(path, "1: 1000 [1: 1000] @"));
+	yafree(ptr);
+	assert(yamalloc_profile_dump(path) == 0);
+	assert(!test_profile_contains(path, "1: 1000 [1: 1000] @"));
+	yamalloc_profile_set_interval(YAMALLOC_PROFILE_DEFAULT_INTERVAL);
+	remove(path);
+	TestEnd();
+}
+
+struct test_heap_node {
+	uint64_t next;
+	int value;
+};
+
+// Sums the list hanging from the root, checking the values along the way
+static int test_heap_list(YaHeap *heap, int count)
+{
+	struct test_heap_node *node =
+	    (struct test_heap_node *)yamalloc_heap_root(heap);
+	int n = 0;
+
+	while (node) {
+		if (node->value != n++) {
+			return 0;
+		}
+		node = (struct test_heap_node *)yamalloc_heap_pointer(
+		    heap, node->next);
+	}
+	return n == count;
+}
+
+void test_yamalloc_heap_1()
+{
+	TestStart("test_yamalloc_heap_1");
+	const char *path = "test_yamalloc_heap.bin";
+	struct test_heap_node *prev = NULL;
+	void *junk[32];
+	remove(path);
+	YaHeap *heap = yamalloc_heap_open(path, 64 * 1024);
+	assert(heap != NULL);
+	if (!heap) {
+		TestEnd();
+		return;
+	}
+	// Another opening of the same file is refused while heap is open
+	assert(yamalloc_heap_open(path, 0) == NULL);
+	for (int i = 0; i < 100; i++) {
+		struct test_heap_node *node =
+		    (struct test_heap_node *)yamalloc_heap_alloc(
+			heap, sizeof(struct test_heap_node));
+		junk[i % 32] = yamalloc_heap_alloc(heap, 24 + i);
+		assert(node != NULL);
+		node->next = 0;
+		node->value = i;
+		if (prev) {
+			prev->next = yamalloc_heap_offset(heap, node);
+		} else {
+			yamalloc_heap_set_root(heap, node);
+		}
+		prev = node;
+		if (i % 32 == 31) {
+			for (int j = 0; j < 32; j++) {
+				yamalloc_heap_free(heap, junk[j]);
+			}
+		}
+	}
+	for (int i = 0; i < 4; i++) {
+		yamalloc_heap_free(heap, junk[i]);
+	}
+	assert(yamalloc_heap_alloc(heap, 1024 * 1024) == NULL);
+	assert(yamalloc_heap_close(heap) == 0);
+
+	// A process that dies with the heap open leaves it to be recovered
+	pid_t pid = fork();
+	if (pid == 0) {
+		heap = yamalloc_heap_open(path, 0);
+		if (!heap || !test_heap_list(heap, 100) ||
+		    !yamalloc_heap_alloc(heap, 100)) {
+			_exit(1);
+		}
+		yamalloc_heap_free(heap, yamalloc_heap_alloc(heap, 200));
+		yamalloc_heap_flush(heap);
+		_exit(0);
+	}
+	int status = 1;
+	waitpid(pid, &status, 0);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	heap = yamalloc_heap_open(path, 0);
+	assert(heap != NULL);
+	if (!heap) {
+		TestEnd();
+		return;
+	}
+	assert(test_heap_list(heap, 100));
+	// Once the list is freed, the free blocks coalesce back
+	struct test_heap_node *node =
+	    (struct test_heap_node *)yamalloc_heap_root(heap);
+	while (node) {
+		struct test_heap_node *next =
+		    (struct test_heap_node *)yamalloc_heap_pointer(heap,
+								   node->next);
+		yamalloc_heap_free(heap, node);
+		node = next;
+	}
+	yamalloc_heap_set_root(heap, NULL);
+	assert(yamalloc_heap_alloc(heap, 60 * 1024) != NULL);
+	assert(yamalloc_heap_close(heap) == 0);
+	remove(path);
+	TestEnd();
+}
+
+void test_yamalloc_shm_1()
+{
+	TestStart("test_yamalloc_shm_1");
+	const char *name = "/yamalloc_test_shm";
+	int status;
+	yamalloc_shm_unlink(name);
+	YaHeap *heap = yamalloc_shm_create(name, 64 * 1024);
+	assert(heap != NULL);
+	if (!heap) {
+		TestEnd();
+		return;
+	}
+	assert(yamalloc_shm_create(name, 64 * 1024) == NULL);
+	uint64_t *mailbox =
+	    (uint64_t *)yamalloc_heap_alloc(heap, 2 * sizeof(uint64_t));
+	mailbox[0] = mailbox[1] = 0;
+	yamalloc_heap_set_root(heap, mailbox);
+
+	// Each worker attaches on its own and leaves a message by offset
+	for (int i = 0; i < 2; i++) {
+		if (fork() == 0) {
+			YaHeap *shm = yamalloc_shm_attach(name);
+			uint64_t *box;
+			char *msg = NULL;
+			if (!shm) {
+				_exit(1);
+			}
+			for (int j = 0; j < 1000; j++) {
+				yamalloc_heap_free(shm, msg);
+				msg = (char *)yamalloc_heap_alloc(shm, 32 + j);
+			}
+			if (!msg) {
+				_exit(1);
+			}
+			snprintf(msg, 32, "worker %d", i);
+			box = (uint64_t *)yamalloc_heap_root(shm);
+			box[i] = yamalloc_heap_offset(shm, msg);
+			yamalloc_heap_close(shm);
+			_exit(0);
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		status = 1;
+		wait(&status);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	for (int i = 0; i < 2; i++) {
+		char expected[32];
+		char *msg = (char *)yamalloc_heap_pointer(heap, mailbox[i]);
+		snprintf(expected, sizeof(expected), "worker %d", i);
+		assert(msg != NULL && strcmp(msg, expected) == 0);
+		yamalloc_heap_free(heap, msg);
+	}
+	yamalloc_heap_free(heap, mailbox);
+	assert(yamalloc_heap_alloc(heap, 60 * 1024) != NULL);
+	assert(yamalloc_heap_close(heap) == 0);
+	assert(yamalloc_shm_unlink(name) == 0);
+	assert(yamalloc_shm_attach(name) == NULL);
+
+#ifdef __linux__
+	// A worker dies holding the lock: the next locker recovers the heap,
+	// unless the worker left the block headers corrupted
+	heap = yamalloc_shm_create(name, 64 * 1024);
+	assert(heap != NULL);
+	char *block = (char *)yamalloc_heap_alloc(heap, 64);
+	uint64_t offset = yamalloc_heap_offset(heap, block);
+	for (int corrupt = 0; corrupt < 2; corrupt++) {
+		if (fork() == 0) {
+			YaHeap *shm = yamalloc_shm_attach(name);
+			if (!shm) {
+				_exit(1);
+			}
+			pthread_mutex_lock(&((YaHeapHeader *)shm->base)->lock);
+			if (corrupt) {
+				memset(shm->base + offset - sizeof(uint64_t),
+				       0xFF, sizeof(uint64_t));
+			}
+			_exit(0);
+		}
+		status = 1;
+		wait(&status);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		char *next = (char *)yamalloc_heap_alloc(heap, 64);
+		assert(corrupt ? next == NULL : next != NULL);
+	}
+	// The heap stays unusable, and frees are ignored
+	yamalloc_heap_free(heap, block);
+	assert(yamalloc_heap_alloc(heap, 64) == NULL);
+	yamalloc_heap_close(heap);
+	yamalloc_shm_unlink(name);
+#endif
+	TestEnd();
+}
+
 // ===== TEST RUNNER =====
 void test_1()
 {
@@ -255,6 +954,25 @@ void test_3()
 	test_yafree_3();
 }
 
+void test_4()
+{
+	test_yamalloc_4();
+	test_yafree_sized_1();
+	test_yaaligned_alloc_1();
+	test_yamallocx_1();
+	test_yamalloc_owns_1();
+	test_yaarena_1();
+	test_yapool_1();
+	test_yamalloc_stats_1();
+	test_yamalloc_latency_1();
+	test_yamalloc_limit_1();
+	test_yamalloc_heap_walk_1();
+	test_yamalloc_trace_1();
+	test_yamalloc_profile_1();
+	test_yamalloc_heap_1();
+	test_yamalloc_shm_1();
+}
+
 int main()
 {
 	num_tests = 0;
@@ -264,6 +982,7 @@ int main()
 	test_1();
 	test_2();
 	test_3();
+	test_4();
 
 	printf("Total tests passed: %d\n", tests_passed);
 	done = 1;
@@ -0,0 +1,217 @@
+#include "yamalloc.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#define RESET "\033[0m"
+#define RED "\033[31m"	 /* Red */
+#define GREEN "\033[32m" /* Green */
+
+// redefine assert to set a boolean flag
+#ifdef assert
+#undef assert
+#endif
+#define assert(x) (rslt = rslt && (x))
+
+// main result return code used by redefined assert
+static int rslt;
+
+// test suite main variables
+static int num_tests;
+static int tests_passed;
+
+static void TestStart(const char *name)
+{
+	num_tests++;
+	rslt = 1;
+	printf("-- Testing %s ... ", name);
+}
+
+static void TestEnd()
+{
+	if (rslt)
+		tests_passed++;
+	printf("%s\n", rslt ? GREEN "success" RESET : RED "fail" RESET);
+}
+
+// An element type more aligned than the blocks of yamalloc()
+struct alignas(64) CacheLine {
+	std::uint64_t words[8];
+};
+
+static bool is_aligned(const void *ptr, std::size_t alignment)
+{
+	return (reinterpret_cast<std::uintptr_t>(ptr) & (alignment - 1)) == 0;
+}
+
+static std::size_t blocks_in_use()
+{
+	struct yamalloc_stats stats;
+
+	yamalloc_stats(&stats);
+	return stats.blocks_in_use;
+}
+
+// ===== TESTS =====
+static void test_allocator_1()
+{
+	TestStart("test_allocator_1");
+	std::size_t blocks = blocks_in_use();
+	{
+		std::vector<int, ya::allocator<int>> vec;
+		for (int i = 0; i < 1000; i++) {
+			vec.push_back(i);
+		}
+		assert(blocks_in_use() > blocks);
+		assert(yamalloc_owns(vec.data()));
+		for (int i = 0; i < 1000; i++) {
+			assert(vec[i] == i);
+		}
+
+		// The map rebinds the allocator to its nodes and buckets
+		std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+				   ya::allocator<std::pair<const int, int>>>
+		    map;
+		for (int i = 0; i < 1000; i++) {
+			map[i] = 2 * i;
+		}
+		for (int i = 0; i < 1000; i += 2) {
+			map.erase(i);
+		}
+		assert(map.size() == 500);
+		for (int i = 1; i < 1000; i += 2) {
+			assert(map.at(i) == 2 * i);
+		}
+		assert(ya::allocator<int>() == ya::allocator<long>());
+	}
+	// Every block went back through yafree_sized()
+	assert(blocks_in_use() == blocks);
+	TestEnd();
+}
+
+static void test_allocator_2()
+{
+	TestStart("test_allocator_2");
+	std::size_t blocks = blocks_in_use();
+	{
+		std::vector<CacheLine, ya::allocator<CacheLine>> vec;
+		for (std::uint64_t i = 0; i < 100; i++) {
+			vec.push_back(CacheLine{{i}});
+			assert(is_aligned(vec.data(), alignof(CacheLine)));
+		}
+		for (std::uint64_t i = 0; i < 100; i++) {
+			assert(vec[i].words[0] == i);
+		}
+	}
+	assert(blocks_in_use() == blocks);
+	TestEnd();
+}
+
+static void test_global_resource_1()
+{
+	TestStart("test_global_resource_1");
+	std::size_t blocks = blocks_in_use();
+	{
+		std::pmr::vector<int> vec(ya::global_resource());
+		std::pmr::vector<CacheLine> lines(ya::global_resource());
+		std::pmr::unordered_map<int, int> map(ya::global_resource());
+
+		for (int i = 0; i < 1000; i++) {
+			vec.push_back(i);
+			map[i] = i;
+		}
+		for (std::uint64_t i = 0; i < 100; i++) {
+			lines.push_back(CacheLine{{i}});
+		}
+		assert(yamalloc_owns(vec.data()));
+		assert(is_aligned(lines.data(), alignof(CacheLine)));
+		assert(vec[999] == 999 && map.at(999) == 999);
+		assert(lines[99].words[0] == 99);
+		assert(ya::global_resource()->is_equal(ya::heap_resource()));
+	}
+	assert(blocks_in_use() == blocks);
+	TestEnd();
+}
+
+static void test_arena_resource_1()
+{
+	TestStart("test_arena_resource_1");
+	std::size_t blocks = blocks_in_use();
+	{
+		ya::arena_resource arena;
+		std::pmr::vector<int> vec(&arena);
+		std::pmr::vector<CacheLine> lines(&arena);
+
+		for (int i = 0; i < 1000; i++) {
+			vec.push_back(i);
+		}
+		for (std::uint64_t i = 0; i < 100; i++) {
+			lines.push_back(CacheLine{{i}});
+			assert(is_aligned(lines.data(), alignof(CacheLine)));
+		}
+		assert(vec[999] == 999 && lines[99].words[0] == 99);
+		assert(!arena.is_equal(*ya::global_resource()));
+
+		std::pmr::unordered_map<int, int> map(&arena);
+		for (int i = 0; i < 1000; i++) {
+			map[i] = i;
+		}
+		assert(map.at(500) == 500);
+	}
+	// Destroying the arena gives its chunks back
+	assert(blocks_in_use() == blocks);
+	TestEnd();
+}
+
+static void test_pool_resource_1()
+{
+	TestStart("test_pool_resource_1");
+	std::size_t blocks = blocks_in_use();
+	{
+		// The nodes come from the pool, the bucket array from upstream
+		ya::pool_resource pool(64);
+		std::pmr::list<int> list(&pool);
+		std::pmr::unordered_map<int, int> map(&pool);
+
+		for (int i = 0; i < 1000; i++) {
+			list.push_back(i);
+			map[i] = i;
+		}
+		int expected = 0;
+		for (int value : list) {
+			assert(value == expected++);
+		}
+		assert(map.size() == 1000 && map.at(999) == 999);
+		list.clear();
+		map.clear();
+		assert(pool.upstream_resource() == ya::global_resource());
+
+		// Over-aligned objects do not fit the pool
+		std::pmr::vector<CacheLine> lines(&pool);
+		for (std::uint64_t i = 0; i < 10; i++) {
+			lines.push_back(CacheLine{{i}});
+			assert(is_aligned(lines.data(), alignof(CacheLine)));
+		}
+		assert(lines[9].words[0] == 9);
+	}
+	assert(blocks_in_use() == blocks);
+	TestEnd();
+}
+
+int main()
+{
+	num_tests = 0;
+	tests_passed = 0;
+
+	test_allocator_1();
+	test_allocator_2();
+	test_global_resource_1();
+	test_arena_resource_1();
+	test_pool_resource_1();
+
+	printf("Total tests passed: %d\n", tests_passed);
+	return !(tests_passed == num_tests);
+}